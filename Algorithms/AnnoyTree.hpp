@@ -7,10 +7,14 @@
 #include <memory>
 #include <queue>
 #include <stack>
+#include <algorithm>
 #include <stdexcept>
+#include <numeric>
 
 #include "BinaryTree.hpp"
 #include "AnnoyTreeNodeData.hpp"
+#include "Distances.hpp"
+#include "VectorStore.hpp"
 
 // How many times we should check if vec[idx1] != vec[idx2] before giving up
 #define NUM_RANDOM_VECTORS_TO_TRY (5)
@@ -24,35 +28,69 @@ public:
     float threshold;
     int sufficient_bucket_threshold;
     int max_depth;
+    VectorSpace space;
+    std::shared_ptr<const VectorStore<TypeName>> store;
 
-    AnnoyTree(const std::vector<std::pair<TypeName, std::vector<float>>>& data, 
+    // Builds the tree over every row of the store
+    AnnoyTree(std::shared_ptr<const VectorStore<TypeName>> store, 
+              const VectorSpace& space,
               float threshold, 
               int sufficient_bucket_threshold, 
               int max_depth ) : 
+              vector_len(space.dimension),
               threshold(threshold),
               sufficient_bucket_threshold(sufficient_bucket_threshold),
-              max_depth(max_depth) {
-        if (!data.empty()) {
-            from_data(data);
+              max_depth(max_depth),
+              space(space),
+              store(std::move(store)) {
+        if (!this->store->empty()) {
+            std::vector<size_t> ids(this->store->size());
+            std::iota(ids.begin(), ids.end(), 0);
+            from_data(std::move(ids));
         }
     }
 
-    // Method to find the node's list that should contain the given vector
-    std::vector<std::pair<TypeName, std::vector<float>>> findContainingList(const std::vector<float>& vec) const {
-        //std::shared_ptr<TreeNode<AnnoyTreeNodeData<vector_len, TypeName>>> node = tree.root;
-        
-        std::vector<std::pair<TypeName, std::vector<float>>> results;
+    // Reads a tree written by save()
+    AnnoyTree(std::shared_ptr<const VectorStore<TypeName>> store,
+              const VectorSpace& space,
+              float threshold,
+              int sufficient_bucket_threshold,
+              int max_depth,
+              SnapshotReader& snapshot) :
+              vector_len(space.dimension),
+              threshold(threshold),
+              sufficient_bucket_threshold(sufficient_bucket_threshold),
+              max_depth(max_depth),
+              space(space),
+              store(std::move(store)) {
+        if (snapshot.read<uint8_t>()) {
+            tree.root = loadNode(snapshot);
+        }
+    }
+
+    // The nodes in preorder: which children each has, then a leaf's row ids or a
+    // split's two vectors
+    void save(SnapshotWriter& snapshot) const {
+        snapshot.write<uint8_t>(tree.root != nullptr);
+        if (tree.root) {
+            saveNode(snapshot, tree.root);
+        }
+    }
+
+    // Method to find the leaves that should contain the given vector
+    std::vector<const AnnoyTreeNodeData<TypeName>*> findContainingLeaves(const std::vector<float>& vec) const {
+        std::vector<const AnnoyTreeNodeData<TypeName>*> results;
 
         std::queue<std::shared_ptr<TreeNode<AnnoyTreeNodeData<TypeName>>>> unprocessed_nodes;
         unprocessed_nodes.push(tree.root);
 
         while (!unprocessed_nodes.empty()) {
-            auto& node = unprocessed_nodes.front();
+            auto node = unprocessed_nodes.front();
             unprocessed_nodes.pop();
             // Assuming leaf nodes or the logic to determine if a node is a leaf
             // For simplicity, we check if the node has no children
             if (node->left == nullptr && node->right == nullptr) {
-                results.insert(results.end(), node->data.pairList.begin(), node->data.pairList.end());
+                results.push_back(&node->data);
             } else {
                 float distanceToVec1 = calculateSquaredDistance(vec, node->data.vec1);
                 float distanceToVec2 = calculateSquaredDistance(vec, node->data.vec2);
@@ -69,6 +107,62 @@ public:
         return results;
     }
 
+    // Adds store row id to the leaf its vector routes to. Leaves aren't split again,
+    // so a tree that takes many inserts should eventually be rebuilt.
+    void insert(size_t id) {
+        if (!tree.root) {
+            tree.root = std::make_shared<TreeNode<AnnoyTreeNodeData<TypeName>>>();
+            tree.root->data.vector_len = space.dimension;
+        }
+        std::vector<float> scratch;
+        leafFor(store->row(id, scratch))->addData(id);
+    }
+
+    // Drops store row id from its leaf
+    void remove(size_t id) {
+        auto* leaf = leafHolding(id);
+        if (leaf) {
+            auto it = std::find(leaf->ids.begin(), leaf->ids.end(), id);
+            *it = leaf->ids.back();
+            leaf->ids.pop_back();
+        }
+    }
+
+    // The store moved row from to id to; the leaf holding it follows
+    void renumber(size_t from, size_t to) {
+        auto* leaf = leafHolding(from);
+        if (leaf) {
+            *std::find(leaf->ids.begin(), leaf->ids.end(), from) = to;
+        }
+    }
+
+    // Method to find the node's list that should contain the given vector
+    std::vector<std::pair<TypeName, std::vector<float>>> findContainingList(const std::vector<float>& vec) const {
+        std::vector<std::pair<TypeName, std::vector<float>>> results;
+        for (const auto* leaf : findContainingLeaves(vec)) {
+            appendLeaf(*leaf, results);
+        }
+        return results;
+    }
+
+    // Every leaf's rows take their new ids, row id becoming newIds[id]
+    void permute(const std::vector<size_t>& newIds) {
+        if (!tree.root) {
+            return;
+        }
+        std::stack<std::shared_ptr<TreeNode<AnnoyTreeNodeData<TypeName>>>> unvisited;
+        unvisited.push(tree.root);
+        while (!unvisited.empty()) {
+            auto node = unvisited.top();
+            unvisited.pop();
+            for (size_t& id : node->data.ids) {
+                id = newIds[id];
+            }
+            if (node->left) unvisited.push(node->left);
+            if (node->right) unvisited.push(node->right);
+        }
+    }
+
     // Method to reconstruct the dataset from the BinaryTree
     std::vector<std::pair<TypeName, std::vector<float>>> reconstructData() const {
         std::vector<std::pair<TypeName, std::vector<float>>> dataset;
@@ -76,19 +170,103 @@ public:
         return dataset;
     }
 
-    const float calculateSquaredDistance(const std::vector<float>& vec1, const std::vector<float>& vec2) const {
-        float squaredDistance = 0.0f;
-        for (size_t i = 0; i < vec1.size(); ++i) {
-            squaredDistance += (vec1[i] - vec2[i]) * (vec1[i] - vec2[i]);
-        }
-        return squaredDistance;
+    // Splits are geometric whatever the search metric, so the tree always uses L2
+    float calculateSquaredDistance(const std::vector<float>& vec1, const std::vector<float>& vec2) const {
+        return space.kernels.squaredL2(vec1.data(), vec2.data(), space.dimension);
+    }
+
+    float calculateSquaredDistance(size_t id, const std::vector<float>& vec) const {
+        std::vector<float> scratch;
+        return space.kernels.squaredL2(store->row(id, scratch), vec.data(), space.dimension);
     }
 
 private:
+    using TreeNodePointer = std::shared_ptr<TreeNode<AnnoyTreeNodeData<TypeName>>>;
+
+    void saveNode(SnapshotWriter& snapshot, const TreeNodePointer& node) const {
+        snapshot.write<uint8_t>((node->left ? 1 : 0) | (node->right ? 2 : 0));
+        if (!node->left && !node->right) {
+            snapshot.writeArray(std::vector<uint64_t>(node->data.ids.begin(), node->data.ids.end()));
+            return;
+        }
+        snapshot.writeArray(node->data.vec1);
+        snapshot.writeArray(node->data.vec2);
+        if (node->left) saveNode(snapshot, node->left);
+        if (node->right) saveNode(snapshot, node->right);
+    }
+
+    TreeNodePointer loadNode(SnapshotReader& snapshot) const {
+        auto node = std::make_shared<TreeNode<AnnoyTreeNodeData<TypeName>>>();
+        uint8_t children = snapshot.read<uint8_t>();
+        if (children == 0) {
+            std::vector<uint64_t> ids = snapshot.readVector<uint64_t>();
+            node->data.vector_len = space.dimension;
+            node->data.ids.assign(ids.begin(), ids.end());
+            return node;
+        }
+        node->data.vec1 = snapshot.readVector<float>();
+        node->data.vec2 = snapshot.readVector<float>();
+        if (children & 1) node->left = loadNode(snapshot);
+        if (children & 2) node->right = loadNode(snapshot);
+        return node;
+    }
+
+    // The one leaf a vector reaches taking the split the build would have taken
+    AnnoyTreeNodeData<TypeName>* leafFor(const float* vec) const {
+        auto node = tree.root;
+        while (node->left || node->right) {
+            float distanceToVec1 = space.kernels.squaredL2(vec, node->data.vec1.data(), space.dimension);
+            float distanceToVec2 = space.kernels.squaredL2(vec, node->data.vec2.data(), space.dimension);
+            auto next = distanceToVec1 < distanceToVec2 ? node->left : node->right;
+            node = next ? next : (node->left ? node->left : node->right);
+        }
+        return &node->data;
+    }
+
+    // The leaf holding store row id, found by routing the row's vector. Rows from a
+    // random split don't follow the routing, so fall back to walking every leaf.
+    AnnoyTreeNodeData<TypeName>* leafHolding(size_t id) const {
+        if (!tree.root) {
+            return nullptr;
+        }
+        std::vector<float> scratch;
+        auto* leaf = leafFor(store->row(id, scratch));
+        if (std::find(leaf->ids.begin(), leaf->ids.end(), id) != leaf->ids.end()) {
+            return leaf;
+        }
+        std::stack<std::shared_ptr<TreeNode<AnnoyTreeNodeData<TypeName>>>> unvisited;
+        unvisited.push(tree.root);
+        while (!unvisited.empty()) {
+            auto node = unvisited.top();
+            unvisited.pop();
+            if (!node->left && !node->right) {
+                if (std::find(node->data.ids.begin(), node->data.ids.end(), id) != node->data.ids.end()) {
+                    return &node->data;
+                }
+                continue;
+            }
+            if (node->left) unvisited.push(node->left);
+            if (node->right) unvisited.push(node->right);
+        }
+        return nullptr;
+    }
+
+    void appendLeaf(const AnnoyTreeNodeData<TypeName>& leaf, std::vector<std::pair<TypeName, std::vector<float>>>& dataset) const {
+        for (size_t id : leaf.ids) {
+            dataset.push_back(store->entry(id));
+        }
+    }
+
+    // A leaf only records which store rows it holds
+    void fillLeaf(AnnoyTreeNodeData<TypeName>& leaf, std::vector<size_t>& items) const {
+        leaf.vector_len = space.dimension;
+        leaf.ids = std::move(items);
+    }
+
     void reconstructDataHelper(const std::shared_ptr<TreeNode<AnnoyTreeNodeData<TypeName>>>& node, std::vector<std::pair<TypeName, std::vector<float>>>& dataset) const {
         if (!node) return;
         if (!node->left && !node->right) {
-            dataset.insert(dataset.end(), node->data.pairList.begin(), node->data.pairList.end());
+            appendLeaf(node->data, dataset);
         } else {
             reconstructDataHelper(node->left, dataset);
             reconstructDataHelper(node->right, dataset);
@@ -96,12 +274,12 @@ private:
     }
     /// @brief 
     /// @param data 
-    void from_data(const std::vector<std::pair<TypeName, std::vector<float>>>& data) {
-        std::stack<std::pair<std::shared_ptr<TreeNode<AnnoyTreeNodeData<TypeName>>>, std::vector<std::pair<TypeName, std::vector<float>>>>> tasks;
+    void from_data(std::vector<size_t> data) {
+        std::stack<std::pair<std::shared_ptr<TreeNode<AnnoyTreeNodeData<TypeName>>>, std::vector<size_t>>> tasks;
         std::stack<int> depths;
 
         tree.root = std::make_shared<TreeNode<AnnoyTreeNodeData<TypeName>>>();
-        tasks.push({tree.root, data}); // No move here; data is a const reference
+        tasks.push({tree.root, std::move(data)});
 
         depths.push(0);
 
@@ -112,15 +290,24 @@ private:
             int depth = depths.top();
             depths.pop();
 
-            if (currentData.size() <= sufficient_bucket_threshold || depth > max_depth) {
-                // Assuming TreeNode has a way to store or otherwise handle the currentData directly
-                node->data.pairList.assign(std::make_move_iterator(currentData.begin()), std::make_move_iterator(currentData.end()));
+            if (currentData.size() <= static_cast<size_t>(sufficient_bucket_threshold) || depth > max_depth) {
+                fillLeaf(node->data, currentData);
                 continue;
             }
 
             auto selectedVectors = selectRandomVectors(currentData);
             auto [leftData, rightData] = splitData(std::move(currentData), selectedVectors);
 
+            // A split that sends everything one way can't be navigated, keep it as a leaf
+            if (leftData.empty() || rightData.empty()) {
+                fillLeaf(node->data, leftData.empty() ? rightData : leftData);
+                continue;
+            }
+
+            // Queries are routed by comparing against the two split vectors
+            node->data.vec1 = std::move(selectedVectors.first);
+            node->data.vec2 = std::move(selectedVectors.second);
+
             // Now, leftData and rightData are moved into the tasks, not copied
             if (!leftData.empty()) {
                 node->left = std::make_shared<TreeNode<AnnoyTreeNodeData<TypeName>>>();
@@ -135,7 +322,7 @@ private:
         }
     }
 
-    std::pair<std::vector<float>, std::vector<float>> selectRandomVectors(const std::vector<std::pair<TypeName, std::vector<float>>>& data) {
+    std::pair<std::vector<float>, std::vector<float>> selectRandomVectors(const std::vector<size_t>& data) {
         std::random_device rd;
         std::mt19937 gen(rd());
         std::uniform_int_distribution<> dis(0, data.size() - 1);
@@ -145,14 +332,14 @@ private:
             idx2 = dis(gen);
         }
 
-        return {data[idx1].second, data[idx2].second};
+        return {store->vectors().decode(data[idx1]), store->vectors().decode(data[idx2])};
     }
 
     // Assumes the original data can be consumed/modified, thus passed by value
     // Assumes <random> is included
-    std::pair<std::vector<std::pair<TypeName, std::vector<float>>>, std::vector<std::pair<TypeName, std::vector<float>>>>
-    splitData(std::vector<std::pair<TypeName, std::vector<float>>> data, const std::pair<std::vector<float>, std::vector<float>>& vectors) {
-        std::vector<std::pair<TypeName, std::vector<float>>> leftData, rightData;
+    std::pair<std::vector<size_t>, std::vector<size_t>>
+    splitData(std::vector<size_t> data, const std::pair<std::vector<float>, std::vector<float>>& vectors) {
+        std::vector<size_t> leftData, rightData;
     
         if (vectors.first == vectors.second) { // Check if vec1 and vec2 are the same
             std::random_device rd;
@@ -169,8 +356,8 @@ private:
         } else {
             // Original splitting logic based on distance
             for (auto& item : data) {
-                float distanceToFirstSquared = calculateSquaredDistance(item.second, vectors.first);
-                float distanceToSecondSquared = calculateSquaredDistance(item.second, vectors.second);
+                float distanceToFirstSquared = calculateSquaredDistance(item, vectors.first);
+                float distanceToSecondSquared = calculateSquaredDistance(item, vectors.second);
 
                 if (distanceToFirstSquared < distanceToSecondSquared) {
                     leftData.push_back(std::move(item));
@@ -8,6 +8,7 @@
 #include <future>
 #include <iterator>
 #include <execution>
+#include <atomic>
 
 #include "VectorSearchAlgorithm.hpp"
 #include "AnnoyTree.hpp"
@@ -24,9 +25,15 @@ public:
     int n_trees;
     bool build_parallel;
     int vector_len;
-
-    // Constructor that takes dataset and builds each tree in the forest
-    AnnoyTreeForest(const std::vector<std::pair<TypeName, std::vector<float>>>& data,
+    VectorSpace space;
+    std::shared_ptr<const VectorStore<TypeName>> store;
+    // Leaf distance evaluations cut short by query, for tuning
+    mutable std::atomic<uint64_t> abandonedEvaluations{0};
+
+    // Constructor that builds each tree in the forest over the rows of the store;
+    // the trees only hold row ids, so every tree shares the one copy of the rows
+    AnnoyTreeForest(std::shared_ptr<const VectorStore<TypeName>> data,
+                    const VectorSpace& space,
                     int vector_len, 
                     float threshold,
                     int sufficient_bucket_threshold,
@@ -37,14 +44,16 @@ public:
                                                    max_depth(max_depth),
                                                    n_trees(n_trees),
                                                    build_parallel(build_parallel),
-                                                   vector_len(vector_len) {
+                                                   vector_len(vector_len),
+                                                   space(space),
+                                                   store(data) {
         trees.reserve(n_trees);
         if (build_parallel) {
             // Build trees in parallel
             std::vector<std::future<void>> futures;
             for (int i = 0; i < n_trees; ++i) {
-                futures.push_back(std::async(std::launch::async, [this, &data, threshold, sufficient_bucket_threshold, max_depth]() {
-                    auto tree = std::make_unique<AnnoyTree<TypeName>>(data, threshold, sufficient_bucket_threshold, max_depth);
+                futures.push_back(std::async(std::launch::async, [this, &data, &space, threshold, sufficient_bucket_threshold, max_depth]() {
+                    auto tree = std::make_unique<AnnoyTree<TypeName>>(data, space, threshold, sufficient_bucket_threshold, max_depth);
                     trees.push_back(std::move(tree));
                 }));
             }
@@ -55,45 +64,117 @@ public:
         } else {
             // Build trees sequentially
             for (int i = 0; i < n_trees; ++i) {
-                trees.push_back(std::make_unique<AnnoyTree<TypeName>>(data, threshold, sufficient_bucket_threshold, max_depth ));
+                trees.push_back(std::make_unique<AnnoyTree<TypeName>>(data, space, threshold, sufficient_bucket_threshold, max_depth ));
             }
         }
     }
 
-    std::vector<std::pair<TypeName, std::vector<float>>> searchClosest (const std::vector<float>& target, const int ef = 1) override {
-        // Perform the search to get a vector of shared pointers to nodes
-        auto nodes = query(target, ef);
-    
-        // Prepare the result vector with the appropriate format
-        std::vector<std::pair<TypeName, std::vector<float>>> results;
-        results.reserve(nodes.size());
-
-        // Transform each node into the required format: a pair of T (node value) and vector<float> (node vector)
-        for (const auto& node : nodes) {
-            // Calculate the distance for each node as per the new requirements
-            // The result should include both the distance and the node vector, but based on the given interface
-            // we should only return the node's value (of type T) and its vector.
-            results.emplace_back(std::get<0>(node), std::get<2>(node));
+    // Reads a forest written by save(); the section tag has already been read
+    AnnoyTreeForest(std::shared_ptr<const VectorStore<TypeName>> data, SnapshotReader& snapshot) : store(data) {
+        threshold = snapshot.read<float>();
+        sufficient_bucket_threshold = snapshot.read<int32_t>();
+        max_depth = snapshot.read<int32_t>();
+        n_trees = snapshot.read<int32_t>();
+        build_parallel = snapshot.read<uint8_t>() != 0;
+        vector_len = snapshot.read<int32_t>();
+        space = VectorSpace(snapshot);
+        trees.reserve(n_trees);
+        for (int i = 0; i < n_trees; ++i) {
+            trees.push_back(std::make_unique<AnnoyTree<TypeName>>(data, space, threshold, sufficient_bucket_threshold, max_depth, snapshot));
+        }
+    }
+
+    void save(SnapshotWriter& snapshot) const override {
+        snapshot.section(SnapshotSection::Annoy);
+        snapshot.write<float>(threshold);
+        snapshot.write<int32_t>(sufficient_bucket_threshold);
+        snapshot.write<int32_t>(max_depth);
+        snapshot.write<int32_t>(static_cast<int32_t>(trees.size()));
+        snapshot.write<uint8_t>(build_parallel);
+        snapshot.write<int32_t>(vector_len);
+        space.save(snapshot);
+        for (const auto& tree : trees) {
+            tree->save(snapshot);
+        }
+    }
+
+    void addRow(size_t id) override {
+        for (auto& tree : trees) {
+            tree->insert(id);
         }
+    }
 
-        return results; 
+    // Every tree drops the row and renumbers the store's last row to id
+    void removeRow(size_t id) override {
+        size_t last = store->size() - 1;
+        for (auto& tree : trees) {
+            tree->remove(id);
+            if (id != last) {
+                tree->renumber(last, id);
+            }
+        }
+    }
+
+    void permuteRows(const std::vector<size_t>& newIds) override {
+        for (auto& tree : trees) {
+            tree->permute(newIds);
+        }
+    }
+
+    std::vector<std::pair<TypeName, std::vector<float>>> searchClosest (const std::vector<float>& target, const int ef = 1) override {
+        // Each item's key and vector, from the store
+        return store->entries(searchRows(target, ef));
+    }
+
+    std::vector<size_t> searchRows (const std::vector<float>& target, const int ef = 1) override {
+        std::vector<size_t> rows;
+        for (const auto& candidate : closestRows(target, ef)) {
+            rows.push_back(candidate.id);
+        }
+        return rows;
     }
 
     std::vector<std::tuple<TypeName, float, std::vector<float>>> query(const std::vector<float>& vec, int k) const {
+        // Prepare the final vector to return: key, distance and vector of the top k items
+        std::vector<std::tuple<TypeName, float, std::vector<float>>> nearestNeighbors;
+        for (const auto& candidate : closestRows(vec, k)) {
+            nearestNeighbors.emplace_back(TypeName(store->key(candidate.id)), candidate.distance, store->vectors().decode(candidate.id));
+        }
+
+        return nearestNeighbors;
+    }
+
+private:
+    // An item found in a leaf, by the id of its store row
+    struct LeafCandidate {
+        float distance;
+        size_t id;
+    };
+
+    // The k closest items over every tree, nearest first
+    std::vector<LeafCandidate> closestRows(const std::vector<float>& vec, int k) const {
         // Temporary storage for futures that will hold the results from each tree
-        std::vector<std::future<std::vector<std::tuple<TypeName, float, std::vector<float>>>>> futures;
+        std::vector<std::future<std::vector<LeafCandidate>>> futures;
 
-        // Temporary storage for results, including the TypeName, distance, and vector
-        std::vector<std::tuple<TypeName, float, std::vector<float>>> tempResults;
+        // Candidates are row ids; keys and vectors are only copied for the final k
+        std::vector<LeafCandidate> tempResults;
 
         // Launch asynchronous tasks for each tree if build_parallel is true
         for (const auto& tree : trees) {
-            auto task = [&tree, &vec, this]() -> std::vector<std::tuple<TypeName, float, std::vector<float>>> {
-                std::vector<std::tuple<TypeName, float, std::vector<float>>> results;
-                const auto list = tree->findContainingList(vec);
-                for (const auto& item : list) {
-                    float distance = tree->calculateSquaredDistance(vec, item.second);
-                    results.emplace_back(item.first, distance, item.second);
+            auto task = [&tree, &vec, k, this]() -> std::vector<LeafCandidate> {
+                // Each item sits in one leaf per tree, so a per-tree top k is exact and its
+                // bound lets the leaf scans abandon candidates early
+                auto leaves = tree->findContainingLeaves(vec);
+                TopK topK(std::max(k, 0));
+                size_t abandoned = 0;
+                for (const auto* leaf : leaves) {
+                    abandoned += space.scanTopK(vec.data(), store->vectors(), leaf->ids, topK, &store->tombstones());
+                }
+                abandonedEvaluations += abandoned;
+
+                std::vector<LeafCandidate> results;
+                for (const auto& [distance, id] : topK.takeSorted()) {
+                    results.push_back({distance, id});
                 }
                 return results;
             };
@@ -103,7 +184,7 @@ public:
             } else {
                 // For sequential execution, directly collect the results
                 auto results = task();
-                std::copy(results.begin(), results.end(), std::back_inserter(tempResults));
+                tempResults.insert(tempResults.end(), results.begin(), results.end());
             }
         }
 
@@ -111,21 +192,25 @@ public:
             // Collect results from all futures
             for (auto& fut : futures) {
                 auto results = fut.get();
-                std::copy(results.begin(), results.end(), std::back_inserter(tempResults));
+                tempResults.insert(tempResults.end(), results.begin(), results.end());
             }
         }
 
-        std::partial_sort(tempResults.begin(), std::min(tempResults.begin() + k, tempResults.end()), tempResults.end(), [](const auto& a, const auto& b) {
-            return std::get<1>(a) < std::get<1>(b); // Sorting based on distance
+        std::sort(tempResults.begin(), tempResults.end(), [](const LeafCandidate& a, const LeafCandidate& b) {
+            if (a.distance != b.distance) {
+                return a.distance < b.distance; // Sorting based on distance
+            }
+            return a.id < b.id;
         });
 
-        // Prepare the final vector to return, selecting the top k items based on distance
-        std::vector<std::tuple<TypeName, float, std::vector<float>>> nearestNeighbors;
-        for (int i = 0; i < std::min(k, static_cast<int>(tempResults.size())); ++i) {
-            nearestNeighbors.push_back(tempResults[i]);
-        }
+        // Every tree reports the items in its leaf, so the same item can appear once per tree
+        tempResults.erase(std::unique(tempResults.begin(), tempResults.end(), [](const LeafCandidate& a, const LeafCandidate& b) {
+            return a.id == b.id;
+        }), tempResults.end());
 
-        return nearestNeighbors;
+        // Selecting the top k items based on distance
+        tempResults.resize(std::min(static_cast<size_t>(std::max(k, 0)), tempResults.size()));
+        return tempResults;
     }
 };
 
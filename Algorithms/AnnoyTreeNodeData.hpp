@@ -3,19 +3,21 @@
 
 #include <vector>
 #include <utility>
+#include <stdexcept>
 
 template<typename DataType>
 struct AnnoyTreeNodeData {
     std::vector<float> vec1;
     std::vector<float> vec2;
-    std::vector<std::pair<DataType, std::vector<float>>> pairList;
+    // Leaf contents: the ids of the items' rows in the collection's store
+    std::vector<size_t> ids;
 
     int vector_len;
 
-    AnnoyTreeNodeData () : vector_len(1), vec1(1, 0.0f), vec2(1, 0.0f) {}
+    AnnoyTreeNodeData () : vec1(1, 0.0f), vec2(1, 0.0f), vector_len(1) {}
 
     // Constructor
-    AnnoyTreeNodeData(int vector_length) : vector_len(vector_length), vec1(vector_len, 0.0f), vec2(vector_len, 0.0f) {
+    AnnoyTreeNodeData(int vector_length) : vec1(vector_length, 0.0f), vec2(vector_length, 0.0f), vector_len(vector_length) {
         // Optionally initialize vec1 and vec2 with specific values
         // and add initial data to pairList if necessary
     }
@@ -30,13 +32,13 @@ struct AnnoyTreeNodeData {
         // pairList can be populated later or modified to accept initial data
     }
 
-    // Method to add data to pairList, ensuring vector length matches vector_len
-    void addData(const DataType& data, const std::vector<float>& vec) {
-        if (vec.size() == vector_len) {
-            pairList.emplace_back(data, vec);
-        } else {
-            // Handle the error or ignore the addition if vector lengths do not match (not implemented)
-        }
+    // Method to add a store row to the leaf
+    void addData(size_t id) {
+        ids.push_back(id);
+    }
+
+    size_t size() const {
+        return ids.size();
     }
 };
 
@@ -0,0 +1,198 @@
+#ifndef BLOCK_READER_HPP
+#define BLOCK_READER_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Sector size every block of a disk-resident index is aligned to, and the alignment
+// direct reads need of their offsets, lengths and buffers
+constexpr size_t diskSectorSize = 4096;
+
+// Memory aligned for direct reads, freed with std::free
+struct AlignedFree {
+    void operator()(void* memory) const { std::free(memory); }
+};
+using AlignedBuffer = std::unique_ptr<uint8_t, AlignedFree>;
+
+inline AlignedBuffer allocateAligned(size_t bytes) {
+    size_t rounded = (bytes + diskSectorSize - 1) / diskSectorSize * diskSectorSize;
+    void* memory = std::aligned_alloc(diskSectorSize, rounded ? rounded : diskSectorSize);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    return AlignedBuffer(static_cast<uint8_t*>(memory));
+}
+
+// Reads batches of sector-aligned blocks from one file with pread. A batch's reads are
+// handed to a pool of threads, so they are all in flight on the device at once instead
+// of one after another; the calling thread reads too while it waits. The file is opened
+// with O_DIRECT where the file system allows it, so reads go to the device and not the
+// page cache. With no threads, every read is made by the caller.
+class BlockReader {
+public:
+    struct Request {
+        uint64_t offset;
+        size_t bytes;
+        void* buffer;
+    };
+
+    BlockReader(const std::string& path, int threads) : path(path) {
+        fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+        direct = fd >= 0;
+        if (!direct) {
+            fd = ::open(path.c_str(), O_RDONLY);
+        }
+        if (fd < 0) {
+            throw std::runtime_error("Could not open index file " + path + ".");
+        }
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back([this]() { serve(); });
+        }
+    }
+
+    BlockReader(const BlockReader&) = delete;
+    BlockReader& operator=(const BlockReader&) = delete;
+
+    ~BlockReader() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        ::close(fd);
+    }
+
+    // Whether reads bypass the page cache
+    bool isDirect() const { return direct; }
+
+    // Blocks read since the file was opened
+    uint64_t blockReads() const { return reads.load(std::memory_order_relaxed); }
+
+    // Reads every request of the batch, returning once all are in their buffers
+    void read(const Request* requests, size_t count) {
+        if (count == 0) {
+            return;
+        }
+        Batch batch;
+        batch.remaining = count;
+        if (!workers.empty() && count > 1) {
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                for (size_t i = 1; i < count; ++i) {
+                    queue.push_back({&batch, &requests[i]});
+                }
+            }
+            queueReady.notify_all();
+        } else {
+            for (size_t i = 1; i < count; ++i) {
+                complete(batch, requests[i]);
+            }
+        }
+        complete(batch, requests[0]);
+
+        // Take back whatever of this batch no worker has picked up yet
+        for (;;) {
+            Work work{nullptr, nullptr};
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                for (auto it = queue.begin(); it != queue.end(); ++it) {
+                    if (it->batch == &batch) {
+                        work = *it;
+                        queue.erase(it);
+                        break;
+                    }
+                }
+            }
+            if (!work.batch) {
+                break;
+            }
+            complete(batch, *work.request);
+        }
+        std::unique_lock<std::mutex> lock(batch.mutex);
+        batch.finished.wait(lock, [&]() { return batch.remaining == 0; });
+        if (batch.failed) {
+            throw std::runtime_error("Could not read index file " + path + ".");
+        }
+    }
+
+private:
+    struct Batch {
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t remaining = 0;
+        bool failed = false;
+    };
+    struct Work {
+        Batch* batch;
+        const Request* request;
+    };
+
+    std::string path;
+    int fd = -1;
+    bool direct = false;
+    std::atomic<uint64_t> reads{0};
+    std::vector<std::thread> workers;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+    std::deque<Work> queue;
+    bool stopping = false;
+
+    void serve() {
+        for (;;) {
+            Work work;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueReady.wait(lock, [&]() { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                work = queue.front();
+                queue.pop_front();
+            }
+            complete(*work.batch, *work.request);
+        }
+    }
+
+    // Makes one read and counts it off its batch
+    void complete(Batch& batch, const Request& request) {
+        bool ok = readFully(request);
+        reads.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(batch.mutex);
+        batch.failed |= !ok;
+        if (--batch.remaining == 0) {
+            batch.finished.notify_all();
+        }
+    }
+
+    bool readFully(const Request& request) const {
+        size_t done = 0;
+        while (done < request.bytes) {
+            ssize_t rv = ::pread(fd, static_cast<char*>(request.buffer) + done, request.bytes - done, request.offset + done);
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rv <= 0) {
+                return false;
+            }
+            done += rv;
+        }
+        return true;
+    }
+};
+
+#endif // BLOCK_READER_HPP
@@ -0,0 +1,535 @@
+#ifndef DISK_VAMANA_HPP
+#define DISK_VAMANA_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <numeric>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "VectorSearchAlgorithm.hpp"
+#include "Vamana.hpp"
+#include "BlockReader.hpp"
+#include "SearchContext.hpp"
+#include "RowCodes.hpp"
+
+// Start of a disk index file, padded to its first sector
+struct DiskIndexHeader {
+    static constexpr char expectedMagic[8] = {'V', 'E', 'C', 'D', 'I', 'S', 'K', '\0'};
+    static constexpr uint32_t currentVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrderMark;
+    uint64_t nodeCount;
+    uint64_t start;
+    uint32_t dimension;
+    uint32_t degree;
+    // Bytes of one node: its vector, its neighbor count, then degree neighbor slots
+    uint32_t nodeBytes;
+    // A block is the unit read: several small nodes share a sector, a large one spans several
+    uint32_t nodesPerBlock;
+    uint32_t sectorsPerBlock;
+};
+
+// A Vamana graph kept on disk, so that serving it doesn't hold the graph in memory. Each
+// node's full vector and its fixed-degree neighbor list are packed into sector-aligned
+// blocks of one file. Only PQ codes of the nodes stay in memory: a search walks the
+// graph on them, reading the blocks of the few best nodes at each step as one batch,
+// and ranks the nodes it read on the exact vectors that came with their blocks.
+//
+// Every search starts at the medoid and walks its first hops through the same few nodes,
+// so the nodes nearest it, breadth first, are read once when the file is opened and kept
+// pinned in memory; a search only reads the blocks of nodes outside that cache.
+//
+// The build is not out of core. It needs every row of the store in memory, builds the
+// whole graph in memory as an in-memory Vamana does, and trains the PQ codes on all the
+// rows; its peak is that of a Vamana over the collection. The collection's store also
+// stays with the engine, in memory or mapped from a snapshot. Serving saves the graph's
+// memory; with the store mapped, its rows are paged in only as they are read.
+//
+// The file is written once, by the build. Rows added later are not indexed, and are
+// counted by unindexedRows() until the index is rebuilt; rows removed stay in the file
+// as waypoints, and are only left out of results.
+template<typename T>
+class DiskVamana : public VectorSearchAlgorithm<T> {
+public:
+    using NodeId = uint32_t;
+    static constexpr NodeId noNode = std::numeric_limits<NodeId>::max();
+
+    std::string path;
+    float alpha;
+    int R;
+    int L;
+    // Blocks read per step of a search, and threads reading them
+    int beam_width;
+    int io_threads;
+    // Nodes around the medoid kept in memory
+    int cache_nodes;
+    VectorSpace space;
+    std::shared_ptr<const VectorStore<T>> store;
+
+    // Builds a Vamana graph over every row of the store, writes it to the file at path
+    // and keeps only the codes. The graph is built in memory first.
+    DiskVamana(std::shared_ptr<const VectorStore<T>> store,
+               const VectorSpace& space,
+               const std::string& path,
+               float alpha,
+               int R,
+               int L = 100,
+               int beam_width = 4,
+               int io_threads = 4,
+               int cache_nodes = 1024,
+               int build_threads = 0)
+               : path(path),
+                 alpha(alpha),
+                 R(R),
+                 L(L),
+                 beam_width(beam_width),
+                 io_threads(io_threads),
+                 cache_nodes(cache_nodes),
+                 space(space),
+                 store(std::move(store)) {
+        if (beam_width <= 0) {
+            throw std::invalid_argument("The beam width must be positive.");
+        }
+        if (io_threads < 0) {
+            throw std::invalid_argument("The I/O thread count can't be negative.");
+        }
+        if (cache_nodes < 0) {
+            throw std::invalid_argument("The cached node count can't be negative.");
+        }
+        if (this->store->size() >= noNode) {
+            throw std::invalid_argument("Too many rows for a disk index.");
+        }
+        RowGraph graph;
+        {
+            Vamana<T> built(this->store, space, alpha, space.dimension, R, 1, Compression::None, 4, L, build_threads);
+            built.rowGraph(graph);
+        }
+        writeIndex(graph);
+        rowOfNode.resize(graph.size());
+        std::iota(rowOfNode.begin(), rowOfNode.end(), 0);
+        nodeOfRow = rowOfNode;
+        if (!rowOfNode.empty()) {
+            codes = RowCodes(Compression::PQ, this->store->vectors(), space.metric);
+        }
+        openIndex();
+    }
+
+    // Reads an index written by save() and opens its file again; the section tag has
+    // already been read
+    DiskVamana(std::shared_ptr<const VectorStore<T>> store, SnapshotReader& snapshot) : store(std::move(store)) {
+        path = snapshot.readString();
+        alpha = snapshot.read<float>();
+        R = snapshot.read<int32_t>();
+        L = snapshot.read<int32_t>();
+        beam_width = snapshot.read<int32_t>();
+        io_threads = snapshot.read<int32_t>();
+        cache_nodes = snapshot.read<int32_t>();
+        space = VectorSpace(snapshot);
+        rowOfNode = snapshot.readVector<NodeId>();
+        nodeOfRow = snapshot.readVector<NodeId>();
+        codes = RowCodes(snapshot);
+        unindexed = std::count(nodeOfRow.begin(), nodeOfRow.end(), noNode);
+        if (beam_width <= 0 || io_threads < 0 || cache_nodes < 0) {
+            throw std::runtime_error("Snapshot disk index is malformed.");
+        }
+        openIndex();
+        if (rowOfNode.size() != header.nodeCount || (header.nodeCount && codes.size() != header.nodeCount)) {
+            throw std::runtime_error("Snapshot disk index doesn't match its file " + path + ".");
+        }
+    }
+
+    std::vector<std::pair<T, std::vector<float>>> searchClosest(const std::vector<float>& target, const int ef = 1) override {
+        return store->entries(searchRows(target, ef));
+    }
+
+    // Beam search over the codes with a list of ef nodes, then the ef nearest of the
+    // nodes read, on their exact vectors
+    std::vector<size_t> searchRows(const std::vector<float>& target, const int ef = 1) override {
+        return searchRows(target, ef, SearchOptions());
+    }
+
+    // The k nearest, from a beam search with a list of options.listSize nodes (at least
+    // k) reading options.beamWidth blocks per step, beam_width if it is not given
+    std::vector<size_t> searchRows(const std::vector<float>& target, int k, const SearchOptions& options) override {
+        if (header.nodeCount == 0 || target.size() != header.dimension) {
+            return {};
+        }
+        searches.fetch_add(1, std::memory_order_relaxed);
+        size_t count = std::max(k, 1);
+        size_t list = std::max<size_t>(count, options.listSize);
+        size_t width = options.beamFor(list, beam_width);
+        static thread_local Beam beam;
+        beam.reserve(width, blockBytes());
+        codes.prepare(target.data(), beam.query);
+        auto& context = SearchContext<NodeId>::local();
+        context.begin(header.nodeCount);
+        beam.candidates.clear();
+        beam.exact.clear();
+
+        NodeId start = static_cast<NodeId>(header.start);
+        context.visit(start);
+        beam.candidates.push_back({codes.distance(beam.query, start), start, false});
+        for (;;) {
+            // The nearest nodes not yet read, as one batch of blocks; cached nodes are
+            // already at hand
+            beam.frontier.clear();
+            beam.requests.clear();
+            for (auto& candidate : beam.candidates) {
+                if (beam.frontier.size() == width) {
+                    break;
+                }
+                if (!candidate.read) {
+                    candidate.read = true;
+                    auto cached = cacheSlots.find(candidate.node);
+                    if (cached != cacheSlots.end()) {
+                        beam.frontier.push_back({candidate.node, noRequest, cacheRecords.data() + cached->second * header.nodeBytes});
+                    } else {
+                        beam.frontier.push_back({candidate.node, requestFor(beam, candidate.node), nullptr});
+                    }
+                }
+            }
+            if (beam.frontier.empty()) {
+                break;
+            }
+            reader->read(beam.requests.data(), beam.requests.size());
+
+            for (const auto& step : beam.frontier) {
+                const uint8_t* record = step.record;
+                if (!record) {
+                    record = static_cast<const uint8_t*>(beam.requests[step.request].buffer)
+                             + (step.node % header.nodesPerBlock) * header.nodeBytes;
+                }
+                NodeId row = rowOfNode[step.node];
+                if (row != noNode && !store->isDeleted(row)) {
+                    beam.exact.emplace_back(space.distance(target.data(), reinterpret_cast<const float*>(record)), row);
+                }
+                const NodeId* neighbors = reinterpret_cast<const NodeId*>(record + header.dimension * sizeof(float));
+                NodeId degree = std::min(neighbors[0], header.degree);
+                for (NodeId i = 1; i <= degree; ++i) {
+                    NodeId next = neighbors[i];
+                    if (next >= header.nodeCount || !context.visit(next)) {
+                        continue;
+                    }
+                    float distance = codes.distance(beam.query, next);
+                    if (beam.candidates.size() >= list && distance >= beam.candidates.back().distance) {
+                        continue;
+                    }
+                    Candidate entry{distance, next, false};
+                    auto at = std::upper_bound(beam.candidates.begin(), beam.candidates.end(), entry,
+                                               [](const Candidate& a, const Candidate& b) { return a.distance < b.distance; });
+                    beam.candidates.insert(at, entry);
+                    if (beam.candidates.size() > list) {
+                        beam.candidates.pop_back();
+                    }
+                }
+            }
+        }
+
+        std::sort(beam.exact.begin(), beam.exact.end());
+        beam.exact.resize(std::min(beam.exact.size(), count));
+        std::vector<size_t> rows(beam.exact.size());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            rows[i] = beam.exact[i].second;
+        }
+        return rows;
+    }
+
+    // Not linked into the graph on disk, so searches can't return it
+    void addRow(size_t id) override {
+        if (nodeOfRow.size() <= id) {
+            unindexed += id + 1 - nodeOfRow.size();
+            nodeOfRow.resize(id + 1, noNode);
+        }
+    }
+
+    size_t unindexedRows() const override { return unindexed; }
+
+    // The row's node stays in the file, with no row; the store's last row takes its id
+    void removeRow(size_t id) override {
+        if (id >= nodeOfRow.size()) {
+            return;
+        }
+        if (nodeOfRow[id] != noNode) {
+            rowOfNode[nodeOfRow[id]] = noNode;
+        } else {
+            --unindexed;
+        }
+        size_t last = nodeOfRow.size() - 1;
+        if (id != last) {
+            nodeOfRow[id] = nodeOfRow[last];
+            if (nodeOfRow[id] != noNode) {
+                rowOfNode[nodeOfRow[id]] = id;
+            }
+        }
+        nodeOfRow.pop_back();
+    }
+
+    // Only which row each node stands for changes; the file keeps its layout
+    void permuteRows(const std::vector<size_t>& newIds) override {
+        std::vector<NodeId> permuted(newIds.size(), noNode);
+        for (size_t id = 0; id < nodeOfRow.size(); ++id) {
+            permuted[newIds[id]] = nodeOfRow[id];
+            if (nodeOfRow[id] != noNode) {
+                rowOfNode[nodeOfRow[id]] = newIds[id];
+            }
+        }
+        nodeOfRow.swap(permuted);
+    }
+
+    // Deleted rows are searched through and left out of results until they are removed
+    void consolidateDeletes() override {}
+
+    // Where the file is, the parameters, which row each node stands for, then the codes.
+    // The file itself is not copied: it must still be at path when the snapshot is loaded.
+    void save(SnapshotWriter& snapshot) const override {
+        snapshot.section(SnapshotSection::DiskVamana);
+        snapshot.writeString(path);
+        snapshot.write<float>(alpha);
+        snapshot.write<int32_t>(R);
+        snapshot.write<int32_t>(L);
+        snapshot.write<int32_t>(beam_width);
+        snapshot.write<int32_t>(io_threads);
+        snapshot.write<int32_t>(cache_nodes);
+        space.save(snapshot);
+        snapshot.writeArray(rowOfNode);
+        snapshot.writeArray(nodeOfRow);
+        codes.save(snapshot);
+    }
+
+    // Searches made and blocks they read since the index was opened, for tuning the
+    // beam width and the cache
+    uint64_t searchCount() const { return searches.load(std::memory_order_relaxed); }
+    uint64_t blockReads() const { return reader->blockReads() - cacheReads; }
+    double readsPerQuery() const {
+        uint64_t count = searchCount();
+        return count ? double(blockReads()) / count : 0.0;
+    }
+    bool directReads() const { return reader->isDirect(); }
+
+private:
+    struct Candidate {
+        float distance;
+        NodeId node;
+        bool read;
+    };
+
+    // A node expanded in a step of a search: its record, in the cache, or else the
+    // request that reads its block
+    struct Step {
+        NodeId node;
+        size_t request;
+        const uint8_t* record;
+    };
+    static constexpr size_t noRequest = std::numeric_limits<size_t>::max();
+
+    // A search's working memory, kept per thread: the list of candidates by code
+    // distance, the nodes read with their exact distances, and one block buffer per
+    // node of a step
+    struct Beam {
+        RowCodes::Query query;
+        std::vector<Candidate> candidates;
+        std::vector<std::pair<float, size_t>> exact;
+        std::vector<Step> frontier;
+        std::vector<BlockReader::Request> requests;
+        std::vector<AlignedBuffer> buffers;
+        size_t bufferBytes = 0;
+
+        void reserve(size_t width, size_t bytes) {
+            if (bufferBytes != bytes) {
+                buffers.clear();
+                bufferBytes = bytes;
+            }
+            while (buffers.size() < width) {
+                buffers.push_back(allocateAligned(bytes));
+            }
+        }
+    };
+
+    DiskIndexHeader header{};
+    std::vector<NodeId> rowOfNode;
+    std::vector<NodeId> nodeOfRow;
+    // Rows added since the build, which have no node
+    size_t unindexed = 0;
+    // PQ codes by node id
+    RowCodes codes;
+    std::unique_ptr<BlockReader> reader;
+    std::atomic<uint64_t> searches{0};
+    // The pinned nodes' records, nodeBytes each, and where each node's is
+    std::unordered_map<NodeId, size_t> cacheSlots;
+    std::vector<uint8_t> cacheRecords;
+    // Blocks read to fill the cache, which no search is charged for
+    uint64_t cacheReads = 0;
+
+    size_t blockBytes() const { return size_t(header.sectorsPerBlock) * diskSectorSize; }
+
+    uint64_t blockOffset(NodeId node) const {
+        return (1 + uint64_t(node / header.nodesPerBlock) * header.sectorsPerBlock) * diskSectorSize;
+    }
+
+    // Index of the request that reads node's block, added unless a node of the same
+    // block is already being read in this step
+    size_t requestFor(Beam& beam, NodeId node) const {
+        uint64_t offset = blockOffset(node);
+        for (size_t i = 0; i < beam.requests.size(); ++i) {
+            if (beam.requests[i].offset == offset) {
+                return i;
+            }
+        }
+        beam.requests.push_back({offset, blockBytes(), beam.buffers[beam.requests.size()].get()});
+        return beam.requests.size() - 1;
+    }
+
+    // Writes the header sector then every block, to a file next to path that replaces
+    // it once it is complete
+    void writeIndex(const RowGraph& graph) {
+        header = DiskIndexHeader{};
+        std::memcpy(header.magic, DiskIndexHeader::expectedMagic, sizeof(header.magic));
+        header.version = DiskIndexHeader::currentVersion;
+        header.byteOrderMark = SnapshotFormat::byteOrderMark;
+        header.nodeCount = graph.size();
+        header.start = graph.start;
+        header.dimension = space.dimension;
+        header.degree = R;
+        header.nodeBytes = header.dimension * sizeof(float) + (1 + header.degree) * sizeof(NodeId);
+        header.nodesPerBlock = std::max<uint32_t>(1, diskSectorSize / header.nodeBytes);
+        header.sectorsPerBlock = (header.nodeBytes * header.nodesPerBlock + diskSectorSize - 1) / diskSectorSize;
+
+        std::string temporaryPath = path + ".tmp";
+        int fd = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open index file " + temporaryPath + " for writing.");
+        }
+        auto fail = [&]() {
+            ::close(fd);
+            ::unlink(temporaryPath.c_str());
+            throw std::runtime_error("Could not write index file " + temporaryPath + ".");
+        };
+        std::vector<uint8_t> block(diskSectorSize, 0);
+        std::memcpy(block.data(), &header, sizeof(header));
+        if (!writeFully(fd, block.data(), block.size())) {
+            fail();
+        }
+        block.assign(blockBytes(), 0);
+        std::vector<float> scratch;
+        for (size_t first = 0; first < graph.size(); first += header.nodesPerBlock) {
+            std::fill(block.begin(), block.end(), 0);
+            size_t end = std::min<size_t>(graph.size(), first + header.nodesPerBlock);
+            for (size_t node = first; node < end; ++node) {
+                uint8_t* record = block.data() + (node - first) * header.nodeBytes;
+                std::memcpy(record, store->row(node, scratch), header.dimension * sizeof(float));
+                NodeId* neighbors = reinterpret_cast<NodeId*>(record + header.dimension * sizeof(float));
+                NodeId count = std::min<size_t>(graph.degree(node), header.degree);
+                neighbors[0] = count;
+                std::copy(graph.begin(node), graph.begin(node) + count, neighbors + 1);
+            }
+            if (!writeFully(fd, block.data(), block.size())) {
+                fail();
+            }
+        }
+        if (::fsync(fd) != 0 || ::close(fd) != 0) {
+            ::unlink(temporaryPath.c_str());
+            throw std::runtime_error("Could not write index file " + temporaryPath + ".");
+        }
+        if (std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+            ::unlink(temporaryPath.c_str());
+            throw std::runtime_error("Could not replace index file " + path + ".");
+        }
+    }
+
+    // Reads and checks the header, then opens the file for searches
+    void openIndex() {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open index file " + path + ".");
+        }
+        DiskIndexHeader read{};
+        bool complete = ::pread(fd, &read, sizeof(read), 0) == static_cast<ssize_t>(sizeof(read));
+        ::close(fd);
+        if (!complete || std::memcmp(read.magic, DiskIndexHeader::expectedMagic, sizeof(read.magic)) != 0
+            || read.version != DiskIndexHeader::currentVersion || read.byteOrderMark != SnapshotFormat::byteOrderMark
+            || read.nodesPerBlock == 0 || read.sectorsPerBlock == 0
+            || read.nodeBytes != read.dimension * sizeof(float) + (1 + read.degree) * sizeof(NodeId)
+            || size_t(read.nodeBytes) * read.nodesPerBlock > size_t(read.sectorsPerBlock) * diskSectorSize
+            || (read.nodeCount && read.start >= read.nodeCount)) {
+            throw std::runtime_error("Index file " + path + " is malformed.");
+        }
+        if (read.dimension != static_cast<uint32_t>(space.dimension)) {
+            throw std::runtime_error("Index file " + path + " has vectors of another dimension.");
+        }
+        header = read;
+        reader = std::make_unique<BlockReader>(path, io_threads);
+        fillCache();
+    }
+
+    // Reads the cache_nodes nodes nearest the medoid, breadth first, a level at a time
+    void fillCache() {
+        cacheSlots.clear();
+        cacheRecords.clear();
+        size_t limit = std::min<size_t>(cache_nodes, header.nodeCount);
+        constexpr size_t blocksPerRead = 64;
+        AlignedBuffer buffer = allocateAligned(blocksPerRead * blockBytes());
+        std::vector<BlockReader::Request> requests;
+        std::vector<NodeId> level;
+        std::unordered_set<NodeId> queued;
+        if (limit > 0) {
+            level.push_back(static_cast<NodeId>(header.start));
+            queued.insert(level.back());
+        }
+        while (!level.empty() && cacheSlots.size() < limit) {
+            std::vector<NodeId> next;
+            for (size_t first = 0; first < level.size() && cacheSlots.size() < limit; first += blocksPerRead) {
+                size_t end = std::min({level.size(), first + blocksPerRead, first + limit - cacheSlots.size()});
+                requests.clear();
+                for (size_t i = first; i < end; ++i) {
+                    requests.push_back({blockOffset(level[i]), blockBytes(), buffer.get() + (i - first) * blockBytes()});
+                }
+                reader->read(requests.data(), requests.size());
+                for (size_t i = first; i < end; ++i) {
+                    const uint8_t* record = buffer.get() + (i - first) * blockBytes()
+                                            + (level[i] % header.nodesPerBlock) * header.nodeBytes;
+                    cacheSlots.emplace(level[i], cacheSlots.size());
+                    cacheRecords.insert(cacheRecords.end(), record, record + header.nodeBytes);
+                    const NodeId* neighbors = reinterpret_cast<const NodeId*>(record + header.dimension * sizeof(float));
+                    for (NodeId n = 1; n <= std::min(neighbors[0], header.degree); ++n) {
+                        if (neighbors[n] < header.nodeCount && queued.insert(neighbors[n]).second) {
+                            next.push_back(neighbors[n]);
+                        }
+                    }
+                }
+            }
+            level.swap(next);
+        }
+        cacheReads = reader->blockReads();
+    }
+
+    static bool writeFully(int fd, const uint8_t* data, size_t bytes) {
+        size_t written = 0;
+        while (written < bytes) {
+            ssize_t rv = ::write(fd, data + written, bytes - written);
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rv <= 0) {
+                return false;
+            }
+            written += rv;
+        }
+        return true;
+    }
+};
+
+#endif // DISK_VAMANA_HPP
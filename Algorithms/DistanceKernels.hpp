@@ -0,0 +1,646 @@
+#ifndef DISTANCE_KERNELS_HPP
+#define DISTANCE_KERNELS_HPP
+
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DISTANCE_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// Instruction set a kernel table was built for, best one is picked at startup.
+enum class SimdLevel {
+    Scalar = 0,
+    SSE = 1,
+    AVX2 = 2,
+    AVX512 = 3
+};
+
+// Table of raw distance kernels over contiguous float buffers of length n.
+struct DistanceKernels {
+    SimdLevel level;
+    float (*squaredL2)(const float* a, const float* b, size_t n);
+    float (*innerProduct)(const float* a, const float* b, size_t n);
+    // One query against count rows of length n stored back to back, one result per row
+    void (*squaredL2Batch)(const float* query, const float* rows, size_t count, size_t n, float* out);
+    void (*innerProductBatch)(const float* query, const float* rows, size_t count, size_t n, float* out);
+    // Squared L2 that gives up once the running sum exceeds bound; the partial sum
+    // returned is then only known to be greater than bound
+    float (*squaredL2Bounded)(const float* a, const float* b, size_t n, float bound);
+};
+
+/* Scalar fallback */
+
+inline float scalarSquaredL2(const float* a, const float* b, size_t n) {
+    // Four independent accumulators so the compiler doesn't serialize on one add
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    size_t i = 0;
+    for (size_t blocked = n - n % 4; i < blocked; i += 4) {
+        float d0 = a[i] - b[i];
+        float d1 = a[i + 1] - b[i + 1];
+        float d2 = a[i + 2] - b[i + 2];
+        float d3 = a[i + 3] - b[i + 3];
+        s0 += d0 * d0;
+        s1 += d1 * d1;
+        s2 += d2 * d2;
+        s3 += d3 * d3;
+    }
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        s0 += d * d;
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+inline float scalarInnerProduct(const float* a, const float* b, size_t n) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    size_t i = 0;
+    for (size_t blocked = n - n % 4; i < blocked; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) {
+        s0 += a[i] * b[i];
+    }
+    return (s0 + s1) + (s2 + s3);
+}
+
+#ifdef DISTANCE_KERNELS_X86
+
+/* SSE */
+
+__attribute__((target("sse4.1")))
+inline float horizontalSum128(__m128 v) {
+    __m128 shuf = _mm_movehdup_ps(v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse4.1")))
+inline float sseSquaredL2(const float* a, const float* b, size_t n) {
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d, d));
+    }
+    float sum = horizontalSum128(_mm_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("sse4.1")))
+inline float sseInnerProduct(const float* a, const float* b, size_t n) {
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    float sum = horizontalSum128(_mm_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+/* AVX2 + FMA */
+
+__attribute__((target("avx2,fma")))
+inline float horizontalSum256(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    return horizontalSum128(_mm_add_ps(lo, hi));
+}
+
+__attribute__((target("avx2,fma")))
+inline float avx2SquaredL2(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+    float sum = horizontalSum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+inline float avx2InnerProduct(const float* a, const float* b, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    }
+    float sum = horizontalSum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+/* AVX-512 */
+
+__attribute__((target("avx512f,avx2,fma")))
+inline float horizontalSum512(__m512 v) {
+    // Fold the upper 256 bits onto the lower ones, then reuse the AVX2 reduction.
+    // The maskz forms avoid GCC 12's bogus -Wuninitialized on _mm512_undefined_*.
+    __m256d hi = _mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(v), 1);
+    __m256d lo = _mm512_maskz_extractf64x4_pd(0xF, _mm512_castps_pd(v), 0);
+    return horizontalSum256(_mm256_add_ps(_mm256_castpd_ps(lo), _mm256_castpd_ps(hi)));
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+inline float avx512SquaredL2(const float* a, const float* b, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc0 = _mm512_fmadd_ps(d, d, acc0);
+    }
+    if (i < n) {
+        // Masked loads zero the lanes past the end, so they add nothing
+        __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1u);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc1 = _mm512_fmadd_ps(d, d, acc1);
+    }
+    return horizontalSum512(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+inline float avx512InnerProduct(const float* a, const float* b, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    }
+    if (i < n) {
+        __mmask16 mask = (__mmask16) ((1u << (n - i)) - 1u);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc1);
+    }
+    return horizontalSum512(_mm512_add_ps(acc0, acc1));
+}
+
+#endif // DISTANCE_KERNELS_X86
+
+/* Dimension-specialized kernels. Dim is a compile-time constant so every loop
+   below has a fixed trip count and unrolls completely; the runtime n is ignored. */
+
+template<size_t Dim>
+inline float scalarSquaredL2Fixed(const float* a, const float* b, size_t) {
+    float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+#pragma GCC unroll 64
+    for (size_t i = 0; i < Dim; ++i) {
+        float d = a[i] - b[i];
+        acc[i % 4] += d * d;
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+template<size_t Dim>
+inline float scalarInnerProductFixed(const float* a, const float* b, size_t) {
+    float acc[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+#pragma GCC unroll 64
+    for (size_t i = 0; i < Dim; ++i) {
+        acc[i % 4] += a[i] * b[i];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+#ifdef DISTANCE_KERNELS_X86
+
+template<size_t Dim>
+__attribute__((target("sse4.1")))
+inline float sseSquaredL2Fixed(const float* a, const float* b, size_t) {
+    __m128 acc[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+#pragma GCC unroll 256
+    for (size_t i = 0; i + 4 <= Dim; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc[(i / 4) % 2] = _mm_add_ps(acc[(i / 4) % 2], _mm_mul_ps(d, d));
+    }
+    float sum = horizontalSum128(_mm_add_ps(acc[0], acc[1]));
+    for (size_t i = Dim - Dim % 4; i < Dim; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+template<size_t Dim>
+__attribute__((target("sse4.1")))
+inline float sseInnerProductFixed(const float* a, const float* b, size_t) {
+    __m128 acc[2] = { _mm_setzero_ps(), _mm_setzero_ps() };
+#pragma GCC unroll 256
+    for (size_t i = 0; i + 4 <= Dim; i += 4) {
+        acc[(i / 4) % 2] = _mm_add_ps(acc[(i / 4) % 2], _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    float sum = horizontalSum128(_mm_add_ps(acc[0], acc[1]));
+    for (size_t i = Dim - Dim % 4; i < Dim; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+template<size_t Dim>
+__attribute__((target("avx2,fma")))
+inline float avx2SquaredL2Fixed(const float* a, const float* b, size_t) {
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+#pragma GCC unroll 128
+    for (size_t i = 0; i + 8 <= Dim; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc[(i / 8) % 4] = _mm256_fmadd_ps(d, d, acc[(i / 8) % 4]);
+    }
+    float sum = horizontalSum256(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+    for (size_t i = Dim - Dim % 8; i < Dim; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+template<size_t Dim>
+__attribute__((target("avx2,fma")))
+inline float avx2InnerProductFixed(const float* a, const float* b, size_t) {
+    __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+#pragma GCC unroll 128
+    for (size_t i = 0; i + 8 <= Dim; i += 8) {
+        acc[(i / 8) % 4] = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc[(i / 8) % 4]);
+    }
+    float sum = horizontalSum256(_mm256_add_ps(_mm256_add_ps(acc[0], acc[1]), _mm256_add_ps(acc[2], acc[3])));
+    for (size_t i = Dim - Dim % 8; i < Dim; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+template<size_t Dim>
+__attribute__((target("avx512f,avx2,fma")))
+inline float avx512SquaredL2Fixed(const float* a, const float* b, size_t) {
+    __m512 acc[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+#pragma GCC unroll 64
+    for (size_t i = 0; i + 16 <= Dim; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc[(i / 16) % 4] = _mm512_fmadd_ps(d, d, acc[(i / 16) % 4]);
+    }
+    if constexpr (Dim % 16 != 0) {
+        constexpr __mmask16 mask = (__mmask16) ((1u << (Dim % 16)) - 1u);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + Dim - Dim % 16),
+                                 _mm512_maskz_loadu_ps(mask, b + Dim - Dim % 16));
+        acc[3] = _mm512_fmadd_ps(d, d, acc[3]);
+    }
+    return horizontalSum512(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]), _mm512_add_ps(acc[2], acc[3])));
+}
+
+template<size_t Dim>
+__attribute__((target("avx512f,avx2,fma")))
+inline float avx512InnerProductFixed(const float* a, const float* b, size_t) {
+    __m512 acc[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+#pragma GCC unroll 64
+    for (size_t i = 0; i + 16 <= Dim; i += 16) {
+        acc[(i / 16) % 4] = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc[(i / 16) % 4]);
+    }
+    if constexpr (Dim % 16 != 0) {
+        constexpr __mmask16 mask = (__mmask16) ((1u << (Dim % 16)) - 1u);
+        acc[3] = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + Dim - Dim % 16),
+                                 _mm512_maskz_loadu_ps(mask, b + Dim - Dim % 16), acc[3]);
+    }
+    return horizontalSum512(_mm512_add_ps(_mm512_add_ps(acc[0], acc[1]), _mm512_add_ps(acc[2], acc[3])));
+}
+
+#endif // DISTANCE_KERNELS_X86
+
+/* Batched kernels. Rows are scored four at a time so each query load is shared
+   by four rows and four accumulator chains run in parallel; the rows are read
+   front to back, which the hardware prefetcher streams well. */
+
+template<bool SquaredL2>
+inline void scalarDistanceBatch(const float* query, const float* rows, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = SquaredL2 ? scalarSquaredL2(query, rows + r * n, n) : scalarInnerProduct(query, rows + r * n, n);
+    }
+}
+
+#ifdef DISTANCE_KERNELS_X86
+
+template<bool SquaredL2>
+__attribute__((target("sse4.1")))
+inline void sseDistanceBatch(const float* query, const float* rows, size_t count, size_t n, float* out) {
+    size_t r = 0;
+    for (; r + 4 <= count; r += 4) {
+        const float* row = rows + r * n;
+        __m128 acc[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128 q = _mm_loadu_ps(query + i);
+            for (int k = 0; k < 4; ++k) {
+                __m128 v = _mm_loadu_ps(row + k * n + i);
+                if (SquaredL2) {
+                    __m128 d = _mm_sub_ps(v, q);
+                    acc[k] = _mm_add_ps(acc[k], _mm_mul_ps(d, d));
+                } else {
+                    acc[k] = _mm_add_ps(acc[k], _mm_mul_ps(v, q));
+                }
+            }
+        }
+        for (int k = 0; k < 4; ++k) {
+            float sum = horizontalSum128(acc[k]);
+            for (size_t j = i; j < n; ++j) {
+                float v = row[k * n + j];
+                sum += SquaredL2 ? (v - query[j]) * (v - query[j]) : v * query[j];
+            }
+            out[r + k] = sum;
+        }
+    }
+    for (; r < count; ++r) {
+        out[r] = SquaredL2 ? sseSquaredL2(query, rows + r * n, n) : sseInnerProduct(query, rows + r * n, n);
+    }
+}
+
+template<bool SquaredL2>
+__attribute__((target("avx2,fma")))
+inline void avx2DistanceBatch(const float* query, const float* rows, size_t count, size_t n, float* out) {
+    size_t r = 0;
+    for (; r + 4 <= count; r += 4) {
+        const float* row = rows + r * n;
+        __m256 acc[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 q = _mm256_loadu_ps(query + i);
+            for (int k = 0; k < 4; ++k) {
+                __m256 v = _mm256_loadu_ps(row + k * n + i);
+                if (SquaredL2) {
+                    __m256 d = _mm256_sub_ps(v, q);
+                    acc[k] = _mm256_fmadd_ps(d, d, acc[k]);
+                } else {
+                    acc[k] = _mm256_fmadd_ps(v, q, acc[k]);
+                }
+            }
+        }
+        for (int k = 0; k < 4; ++k) {
+            float sum = horizontalSum256(acc[k]);
+            for (size_t j = i; j < n; ++j) {
+                float v = row[k * n + j];
+                sum += SquaredL2 ? (v - query[j]) * (v - query[j]) : v * query[j];
+            }
+            out[r + k] = sum;
+        }
+    }
+    for (; r < count; ++r) {
+        out[r] = SquaredL2 ? avx2SquaredL2(query, rows + r * n, n) : avx2InnerProduct(query, rows + r * n, n);
+    }
+}
+
+template<bool SquaredL2>
+__attribute__((target("avx512f,avx2,fma")))
+inline void avx512DistanceBatch(const float* query, const float* rows, size_t count, size_t n, float* out) {
+    const __mmask16 tailMask = (__mmask16) ((1u << (n % 16)) - 1u);
+    size_t r = 0;
+    for (; r + 4 <= count; r += 4) {
+        const float* row = rows + r * n;
+        __m512 acc[4] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+        size_t i = 0;
+        for (; i + 16 <= n; i += 16) {
+            __m512 q = _mm512_loadu_ps(query + i);
+            for (int k = 0; k < 4; ++k) {
+                __m512 v = _mm512_loadu_ps(row + k * n + i);
+                if (SquaredL2) {
+                    __m512 d = _mm512_sub_ps(v, q);
+                    acc[k] = _mm512_fmadd_ps(d, d, acc[k]);
+                } else {
+                    acc[k] = _mm512_fmadd_ps(v, q, acc[k]);
+                }
+            }
+        }
+        if (i < n) {
+            __m512 q = _mm512_maskz_loadu_ps(tailMask, query + i);
+            for (int k = 0; k < 4; ++k) {
+                __m512 v = _mm512_maskz_loadu_ps(tailMask, row + k * n + i);
+                if (SquaredL2) {
+                    __m512 d = _mm512_sub_ps(v, q);
+                    acc[k] = _mm512_fmadd_ps(d, d, acc[k]);
+                } else {
+                    acc[k] = _mm512_fmadd_ps(v, q, acc[k]);
+                }
+            }
+        }
+        for (int k = 0; k < 4; ++k) {
+            out[r + k] = horizontalSum512(acc[k]);
+        }
+    }
+    for (; r < count; ++r) {
+        out[r] = SquaredL2 ? avx512SquaredL2(query, rows + r * n, n) : avx512InnerProduct(query, rows + r * n, n);
+    }
+}
+
+#endif // DISTANCE_KERNELS_X86
+
+/* Bounded kernels for threshold scans. The running sum is checked once per
+   unrolled chunk, so abandoning costs one horizontal add per chunk. */
+
+inline float scalarSquaredL2Bounded(const float* a, const float* b, size_t n, float bound) {
+    float sum = 0.0f;
+    size_t i = 0;
+    for (size_t blocked = n - n % 8; i < blocked; i += 8) {
+        float s0 = 0.0f, s1 = 0.0f;
+        for (size_t j = 0; j < 8; j += 2) {
+            float d0 = a[i + j] - b[i + j];
+            float d1 = a[i + j + 1] - b[i + j + 1];
+            s0 += d0 * d0;
+            s1 += d1 * d1;
+        }
+        sum += s0 + s1;
+        if (sum > bound) {
+            return sum;
+        }
+    }
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+#ifdef DISTANCE_KERNELS_X86
+
+__attribute__((target("sse4.1")))
+inline float sseSquaredL2Bounded(const float* a, const float* b, size_t n, float bound) {
+    float sum = 0.0f;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        sum += horizontalSum128(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)));
+        if (sum > bound) {
+            return sum;
+        }
+    }
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+inline float avx2SquaredL2Bounded(const float* a, const float* b, size_t n, float bound) {
+    float sum = 0.0f;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        sum += horizontalSum256(_mm256_fmadd_ps(d1, d1, _mm256_mul_ps(d0, d0)));
+        if (sum > bound) {
+            return sum;
+        }
+    }
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+inline float avx512SquaredL2Bounded(const float* a, const float* b, size_t n, float bound) {
+    float sum = 0.0f;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        sum += horizontalSum512(_mm512_fmadd_ps(d1, d1, _mm512_mul_ps(d0, d0)));
+        if (sum > bound) {
+            return sum;
+        }
+    }
+    if (i < n) {
+        // At most 31 floats left, finish them without further checks
+        sum += avx512SquaredL2(a + i, b + i, n - i);
+    }
+    return sum;
+}
+
+#endif // DISTANCE_KERNELS_X86
+
+// Picks the widest kernel set the running CPU supports.
+inline DistanceKernels detectDistanceKernels() {
+#ifdef DISTANCE_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return { SimdLevel::AVX512, avx512SquaredL2, avx512InnerProduct,
+                 avx512DistanceBatch<true>, avx512DistanceBatch<false>, avx512SquaredL2Bounded };
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return { SimdLevel::AVX2, avx2SquaredL2, avx2InnerProduct,
+                 avx2DistanceBatch<true>, avx2DistanceBatch<false>, avx2SquaredL2Bounded };
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return { SimdLevel::SSE, sseSquaredL2, sseInnerProduct,
+                 sseDistanceBatch<true>, sseDistanceBatch<false>, sseSquaredL2Bounded };
+    }
+#endif
+    return { SimdLevel::Scalar, scalarSquaredL2, scalarInnerProduct,
+             scalarDistanceBatch<true>, scalarDistanceBatch<false>, scalarSquaredL2Bounded };
+}
+
+// Kernel table for this process, detected once on first use.
+inline const DistanceKernels& getDistanceKernels() {
+    static const DistanceKernels kernels = detectDistanceKernels();
+    return kernels;
+}
+
+// Kernel table whose loops are specialized for a compile-time dimension, at the
+// same instruction set as the generic table.
+template<size_t Dim>
+inline DistanceKernels fixedDimensionKernels() {
+    DistanceKernels kernels = getDistanceKernels();
+    switch (kernels.level) {
+#ifdef DISTANCE_KERNELS_X86
+        case SimdLevel::AVX512:
+            kernels.squaredL2 = avx512SquaredL2Fixed<Dim>;
+            kernels.innerProduct = avx512InnerProductFixed<Dim>;
+            break;
+        case SimdLevel::AVX2:
+            kernels.squaredL2 = avx2SquaredL2Fixed<Dim>;
+            kernels.innerProduct = avx2InnerProductFixed<Dim>;
+            break;
+        case SimdLevel::SSE:
+            kernels.squaredL2 = sseSquaredL2Fixed<Dim>;
+            kernels.innerProduct = sseInnerProductFixed<Dim>;
+            break;
+#endif
+        default:
+            kernels.squaredL2 = scalarSquaredL2Fixed<Dim>;
+            kernels.innerProduct = scalarInnerProductFixed<Dim>;
+            break;
+    }
+    return kernels;
+}
+
+// Kernel table for vectors of the given dimension. Common embedding sizes get
+// fully unrolled kernels; any other dimension falls back to the generic loops.
+inline DistanceKernels selectDistanceKernels(size_t dimension) {
+    switch (dimension) {
+        case 96: return fixedDimensionKernels<96>();
+        case 128: return fixedDimensionKernels<128>();
+        case 384: return fixedDimensionKernels<384>();
+        case 768: return fixedDimensionKernels<768>();
+        default: return getDistanceKernels();
+    }
+}
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::AVX512: return "AVX-512";
+        case SimdLevel::AVX2: return "AVX2";
+        case SimdLevel::SSE: return "SSE";
+        default: return "scalar";
+    }
+}
+
+#endif // DISTANCE_KERNELS_HPP
@@ -2,14 +2,318 @@
 #define DISTANCES_HPP
 
 #include <vector>
+#include <string>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <strings.h>
+
+#include "DistanceKernels.hpp"
+#include "VectorBlock.hpp"
+#include "Tombstones.hpp"
 
 // Calculates the squared Euclidean distance between two vectors of floats.
-static float defaultDistance(const std::vector<float>& vec1, const std::vector<float>& vec2) {
-    float squaredDistance = 0.0f;
-    for (size_t i = 0; i < vec1.size(); ++i) {
-        squaredDistance += (vec1[i] - vec2[i]) * (vec1[i] - vec2[i]);
+inline float defaultDistance(const std::vector<float>& vec1, const std::vector<float>& vec2) {
+    return getDistanceKernels().squaredL2(vec1.data(), vec2.data(), vec1.size());
+}
+
+// Similarity measure a collection is searched with.
+enum class Metric {
+    L2 = 0,
+    InnerProduct = 1,
+    Cosine = 2
+};
+
+// Parses a metric name from the protocol ("l2", "ip"/"inner_product", "cosine").
+inline bool parseMetric(const std::string& name, Metric& metric) {
+    if (strcasecmp(name.c_str(), "l2") == 0) {
+        metric = Metric::L2;
+    } else if (strcasecmp(name.c_str(), "ip") == 0 || strcasecmp(name.c_str(), "inner_product") == 0) {
+        metric = Metric::InnerProduct;
+    } else if (strcasecmp(name.c_str(), "cosine") == 0) {
+        metric = Metric::Cosine;
+    } else {
+        return false;
     }
-    return squaredDistance; 
+    return true;
 }
 
+// The k closest (distance, index) pairs offered by a scan. Once full, the worst of
+// them is the bound any further candidate has to beat.
+class TopK {
+public:
+    explicit TopK(size_t k) : k(k) {
+        heap.reserve(k + 1);
+    }
+
+    bool full() const {
+        return heap.size() >= k;
+    }
+
+    float bound() const {
+        return full() && k > 0 ? heap.front().first : std::numeric_limits<float>::max();
+    }
+
+    void push(float distance, size_t index) {
+        if (k == 0) {
+            return;
+        }
+        if (!full()) {
+            heap.emplace_back(distance, index);
+            std::push_heap(heap.begin(), heap.end());
+        } else if (distance < heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = {distance, index};
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    // The collected pairs, closest first. Leaves the collector empty.
+    std::vector<std::pair<float, size_t>> takeSorted() {
+        std::sort_heap(heap.begin(), heap.end());
+        return std::move(heap);
+    }
+
+private:
+    size_t k;
+    std::vector<std::pair<float, size_t>> heap; // Max-heap on distance
+};
+
+// Distance evaluation bound to a collection's dimension and metric. The kernel is
+// chosen once (fixed-dimension when one exists), so algorithms holding a VectorSpace
+// pay a single indirect call per pair in their hot loops.
+//
+// Smaller is always closer: inner product is returned negated. Cosine vectors are
+// normalized once by prepare() at ingest and query time, after which cosine is a
+// plain inner product.
+//
+// storage is the element type the collection's rows are kept in; blocks made by
+// makeBlock() use it and the VectorBlock overloads score them without widening
+// them in memory first.
+struct VectorSpace {
+    int dimension;
+    Metric metric;
+    StorageType storage;
+    DistanceKernels kernels;
+
+    VectorSpace() : dimension(0), metric(Metric::L2), storage(StorageType::Float32), kernels(getDistanceKernels()) {}
+
+    explicit VectorSpace(int dimension, Metric metric = Metric::L2, StorageType storage = StorageType::Float32)
+        : dimension(dimension), metric(metric), storage(storage), kernels(selectDistanceKernels(dimension)) {}
+
+    // Reads a space written by save(); the kernels are picked again for this machine
+    explicit VectorSpace(SnapshotReader& snapshot) {
+        int dim = snapshot.read<int32_t>();
+        Metric spaceMetric = static_cast<Metric>(snapshot.read<int32_t>());
+        StorageType spaceStorage = static_cast<StorageType>(snapshot.read<int32_t>());
+        *this = VectorSpace(dim, spaceMetric, spaceStorage);
+    }
+
+    void save(SnapshotWriter& snapshot) const {
+        snapshot.write<int32_t>(dimension);
+        snapshot.write<int32_t>(static_cast<int32_t>(metric));
+        snapshot.write<int32_t>(static_cast<int32_t>(storage));
+    }
+
+    float distance(const float* a, const float* b) const {
+        if (metric == Metric::L2) {
+            return kernels.squaredL2(a, b, dimension);
+        }
+        return -kernels.innerProduct(a, b, dimension);
+    }
+
+    float distance(const std::vector<float>& a, const std::vector<float>& b) const {
+        return distance(a.data(), b.data());
+    }
+
+    // Distance from query to row index of block, whatever the block's storage type
+    float distance(const float* query, const VectorBlock& block, size_t index) const {
+        if (block.storage() == StorageType::Float32) {
+            return distance(query, block.floatRow(index));
+        }
+        float result;
+        distanceBatchContiguous(query, block, index, 1, &result);
+        return result;
+    }
+
+    // Distances from one query to count rows stored back to back, written to out
+    void distanceBatch(const float* query, const float* rows, size_t count, float* out) const {
+        if (metric == Metric::L2) {
+            kernels.squaredL2Batch(query, rows, count, dimension, out);
+            return;
+        }
+        kernels.innerProductBatch(query, rows, count, dimension, out);
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = -out[i];
+        }
+    }
+
+    // Distances from one query to count rows of block starting at first, written to out
+    void distanceBatch(const float* query, const VectorBlock& block, size_t first, size_t count, float* out) const {
+        while (count > 0) {
+            // One batched call per run of rows that share a chunk
+            size_t rows = std::min(count, block.contiguousRows(first));
+            distanceBatchContiguous(query, block, first, rows, out);
+            first += rows;
+            out += rows;
+            count -= rows;
+        }
+    }
+
+    // The distance, or some value greater than bound once it is known to exceed bound.
+    // Only L2 can stop early; an inner product can still shrink, so it is computed in full.
+    float distanceBounded(const float* a, const float* b, float bound) const {
+        if (metric == Metric::L2) {
+            return kernels.squaredL2Bounded(a, b, dimension, bound);
+        }
+        return distance(a, b);
+    }
+
+    // Offers count rows stored back to back to topK, numbered from firstIndex. Once topK
+    // is full, L2 rows are abandoned as soon as they can't beat its bound. Rows whose
+    // number is in skip are passed over. Returns the number of abandoned evaluations.
+    size_t scanTopK(const float* query, const float* rows, size_t count, size_t firstIndex, TopK& topK,
+                    const Tombstones* skip = nullptr) const {
+        size_t abandoned = 0;
+        if (metric != Metric::L2) {
+            // Nothing to abandon, so take the batched kernel a block at a time
+            constexpr size_t blockSize = 64;
+            float distances[blockSize];
+            for (size_t start = 0; start < count; start += blockSize) {
+                size_t block = std::min(blockSize, count - start);
+                distanceBatch(query, rows + start * dimension, block, distances);
+                for (size_t i = 0; i < block; ++i) {
+                    if (!skip || !skip->test(firstIndex + start + i)) {
+                        topK.push(distances[i], firstIndex + start + i);
+                    }
+                }
+            }
+            return abandoned;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (skip && skip->test(firstIndex + i)) {
+                continue;
+            }
+            const float* row = rows + i * dimension;
+            if (!topK.full()) {
+                topK.push(kernels.squaredL2(query, row, dimension), firstIndex + i);
+                continue;
+            }
+            float bound = topK.bound();
+            float distance = kernels.squaredL2Bounded(query, row, dimension, bound);
+            if (distance > bound) {
+                ++abandoned;
+            } else {
+                topK.push(distance, firstIndex + i);
+            }
+        }
+        return abandoned;
+    }
+
+    // scanTopK over count rows of a block starting at first, numbered by their index in
+    // the block. 16-bit rows are scored with the widening batch kernels and never abandoned.
+    size_t scanTopK(const float* query, const VectorBlock& block, size_t first, size_t count, TopK& topK,
+                    const Tombstones* skip = nullptr) const {
+        size_t end = first + count;
+        if (block.storage() == StorageType::Float32) {
+            size_t abandoned = 0;
+            for (size_t start = first; start < end; ) {
+                size_t rows = std::min(block.contiguousRows(start), end - start);
+                abandoned += scanTopK(query, block.floatRow(start), rows, start, topK, skip);
+                start += rows;
+            }
+            return abandoned;
+        }
+        constexpr size_t blockSize = 64;
+        float distances[blockSize];
+        for (size_t start = first; start < end; start += blockSize) {
+            size_t rows = std::min(blockSize, end - start);
+            distanceBatch(query, block, start, rows, distances);
+            for (size_t i = 0; i < rows; ++i) {
+                if (!skip || !skip->test(start + i)) {
+                    topK.push(distances[i], start + i);
+                }
+            }
+        }
+        return 0;
+    }
+
+    // scanTopK over the rows of a block listed in ids, which can sit anywhere in it
+    size_t scanTopK(const float* query, const VectorBlock& block, const std::vector<size_t>& ids, TopK& topK,
+                    const Tombstones* skip = nullptr) const {
+        if (block.storage() != StorageType::Float32 || metric != Metric::L2) {
+            for (size_t id : ids) {
+                if (!skip || !skip->test(id)) {
+                    topK.push(distance(query, block, id), id);
+                }
+            }
+            return 0;
+        }
+        size_t abandoned = 0;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            // The rows are scattered, so fetch the next one while this one is scored
+            if (i + 1 < ids.size()) {
+                __builtin_prefetch(block.floatRow(ids[i + 1]));
+            }
+            if (skip && skip->test(ids[i])) {
+                continue;
+            }
+            const float* row = block.floatRow(ids[i]);
+            if (!topK.full()) {
+                topK.push(kernels.squaredL2(query, row, dimension), ids[i]);
+                continue;
+            }
+            float bound = topK.bound();
+            float distance = kernels.squaredL2Bounded(query, row, dimension, bound);
+            if (distance > bound) {
+                ++abandoned;
+            } else {
+                topK.push(distance, ids[i]);
+            }
+        }
+        return abandoned;
+    }
+
+    VectorBlock makeBlock() const {
+        return VectorBlock(dimension, storage);
+    }
+
+private:
+    void distanceBatchContiguous(const float* query, const VectorBlock& block, size_t first, size_t count, float* out) const {
+        if (block.storage() == StorageType::Float32) {
+            distanceBatch(query, block.floatRow(first), count, out);
+            return;
+        }
+        const HalfKernels& halfKernels = getHalfKernels(block.storage());
+        if (metric == Metric::L2) {
+            halfKernels.squaredL2Batch(query, block.halfRow(first), count, dimension, out);
+            return;
+        }
+        halfKernels.innerProductBatch(query, block.halfRow(first), count, dimension, out);
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = -out[i];
+        }
+    }
+
+public:
+    // Puts a vector into the form the metric's kernel expects (unit length for cosine)
+    void prepare(std::vector<float>& vec) const {
+        if (metric != Metric::Cosine) {
+            return;
+        }
+        float norm = std::sqrt(kernels.innerProduct(vec.data(), vec.data(), vec.size()));
+        if (norm > 0.0f) {
+            for (auto& val : vec) {
+                val /= norm;
+            }
+        }
+    }
+
+    std::vector<float> prepared(const std::vector<float>& vec) const {
+        std::vector<float> result = vec;
+        prepare(result);
+        return result;
+    }
+};
+
 #endif // DISTANCES_HPP
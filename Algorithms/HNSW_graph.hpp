@@ -6,209 +6,796 @@
     #include <utility>
     #include <limits>
     #include <cmath>
-    #include <queue>
-    #include <set>
     #include <algorithm>
-    #include <cmath>
     #include <stdexcept>
     #include <unordered_set>
     #include <random>
+    #include <numeric>
+    #include <cstdint>
+    #include <cstring>
+    #include <mutex>
+    #include <atomic>
+    #include <future>
+    #include <thread>
 
-    #include "GraphNode.hpp"
     #include "VectorSearchAlgorithm.hpp"
     #include "Distances.hpp"
+    #include "VectorStore.hpp"
+    #include "SearchContext.hpp"
+    #include "RowCodes.hpp"
+
+    // What a collection's graph is built with, chosen when the collection is created
+    struct HnswParameters {
+        float mL = 0.9f;
+        int num_layers = 5;
+        int efc = 6;
+        int M = 16;
+        // Threads that link rows into the graph; 0 uses every core
+        int threads = 0;
+        Compression compression = Compression::None;
+        int rerank_factor = 4;
+
+        HnswParameters() {}
+
+        explicit HnswParameters(SnapshotReader& snapshot) {
+            mL = snapshot.read<float>();
+            num_layers = snapshot.read<int32_t>();
+            efc = snapshot.read<int32_t>();
+            M = snapshot.read<int32_t>();
+            threads = snapshot.read<int32_t>();
+            compression = static_cast<Compression>(snapshot.read<uint8_t>());
+            rerank_factor = snapshot.read<int32_t>();
+        }
+
+        void save(SnapshotWriter& snapshot) const {
+            snapshot.write<float>(mL);
+            snapshot.write<int32_t>(num_layers);
+            snapshot.write<int32_t>(efc);
+            snapshot.write<int32_t>(M);
+            snapshot.write<int32_t>(threads);
+            snapshot.write<uint8_t>(static_cast<uint8_t>(compression));
+            snapshot.write<int32_t>(rerank_factor);
+        }
+    };
 
     template<typename T>
     class HNSW_graph : public VectorSearchAlgorithm<T> {
     public:
-        using NodeValueType = std::pair<T, std::vector<float>>;
-        using Node = GraphNode<NodeValueType>;
-        using GraphLayer = std::vector<std::shared_ptr<Node>>;
-        float mL;
+        // A node is the id of its row in the collection's store
+        using NodeId = uint32_t;
+        static constexpr NodeId noNode = std::numeric_limits<NodeId>::max();
 
-        std::vector<GraphLayer> layers;
+        float mL;
         int vector_len;
         int num_layers;
         int efc;
-        float (*distanceFunction)(const std::vector<float>&, const std::vector<float>&) = defaultDistance;
-
-        HNSW_graph(const std::vector<NodeValueType>& nodeValues, 
+        // Most neighbors a node keeps in an upper layer, and in the bottom layer, which
+        // holds every node and is where searches end
+        int M;
+        int M0;
+        // Threads that link queued rows into the graph; 0 uses every core
+        int threads;
+        // What searches score nodes on while walking the graph. With codes, the bottom
+        // layer keeps ef * rerank_factor nodes, which are rescored on their rows for the
+        // ef returned. Inserts always work on the rows, and so do searches until the
+        // codes have enough rows to be trained on (RowCodes::minTrainingRows).
+        Compression compression;
+        int rerank_factor;
+        VectorSpace space;
+        std::shared_ptr<const VectorStore<T>> store;
+
+        HNSW_graph(std::shared_ptr<const VectorStore<T>> store,
+                   const VectorSpace& space,
                    float mL,
                    int vector_len,
                    int num_layers,
                    int efc,
-                   float (*distanceFunction)(const std::vector<float>&, const std::vector<float>&) = defaultDistance) :  
-                          layers (num_layers), 
+                   int M = 16,
+                   int threads = 0,
+                   uint32_t seed = std::mt19937::default_seed,
+                   Compression compression = Compression::None,
+                   int rerank_factor = 4) :
                           mL (mL),
                           vector_len (vector_len),
                           num_layers (num_layers),
                           efc (efc),
-                          distanceFunction (distanceFunction) {
-            // Create a copy of the input vector
-            std::vector<NodeValueType> shuffledValues = nodeValues;
+                          M (M),
+                          M0 (2 * M),
+                          threads (threads),
+                          compression (compression),
+                          rerank_factor (rerank_factor),
+                          space (space),
+                          store (std::move(store)),
+                          links (num_layers),
+                          rng (seed) {
+            if (num_layers <= 0 || num_layers >= absent) {
+                throw std::invalid_argument("The number of layers must be between 1 and 254.");
+            }
+            if (M <= 0 || efc <= 0) {
+                throw std::invalid_argument("M and efc must be positive.");
+            }
+            if (rerank_factor <= 0) {
+                throw std::invalid_argument("The rerank factor must be positive.");
+            }
+
+            // Every row of the store, in random order
+            std::vector<NodeId> shuffledValues(this->store->size());
+            std::iota(shuffledValues.begin(), shuffledValues.end(), 0);
+
+            // Shuffle the copied vector; with one thread, the same seed builds the same graph
+            std::shuffle(shuffledValues.begin(), shuffledValues.end(), rng);
+
+            // Insert each value into the graph, on all the threads
+            pendingRows = std::move(shuffledValues);
+            applyInserts();
+        }
 
-            // Shuffle the copied vector 
-            std::random_device rd;
-            std::mt19937 g(rd());
-            std::shuffle(shuffledValues.begin(), shuffledValues.end(), g);
+        // A graph over every row of the store, its dimension taken from the store
+        HNSW_graph(std::shared_ptr<const VectorStore<T>> store, const VectorSpace& space, const HnswParameters& parameters,
+                   uint32_t seed = std::mt19937::default_seed) :
+                   HNSW_graph(store, space, parameters.mL, store->dimension(), parameters.num_layers, parameters.efc,
+                              parameters.M, parameters.threads, seed, parameters.compression, parameters.rerank_factor) { }
+
+        // Reads a graph written by save(). The adjacency is copied out of the snapshot
+        // as it lies; no distances are computed. The section tag has already been read.
+        HNSW_graph(std::shared_ptr<const VectorStore<T>> store, SnapshotReader& snapshot) : threads (0), store (std::move(store)) {
+            mL = snapshot.read<float>();
+            vector_len = snapshot.read<int32_t>();
+            num_layers = snapshot.read<int32_t>();
+            efc = snapshot.read<int32_t>();
+            M = snapshot.read<int32_t>();
+            M0 = snapshot.read<int32_t>();
+            compression = static_cast<Compression>(snapshot.read<uint8_t>());
+            rerank_factor = snapshot.read<int32_t>();
+            space = VectorSpace(snapshot);
+            if (num_layers <= 0 || num_layers >= absent || M <= 0 || M0 <= 0 || rerank_factor <= 0) {
+                throw std::runtime_error("Snapshot graph is malformed.");
+            }
 
-            // Insert each value into the graph
-            for (const auto& value : shuffledValues) {
-                insert(value);
+            levels = snapshot.readVector<uint8_t>();
+            size_t count = levels.size();
+            links.resize(num_layers);
+            for (int layerIndex = 0; layerIndex < num_layers; ++layerIndex) {
+                auto& layer = links[layerIndex];
+                layer = snapshot.readVector<NodeId>();
+                if (layer.size() != count * stride(layerIndex)) {
+                    throw std::runtime_error("Snapshot graph layer is malformed.");
+                }
+                for (NodeId id = 0; id < count; ++id) {
+                    const NodeId* block = linksOf(layerIndex, id);
+                    if (block[0] > maxNeighbors(layerIndex)) {
+                        throw std::runtime_error("Snapshot graph layer is malformed.");
+                    }
+                    for (NodeId i = 1; i <= block[0]; ++i) {
+                        if (block[i] >= count || levels[block[i]] > layerIndex) {
+                            throw std::runtime_error("Snapshot graph refers to a missing node.");
+                        }
+                    }
+                }
+            }
+            entryPoint = snapshot.read<NodeId>();
+            if (entryPoint != noNode && (entryPoint >= count || levels[entryPoint] >= num_layers)) {
+                throw std::runtime_error("Snapshot graph refers to a missing node.");
+            }
+            codes = RowCodes(snapshot);
+            if (codes.enabled() && (codes.compression() != compression || codes.size() < count)) {
+                throw std::runtime_error("Snapshot graph codes are malformed.");
             }
         }
 
         // Default constructor
-        HNSW_graph() : mL(0.9f) { 
-            layers = std::vector<GraphLayer>(num_layers); // Initialize layers based on the num_layers template argument
-        }
+        HNSW_graph() : mL(0.9f), vector_len(0), num_layers(1), efc(1), M(1), M0(2), threads(0),
+                       compression(Compression::None), rerank_factor(1), links(1) { }
 
-        std::vector<std::shared_ptr<Node>> search_layer(int layerIndex, const std::shared_ptr<Node>& startNode, const std::vector<float>& queryVec, size_t ef = 1) {
+        // Closest nodes to the query found from startNode in one layer, nearest first.
+        // With liveOnly, rows deleted from the store are still walked through but left out of the results.
+        std::vector<NodeId> search_layer(int layerIndex, NodeId startNode, const float* queryVec, size_t ef = 1,
+                                         bool liveOnly = false) const {
             if (layerIndex < 0 || layerIndex >= num_layers) throw std::out_of_range("Layer index is out of range.");
+            auto& context = SearchContext<NodeId>::local();
+            auto exact = [&](NodeId node) { return distanceTo(queryVec, node); };
+            searchLayer(context, layerIndex, startNode, exact, ef, liveOnly, false);
+            return nodesOf(context.sortedNearest());
+        }
 
-            std::unordered_set<std::shared_ptr<Node>> visited_nodes;
-        
-            // Max heap for nearest_neighbors based on distance
-            auto maxCompare = [](const std::pair<float, std::shared_ptr<Node>>& a, const std::pair<float, std::shared_ptr<Node>>& b) {
-                return a.first < b.first;
-            };
-            std::priority_queue<std::pair<float, std::shared_ptr<Node>>, 
-                                std::vector<std::pair<float, std::shared_ptr<Node>>>, 
-                                decltype(maxCompare)> nearest_neighbors(maxCompare);
+        std::vector<std::pair<T, std::vector<float>>> searchClosest (const std::vector<float>& target, const int ef = 1) override {
+            // Each node's row key and vector, from the store
+            return store->entries(searchRows(target, ef));
+        }
 
-            // Min heap for candidates based on distance
-            auto minCompare = [](const std::pair<float, std::shared_ptr<Node>>& a, const std::pair<float, std::shared_ptr<Node>>& b) {
-                return a.first > b.first;
-            };
-            std::priority_queue<std::pair<float, std::shared_ptr<Node>>, 
-                                std::vector<std::pair<float, std::shared_ptr<Node>>>, 
-                                decltype(minCompare)> candidates(minCompare);
+        std::vector<size_t> searchRows (const std::vector<float>& target, const int ef = 1) override {
+            auto& context = SearchContext<NodeId>::local();
+            if (!searchInto(context, target.data(), ef)) {
+                return {};
+            }
+            const auto& nearest = context.sortedNearest();
+            std::vector<size_t> rows(nearest.size());
+            for (size_t i = 0; i < nearest.size(); ++i) {
+                rows[i] = nearest[i].second;
+            }
+            return rows;
+        }
 
-            float initialDistance = distanceFunction(startNode->value.second, queryVec);
-            candidates.emplace(initialDistance, startNode);
-            nearest_neighbors.emplace(initialDistance, startNode);
-            visited_nodes.insert(startNode);
+        std::vector<NodeId> search(const std::vector<float>& queryVec, size_t ef = 1) {
+            return search(queryVec.data(), ef);
+        }
+
+        std::vector<NodeId> search(const float* queryVec, size_t ef = 1) {
+            auto& context = SearchContext<NodeId>::local();
+            if (!searchInto(context, queryVec, ef)) {
+                return {};
+            }
+            return nodesOf(context.sortedNearest());
+        }
 
-            while (!candidates.empty()) {
-                auto current = candidates.top();
-                candidates.pop();
+        // Queues row id. Queued rows are linked together, in parallel, the next time the
+        // graph is searched, saved or relinked, so a burst of adds between queries is
+        // inserted on all the threads instead of one row at a time.
+        void addRow(size_t id) override {
+            applyRemovals();
+            if (id >= noNode) {
+                throw std::length_error("Too many rows for 32-bit node ids.");
+            }
+            pendingRows.push_back(id);
+        }
 
-                // If nearest_neighbors is full and current candidate is not closer, break
-                if (nearest_neighbors.size() > 0 && current.first > nearest_neighbors.top().first) {
-                    break;
-                }
+        // Row id leaves the graph and the store's last row takes its id. Renumbering
+        // means rewriting every edge that points at either row, so removals are only
+        // recorded here and applied together, in one pass over the layers, the next
+        // time the graph is used.
+        void removeRow(size_t id) override {
+            size_t last = store->size() - 1;
+            if (!removalsPending) {
+                // Queued rows are linked under the ids they were added with
+                applyInserts();
+                reserveRows(store->size());
+                codes.encodeRows(store->vectors(), levels.size());
+                originalIds.resize(store->size());
+                std::iota(originalIds.begin(), originalIds.end(), 0);
+                removalsPending = true;
+            }
+            originalIds[id] = originalIds[last];
+            originalIds.pop_back();
+        }
 
-                // Continue searching through adjacents
-                for (auto neighbor : current.second->adjacentsByGraph[layerIndex]) {
-                    if (visited_nodes.insert(neighbor).second) { // Node wasn't visited before
-                        float distance = distanceFunction(neighbor->value.second, queryVec);
-                        if (distance < nearest_neighbors.top().first || nearest_neighbors.size() < ef) {
-                            candidates.push({distance, neighbor});
-                            nearest_neighbors.push({distance, neighbor});
-                            if (nearest_neighbors.size() > ef) {
-                                nearest_neighbors.pop();
+        // Relinks the graph around the rows marked deleted in the store, so removing them
+        // afterwards leaves no holes. In each layer, a node that points at deleted nodes is
+        // refilled to its former degree from the nearest live nodes found through them.
+        void consolidateDeletes() override {
+            consolidateDeletesIn(0, std::numeric_limits<size_t>::max());
+        }
+
+        void consolidateDeletesIn(size_t first, size_t end) override {
+            applyRemovals();
+            applyInserts();
+            if (!store->tombstones().any()) {
+                return;
+            }
+            auto isDeleted = [&](NodeId node) {
+                return store->isDeleted(node);
+            };
+            std::vector<float> scratch;
+            std::vector<NodeId> deletedNeighbors;
+            end = std::min<size_t>(end, levels.size());
+            for (NodeId node = static_cast<NodeId>(std::min(first, end)); node < end; ++node) {
+                if (levels[node] == absent || isDeleted(node)) {
+                    continue;
+                }
+                for (int layerIndex = 0; layerIndex < num_layers; ++layerIndex) {
+                    NodeId* block = linksOf(layerIndex, node);
+                    if (std::none_of(block + 1, block + 1 + block[0], isDeleted)) {
+                        continue;
+                    }
+                    size_t degree = block[0];
+                    deletedNeighbors.clear();
+                    NodeId kept = 0;
+                    for (NodeId i = 1; i <= degree; ++i) {
+                        if (isDeleted(block[i])) {
+                            deletedNeighbors.push_back(block[i]);
+                        } else {
+                            block[++kept] = block[i];
+                        }
+                    }
+                    block[0] = kept;
+
+                    // Live nodes one hop past the deleted neighbors, nearest first
+                    const float* vec = store->row(node, scratch);
+                    std::vector<std::pair<float, NodeId>> candidates;
+                    std::unordered_set<NodeId> seen(block + 1, block + 1 + kept);
+                    for (NodeId removed : deletedNeighbors) {
+                        const NodeId* next = linksOf(layerIndex, removed);
+                        for (NodeId i = 1; i <= next[0]; ++i) {
+                            if (next[i] != node && !isDeleted(next[i]) && seen.insert(next[i]).second) {
+                                candidates.emplace_back(distanceTo(vec, next[i]), next[i]);
                             }
                         }
                     }
+                    std::sort(candidates.begin(), candidates.end());
+
+                    for (const auto& [distance, candidate] : candidates) {
+                        if (block[0] >= degree) {
+                            break;
+                        }
+                        connectNodesInLayer(node, candidate, layerIndex);
+                    }
                 }
             }
+        }
 
-            // Transfer from max heap to vector without reversing
-            std::vector<std::shared_ptr<Node>> result;
-            while (!nearest_neighbors.empty()) {
-                result.insert(result.begin(), nearest_neighbors.top().second); // Insert at the beginning
-                nearest_neighbors.pop();
+        // Every row's node and neighbor blocks move to its new id, and every edge follows
+        void permuteRows(const std::vector<size_t>& newIds) override {
+            applyRemovals();
+            applyInserts();
+            reserveRows(newIds.size());
+            codes.encodeRows(store->vectors(), levels.size());
+
+            std::vector<uint8_t> newLevels(levels.size());
+            std::vector<std::vector<NodeId>> newLinks(num_layers);
+            for (int layerIndex = 0; layerIndex < num_layers; ++layerIndex) {
+                newLinks[layerIndex].assign(levels.size() * stride(layerIndex), 0);
+            }
+            for (NodeId id = 0; id < levels.size(); ++id) {
+                NodeId to = newIds[id];
+                newLevels[to] = levels[id];
+                for (int layerIndex = 0; layerIndex < num_layers; ++layerIndex) {
+                    const NodeId* from = linksOf(layerIndex, id);
+                    NodeId* block = newLinks[layerIndex].data() + to * stride(layerIndex);
+                    block[0] = from[0];
+                    for (NodeId i = 1; i <= from[0]; ++i) {
+                        block[i] = newIds[from[i]];
+                    }
+                }
             }
 
-            return result;
+            codes.permute(newIds);
+            levels.swap(newLevels);
+            links.swap(newLinks);
+            if (entryPoint != noNode) {
+                entryPoint = newIds[entryPoint];
+            }
         }
 
-        std::vector<std::pair<T, std::vector<float>>> searchClosest (const std::vector<float>& target, const int ef = 1) override {
-            auto nodes = search (target, ef);
+        // The bottom layer, which every search ends in, from the entry point
+        bool rowGraph(RowGraph& graph) override {
+            applyRemovals();
+            applyInserts();
+            int bottom = num_layers - 1;
+            graph.offsets.assign(1, 0);
+            graph.targets.clear();
+            for (NodeId id = 0; id < levels.size(); ++id) {
+                const NodeId* block = linksOf(bottom, id);
+                graph.targets.insert(graph.targets.end(), block + 1, block + 1 + block[0]);
+                graph.offsets.push_back(graph.targets.size());
+            }
+            graph.start = entryPoint == noNode ? 0 : entryPoint;
+            return true;
+        }
+
+        // Parameters, then the layer each row's node starts at, then every layer's
+        // neighbor blocks as they lie in memory, then the entry point and the codes.
+        // Queued rows and removals must have been applied, with prepareForSave().
+        void save(SnapshotWriter& snapshot) const override {
+            if (removalsPending || !pendingRows.empty()) {
+                throw std::logic_error("The graph has changes queued; apply them before saving it.");
+            }
+            snapshot.section(SnapshotSection::HNSW);
+            snapshot.write<float>(mL);
+            snapshot.write<int32_t>(vector_len);
+            snapshot.write<int32_t>(num_layers);
+            snapshot.write<int32_t>(efc);
+            snapshot.write<int32_t>(M);
+            snapshot.write<int32_t>(M0);
+            snapshot.write<uint8_t>(static_cast<uint8_t>(compression));
+            snapshot.write<int32_t>(rerank_factor);
+            space.save(snapshot);
+            snapshot.writeArray(levels);
+            for (int layerIndex = 0; layerIndex < num_layers; ++layerIndex) {
+                snapshot.writeArray(links[layerIndex].data(), levels.size() * stride(layerIndex));
+            }
+            snapshot.write<NodeId>(entryPoint);
+            codes.save(snapshot);
+        }
 
-            // Prepare the result vector with the appropriate format
-            std::vector<std::pair<T, std::vector<float>>> results;
-            results.reserve(nodes.size());
+        // Bytes held by the graph itself; the rows belong to the shared store
+        size_t memoryBytes() const {
+            size_t bytes = levels.capacity() + (originalIds.capacity() + pendingRows.capacity()) * sizeof(NodeId)
+                         + codes.memoryBytes();
+            for (const auto& layer : links) {
+                bytes += layer.capacity() * sizeof(NodeId);
+            }
+            return bytes;
+        }
 
-            // Transform each node into the required format: a pair of T (node value) and vector<float> (node vector)
-            for (const auto& node : nodes) {
-                results.emplace_back(node->value.first, node->value.second);
+        // Rows [first, end) were appended together; they are linked now, on all the threads
+        void addRows(size_t first, size_t end) override {
+            for (size_t id = first; id < end; ++id) {
+                addRow(id);
             }
+            applyInserts();
+        }
+
+        // Applies the removals recorded and links the rows queued since the graph was
+        // last used, as the next search would
+        void applyPending() {
+            applyRemovals();
+            applyInserts();
+        }
+
+        void prepareForSave() override {
+            applyPending();
+        }
 
-            return results; 
+        // Links row id of the store into the graph now
+        void insert(size_t value) {
+            addRow(value);
+            applyInserts();
         }
 
-        std::vector<std::shared_ptr<Node>> search(const std::vector<float>& queryVec, size_t ef = 1) {
-            std::vector<std::shared_ptr<Node>> result;
-            if (layers.empty() || layers[0].empty()) {
-                return result;
+        // Method to connect two nodes within a specific layer
+        void connectNodesInLayer(NodeId node1, NodeId node2, int layerIndex) {
+            if (layerIndex < 0 || layerIndex >= num_layers || node1 >= levels.size() || node2 >= levels.size()) {
+                throw std::invalid_argument("Invalid layer index or node id.");
             }
 
-            auto bestNode = layers[0][0];
-            for (int i = 0; i < num_layers; ++i) {
-                bestNode = search_layer(i, bestNode, queryVec)[0];
+            addEdge(node1, node2, layerIndex);
+            addEdge(node2, node1, layerIndex);
+        }
+
+    private:
+        static constexpr uint8_t absent = std::numeric_limits<uint8_t>::max();
+        // Neighbor lists are locked by node id modulo this; a node's list is only ever
+        // locked on its own, so two nodes sharing a lock can't deadlock
+        static constexpr size_t lockStripes = 4096;
+        // Fewest queued rows worth starting another thread for
+        static constexpr size_t rowsPerThread = 256;
+
+        // For every layer, a block of 1 + maxNeighbors ids per row: the neighbor count,
+        // then the neighbors. A hop reads one contiguous block; there's nothing to chase.
+        std::vector<std::vector<NodeId>> links;
+        // First layer each row's node was linked into, or absent for rows without a node
+        std::vector<uint8_t> levels;
+        // A node in the highest layer reached; every search and insert starts there
+        NodeId entryPoint = noNode;
+        // While removals are pending, the pre-removal id of each row, by current id
+        std::vector<NodeId> originalIds;
+        bool removalsPending = false;
+        // Draws the insertion order of a build and every node's level
+        std::mt19937 rng;
+        // Rows added since the graph was last used, in the order they came
+        std::vector<NodeId> pendingRows;
+        // Codes of the rows searches walk over, trained on the rows there are when the
+        // first ones are linked
+        RowCodes codes;
+        mutable std::vector<std::mutex> linkLocks = std::vector<std::mutex>(lockStripes);
+        // Held to read the entry point while inserting, and for the whole insert of a
+        // node that will reach above it, so only one node at a time can take it over
+        std::mutex entryLock;
+
+        std::mutex& linkLock(NodeId node) const {
+            return linkLocks[node % lockStripes];
+        }
+
+        NodeId maxNeighbors(int layerIndex) const {
+            return layerIndex == num_layers - 1 ? M0 : M;
+        }
+
+        size_t stride(int layerIndex) const { return static_cast<size_t>(maxNeighbors(layerIndex)) + 1; }
+
+        NodeId* linksOf(int layerIndex, NodeId node) {
+            return links[layerIndex].data() + node * stride(layerIndex);
+        }
+
+        const NodeId* linksOf(int layerIndex, NodeId node) const {
+            return links[layerIndex].data() + node * stride(layerIndex);
+        }
+
+        // Makes room for rows [0, count)
+        void reserveRows(size_t count) {
+            if (count > levels.size()) {
+                levels.resize(count, absent);
+                for (int layerIndex = 0; layerIndex < num_layers; ++layerIndex) {
+                    links[layerIndex].resize(count * stride(layerIndex), 0);
+                }
+            }
+        }
+
+        // The diversity heuristic of the HNSW paper. Going through candidates nearest
+        // first, one is kept only if it is closer to the node than to every neighbor kept
+        // so far, so a cluster is reached through one edge and the rest of the list goes
+        // to other directions, like the long edges between clusters that searches cross
+        // on. With keepPruned, the list is topped up to the limit with the nearest of
+        // the candidates turned away.
+        std::vector<NodeId> selectNeighbors(std::vector<std::pair<float, NodeId>>& candidates, size_t limit,
+                                            bool keepPruned) const {
+            std::sort(candidates.begin(), candidates.end());
+            std::vector<NodeId> kept;
+            std::vector<NodeId> pruned;
+            kept.reserve(limit);
+            std::vector<float> scratch;
+            for (const auto& [distance, candidate] : candidates) {
+                if (kept.size() >= limit) {
+                    break;
+                }
+                const float* candidateVec = store->row(candidate, scratch);
+                bool diverse = true;
+                for (size_t i = 0; i < kept.size() && diverse; ++i) {
+                    diverse = distanceTo(candidateVec, kept[i]) >= distance;
+                }
+                if (diverse) {
+                    kept.push_back(candidate);
+                } else if (keepPruned) {
+                    pruned.push_back(candidate);
+                }
+            }
+            for (size_t i = 0; kept.size() < limit && i < pruned.size(); ++i) {
+                kept.push_back(pruned[i]);
+            }
+            return kept;
+        }
+
+        // Adds the edge from -> to. A full list is cut back to the layer's limit with
+        // selectNeighbors, so no node's degree grows with the graph.
+        void addEdge(NodeId from, NodeId to, int layerIndex) {
+            std::lock_guard<std::mutex> lock(linkLock(from));
+            NodeId* block = linksOf(layerIndex, from);
+            if (std::find(block + 1, block + 1 + block[0], to) != block + 1 + block[0]) {
+                return;
+            }
+            NodeId limit = maxNeighbors(layerIndex);
+            if (block[0] < limit) {
+                block[++block[0]] = to;
+                return;
             }
-            auto results = search_layer(num_layers - 1, bestNode, queryVec, ef);
-            for (const auto& r : results) {
-                result.push_back(r);
+
+            std::vector<float> scratch;
+            const float* vec = store->row(from, scratch);
+            std::vector<std::pair<float, NodeId>> candidates;
+            candidates.reserve(limit + 1);
+            for (NodeId i = 1; i <= block[0]; ++i) {
+                candidates.emplace_back(distanceTo(vec, block[i]), block[i]);
             }
+            candidates.emplace_back(distanceTo(vec, to), to);
 
-            return result;
+            auto kept = selectNeighbors(candidates, limit, true);
+            block[0] = kept.size();
+            std::copy(kept.begin(), kept.end(), block + 1);
         }
 
-        void insert(NodeValueType value) {
-            std::shared_ptr<Node> new_node = std::make_shared<Node>(value);
-            
-            if (layers[0].empty()) {
-                for(auto& layer : layers) {
-                    layer.push_back(new_node);
+        // Links every queued row. Levels are drawn up front, in queue order, then the rows
+        // are spread over the threads; all the room they need is made beforehand, so no
+        // layer moves while they link.
+        void applyInserts() {
+            if (pendingRows.empty()) {
+                return;
+            }
+            std::vector<NodeId> rows;
+            rows.swap(pendingRows);
+            reserveRows(static_cast<size_t>(*std::max_element(rows.begin(), rows.end())) + 1);
+            // A graph built before the collection had rows picks up its dimension from the store
+            if (space.dimension == 0) {
+                space = VectorSpace(store->dimension(), space.metric, space.storage);
+            }
+            // Codes are trained once there are enough rows, and again as the rows grow
+            if (codes.needsTraining(compression, store->size())) {
+                codes = RowCodes(compression, store->vectors(), space.metric);
+            }
+            codes.encodeRows(store->vectors(), levels.size());
+            for (NodeId node : rows) {
+                levels[node] = calculate_insertion_layer();
+            }
+
+            size_t workers = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+            workers = std::min(workers, std::max<size_t>(1, rows.size() / rowsPerThread));
+            if (workers == 1) {
+                for (NodeId node : rows) {
+                    linkNode(node, false);
                 }
                 return;
             }
 
-            int insertion_layer = calculate_insertion_layer();
-            auto& curr_node = layers[0][0];
-            for (int i = 0; i < num_layers; i++) {
+            std::atomic<size_t> next(0);
+            std::vector<std::future<void>> futures;
+            for (size_t w = 0; w < workers; ++w) {
+                futures.push_back(std::async(std::launch::async, [this, &rows, &next]() {
+                    for (size_t i = next++; i < rows.size(); i = next++) {
+                        linkNode(rows[i], true);
+                    }
+                }));
+            }
+            for (auto& fut : futures) {
+                fut.get();
+            }
+        }
+
+        // Best-first search of one layer from startNode, leaving at most ef of the nearest
+        // nodes it finds in context. distanceOf scores a node against the query. With
+        // liveOnly, rows deleted from the store are still walked through but not kept.
+        // With lockLinks, each neighbor list is copied out under its lock, for searches
+        // made while other threads are inserting.
+        template<typename Distance>
+        void searchLayer(SearchContext<NodeId>& context, int layerIndex, NodeId startNode, Distance&& distanceOf,
+                         size_t ef, bool liveOnly, bool lockLinks) const {
+            context.begin(levels.size());
+            auto admits = [&](NodeId node) {
+                return !liveOnly || !store->isDeleted(node);
+            };
+
+            float initialDistance = distanceOf(startNode);
+            context.pushCandidate(initialDistance, startNode);
+            if (admits(startNode)) {
+                context.pushNearest(initialDistance, startNode, ef);
+            }
+            context.visit(startNode);
+
+            while (context.hasCandidates()) {
+                auto current = context.popCandidate();
+
+                // If the nearest are full and the current candidate is not closer, stop
+                if (context.nearestCount() >= ef && current.first > context.farthest()) {
+                    break;
+                }
+
+                // Continue searching through adjacents, straight from the layer's id array
+                const NodeId* block = linksOf(layerIndex, current.second);
+                if (lockLinks) {
+                    std::lock_guard<std::mutex> lock(linkLock(current.second));
+                    context.neighbors.assign(block, block + 1 + block[0]);
+                    block = context.neighbors.data();
+                }
+                for (NodeId i = 1; i <= block[0]; ++i) {
+                    NodeId neighbor = block[i];
+                    if (context.visit(neighbor)) { // Node wasn't visited before
+                        float distance = distanceOf(neighbor);
+                        if (context.nearestCount() < ef || distance < context.farthest()) {
+                            context.pushCandidate(distance, neighbor);
+                            if (admits(neighbor)) {
+                                context.pushNearest(distance, neighbor, ef);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // Greedy through the layers the entry point is in, then a search of the bottom
+        // one that leaves the nearest live nodes in context. False if the graph is empty.
+        bool searchInto(SearchContext<NodeId>& context, const float* queryVec, size_t ef) {
+            applyRemovals();
+            applyInserts();
+            if (entryPoint == noNode) {
+                return false;
+            }
+            auto exact = [&](NodeId node) { return distanceTo(queryVec, node); };
+            if (!codes.enabled()) {
+                descend(context, exact, ef);
+                return true;
+            }
+            static thread_local RowCodes::Query query;
+            codes.prepare(queryVec, query);
+            descend(context, [&](NodeId node) { return codes.distance(query, node); }, ef * rerank_factor);
+            context.rescoreNearest(exact, ef);
+            return true;
+        }
+
+        template<typename Distance>
+        void descend(SearchContext<NodeId>& context, Distance&& distanceOf, size_t ef) const {
+            NodeId bestNode = entryPoint;
+            for (int i = levels[entryPoint]; i < num_layers - 1; ++i) {
+                searchLayer(context, i, bestNode, distanceOf, 1, false, false);
+                bestNode = context.sortedNearest().front().second;
+            }
+            searchLayer(context, num_layers - 1, bestNode, distanceOf, ef, true, false);
+        }
+
+        static std::vector<NodeId> nodesOf(const std::vector<std::pair<float, NodeId>>& nearest) {
+            std::vector<NodeId> nodes(nearest.size());
+            for (size_t i = 0; i < nearest.size(); ++i) {
+                nodes[i] = nearest[i].second;
+            }
+            return nodes;
+        }
+
+        // Links node, whose level is set, into every layer from its level down. Safe to run
+        // on several nodes at once, with concurrent set to lock the lists it reads.
+        void linkNode(NodeId node, bool concurrent) {
+            int insertion_layer = levels[node];
+            std::unique_lock<std::mutex> entryGuard(entryLock);
+            if (entryPoint == noNode) {
+                entryPoint = node;
+                return;
+            }
+            int entryLayer = levels[entryPoint];
+            NodeId curr_node = entryPoint;
+            if (insertion_layer >= entryLayer) {
+                entryGuard.unlock();
+            }
+
+            std::vector<float> scratch;
+            const float* vec = store->row(node, scratch);
+            auto& context = SearchContext<NodeId>::local();
+            auto exact = [&](NodeId other) { return distanceTo(vec, other); };
+            std::vector<std::pair<float, NodeId>> candidates;
+            // Layers above the entry point's hold no other node to link to
+            for (int i = entryLayer; i < num_layers; i++) {
                 if (i < insertion_layer) {
-                    curr_node = search_layer(i, curr_node, value.second)[0];
+                    searchLayer(context, i, curr_node, exact, 1, false, concurrent);
+                    curr_node = context.sortedNearest().front().second;
                 } else {
-                    auto nearest_neighbors = search_layer (i, curr_node, value.second, efc);
-                    for (auto& neighbor : nearest_neighbors) {
-                        connectNodesInLayer(neighbor, new_node, i);
+                    searchLayer(context, i, curr_node, exact, std::max(efc, M), false, concurrent);
+                    const auto& nearest = context.sortedNearest();
+                    candidates.assign(nearest.begin(), nearest.end());
+                    for (NodeId neighbor : selectNeighbors(candidates, maxNeighbors(i), false)) {
+                        connectNodesInLayer(node, neighbor, i);
                     }
-                    curr_node = nearest_neighbors[0]; 
-                    //layers[i].push_back(new_node);
+                    curr_node = candidates.front().second;
                 }
             }
+
+            // The node reaching highest becomes where searches start
+            if (insertion_layer < entryLayer) {
+                entryPoint = node;
+            }
         }
 
+        // Renumbers the graph after a run of removeRow calls: rows keep their blocks
+        // under their new ids, and edges to removed rows are dropped. A removed entry
+        // point hands over to a remaining node of the highest layer left.
+        void applyRemovals() {
+            if (!removalsPending) {
+                return;
+            }
+            std::vector<NodeId> renumbered(levels.size(), noNode);
+            for (NodeId id = 0; id < originalIds.size(); ++id) {
+                renumbered[originalIds[id]] = id;
+            }
 
+            std::vector<uint8_t> newLevels(originalIds.size());
+            std::vector<std::vector<NodeId>> newLinks(num_layers);
+            for (int layerIndex = 0; layerIndex < num_layers; ++layerIndex) {
+                newLinks[layerIndex].assign(originalIds.size() * stride(layerIndex), 0);
+            }
+            for (NodeId id = 0; id < originalIds.size(); ++id) {
+                newLevels[id] = levels[originalIds[id]];
+                for (int layerIndex = 0; layerIndex < num_layers; ++layerIndex) {
+                    const NodeId* from = linksOf(layerIndex, originalIds[id]);
+                    NodeId* to = newLinks[layerIndex].data() + id * stride(layerIndex);
+                    for (NodeId i = 1; i <= from[0]; ++i) {
+                        if (renumbered[from[i]] != noNode) {
+                            to[++to[0]] = renumbered[from[i]];
+                        }
+                    }
+                }
+            }
 
-        // Additional functionalities...
-        // Method to add a new node to a specific layer
-        void addNodeToLayer(const T& value, const std::vector<float>& vector, int layerIndex) {
-            if (layerIndex < 0 || layerIndex >= num_layers) {
-                throw std::out_of_range("Layer index is out of range.");
+            NodeId newEntry = entryPoint == noNode ? noNode : renumbered[entryPoint];
+            if (entryPoint != noNode && newEntry == noNode) {
+                for (NodeId id = 0; id < newLevels.size(); ++id) {
+                    if (newLevels[id] != absent && (newEntry == noNode || newLevels[id] < newLevels[newEntry])) {
+                        newEntry = id;
+                    }
+                }
             }
-            auto newNode = std::make_shared<Node>(NodeValueType(value, vector));
-            layers[layerIndex].push_back(newNode);
+
+            codes.keepRows(originalIds);
+            levels.swap(newLevels);
+            links.swap(newLinks);
+            entryPoint = newEntry;
+            originalIds.clear();
+            originalIds.shrink_to_fit();
+            removalsPending = false;
         }
 
-        // Method to connect two nodes within a specific layer
-        void connectNodesInLayer(std::shared_ptr<Node> node1, std::shared_ptr<Node> node2, int layerIndex) {
-            if (layerIndex < 0 || layerIndex >= num_layers || !node1 || !node2) {
-                throw std::invalid_argument("Invalid layer index or node pointer.");
-            }
-            
-            node1->addEdge(layerIndex, node2);
-            node2->addEdge(layerIndex, node1);
+        // Distance from the query to the row behind node
+        float distanceTo(const float* queryVec, NodeId node) const {
+            return space.distance(queryVec, store->vectors(), node);
         }
 
-    private:
+        // Every node is in the bottom layer, and reaches each layer above with probability
+        // exp(-1 / mL) of reaching the one below; layers are numbered from the top
         int calculate_insertion_layer() {
-            // mL is a multiplicative factor used to normalize the distribution
-            int l = -static_cast<int>(std::log(static_cast<double>(std::rand()) / RAND_MAX) * mL);
-            return std::min(l, num_layers - 1);
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            int level = static_cast<int>(-std::log(1.0 - uniform(rng)) * mL);
+            return num_layers - 1 - std::min(level, num_layers - 1);
         }
     };
 
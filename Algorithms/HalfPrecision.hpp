@@ -0,0 +1,373 @@
+#ifndef HALF_PRECISION_HPP
+#define HALF_PRECISION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <strings.h>
+
+#include "DistanceKernels.hpp"
+
+// Element type a collection keeps its vectors in. The 16-bit formats halve memory
+// and bandwidth; queries stay float32 and rows are widened inside the kernels.
+enum class StorageType {
+    Float32 = 0,
+    Float16 = 1,
+    BFloat16 = 2
+};
+
+// Parses a storage type name from the protocol ("f32", "f16"/"fp16", "bf16").
+inline bool parseStorageType(const std::string& name, StorageType& storage) {
+    if (strcasecmp(name.c_str(), "f32") == 0 || strcasecmp(name.c_str(), "float32") == 0) {
+        storage = StorageType::Float32;
+    } else if (strcasecmp(name.c_str(), "f16") == 0 || strcasecmp(name.c_str(), "fp16") == 0 || strcasecmp(name.c_str(), "float16") == 0) {
+        storage = StorageType::Float16;
+    } else if (strcasecmp(name.c_str(), "bf16") == 0 || strcasecmp(name.c_str(), "bfloat16") == 0) {
+        storage = StorageType::BFloat16;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline const char* storageTypeName(StorageType storage) {
+    switch (storage) {
+        case StorageType::Float16: return "fp16";
+        case StorageType::BFloat16: return "bf16";
+        default: return "fp32";
+    }
+}
+
+/* Scalar conversions, round to nearest even like the hardware instructions */
+
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t magnitude = bits & 0x7FFFFFFFu;
+
+    if (magnitude >= 0x7F800000u) {
+        // Infinity stays infinity, any NaN becomes a quiet NaN
+        return sign | (magnitude > 0x7F800000u ? 0x7E00u : 0x7C00u);
+    }
+    if (magnitude >= 0x477FF000u) {
+        return sign | 0x7C00u; // Rounds past the largest half, 65504
+    }
+    if (magnitude < 0x38800000u) {
+        // Below the smallest normal half: produce a subnormal, or zero
+        if (magnitude <= 0x33000000u) {
+            return sign;
+        }
+        uint32_t mantissa = (magnitude & 0x7FFFFFu) | 0x800000u;
+        uint32_t shift = 126u - (magnitude >> 23);
+        uint32_t result = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1u);
+        uint32_t halfway = 1u << (shift - 1u);
+        if (remainder > halfway || (remainder == halfway && (result & 1u))) {
+            ++result;
+        }
+        return sign | result;
+    }
+    // Rebias the exponent from 127 to 15 and drop 13 mantissa bits; a carry out of
+    // the mantissa correctly bumps the exponent
+    uint32_t result = (magnitude - 0x38000000u) >> 13;
+    uint32_t remainder = magnitude & 0x1FFFu;
+    if (remainder > 0x1000u || (remainder == 0x1000u && (result & 1u))) {
+        ++result;
+    }
+    return sign | result;
+}
+
+inline float halfToFloat(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000u) << 16;
+    uint32_t exponent = (half >> 10) & 0x1Fu;
+    uint32_t mantissa = half & 0x3FFu;
+    uint32_t bits;
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            // Subnormal: mantissa units of 2^-24
+            float value = static_cast<float>(mantissa) * (1.0f / 16777216.0f);
+            return sign ? -value : value;
+        }
+    } else if (exponent == 31) {
+        bits = sign | 0x7F800000u | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112u) << 23) | (mantissa << 13);
+    }
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline uint16_t floatToBFloat16(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7FFFFFFFu) > 0x7F800000u) {
+        return static_cast<uint16_t>((bits >> 16) | 0x40u); // Keep NaNs quiet
+    }
+    bits += 0x7FFFu + ((bits >> 16) & 1u);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float bfloat16ToFloat(uint16_t value) {
+    uint32_t bits = static_cast<uint32_t>(value) << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+template<StorageType Storage>
+inline float decodeElement(uint16_t value) {
+    if constexpr (Storage == StorageType::Float16) {
+        return halfToFloat(value);
+    } else {
+        return bfloat16ToFloat(value);
+    }
+}
+
+template<StorageType Storage>
+inline uint16_t encodeElement(float value) {
+    if constexpr (Storage == StorageType::Float16) {
+        return floatToHalf(value);
+    } else {
+        return floatToBFloat16(value);
+    }
+}
+
+// Table of kernels for rows stored in one 16-bit format. The query is always float32.
+struct HalfKernels {
+    SimdLevel level;
+    // One query against count encoded rows of length n stored back to back
+    void (*squaredL2Batch)(const float* query, const uint16_t* rows, size_t count, size_t n, float* out);
+    void (*innerProductBatch)(const float* query, const uint16_t* rows, size_t count, size_t n, float* out);
+    void (*encode)(const float* in, uint16_t* out, size_t n);
+    void (*decode)(const uint16_t* in, float* out, size_t n);
+};
+
+/* Scalar fallback */
+
+template<StorageType Storage, bool SquaredL2>
+inline float scalarHalfDistance(const float* query, const uint16_t* row, size_t n) {
+    float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (size_t i = 0; i < n; ++i) {
+        float value = decodeElement<Storage>(row[i]);
+        if constexpr (SquaredL2) {
+            float d = query[i] - value;
+            acc[i % 4] += d * d;
+        } else {
+            acc[i % 4] += query[i] * value;
+        }
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+template<StorageType Storage, bool SquaredL2>
+inline void scalarHalfDistanceBatch(const float* query, const uint16_t* rows, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = scalarHalfDistance<Storage, SquaredL2>(query, rows + r * n, n);
+    }
+}
+
+template<StorageType Storage>
+inline void scalarEncode(const float* in, uint16_t* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = encodeElement<Storage>(in[i]);
+    }
+}
+
+template<StorageType Storage>
+inline void scalarDecode(const uint16_t* in, float* out, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = decodeElement<Storage>(in[i]);
+    }
+}
+
+#ifdef DISTANCE_KERNELS_X86
+
+/* AVX2 + FMA, with F16C for the IEEE half conversions. bf16 is the top half of a
+   float32, so widening it is a zero-extend and a shift. */
+
+template<StorageType Storage>
+__attribute__((target("avx2,fma,f16c")))
+inline __m256 avx2Widen8(const uint16_t* p) {
+    __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    if constexpr (Storage == StorageType::Float16) {
+        return _mm256_cvtph_ps(packed);
+    } else {
+        return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(packed), 16));
+    }
+}
+
+template<StorageType Storage, bool SquaredL2>
+__attribute__((target("avx2,fma,f16c")))
+inline float avx2HalfDistance(const float* query, const uint16_t* row, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 v0 = avx2Widen8<Storage>(row + i);
+        __m256 v1 = avx2Widen8<Storage>(row + i + 8);
+        if constexpr (SquaredL2) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(query + i), v0);
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(query + i + 8), v1);
+            acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+            acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+        } else {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i), v0, acc0);
+            acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i + 8), v1, acc1);
+        }
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 v = avx2Widen8<Storage>(row + i);
+        if constexpr (SquaredL2) {
+            __m256 d = _mm256_sub_ps(_mm256_loadu_ps(query + i), v);
+            acc0 = _mm256_fmadd_ps(d, d, acc0);
+        } else {
+            acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(query + i), v, acc0);
+        }
+    }
+    float sum = horizontalSum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        float value = decodeElement<Storage>(row[i]);
+        if constexpr (SquaredL2) {
+            float d = query[i] - value;
+            sum += d * d;
+        } else {
+            sum += query[i] * value;
+        }
+    }
+    return sum;
+}
+
+template<StorageType Storage, bool SquaredL2>
+__attribute__((target("avx2,fma,f16c")))
+inline void avx2HalfDistanceBatch(const float* query, const uint16_t* rows, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = avx2HalfDistance<Storage, SquaredL2>(query, rows + r * n, n);
+    }
+}
+
+template<StorageType Storage>
+__attribute__((target("avx2,fma,f16c")))
+inline void avx2Encode(const float* in, uint16_t* out, size_t n) {
+    size_t i = 0;
+    if constexpr (Storage == StorageType::Float16) {
+        for (; i + 8 <= n; i += 8) {
+            __m128i packed = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+        }
+    }
+    scalarEncode<Storage>(in + i, out + i, n - i);
+}
+
+template<StorageType Storage>
+__attribute__((target("avx2,fma,f16c")))
+inline void avx2Decode(const uint16_t* in, float* out, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(out + i, avx2Widen8<Storage>(in + i));
+    }
+    scalarDecode<Storage>(in + i, out + i, n - i);
+}
+
+/* AVX-512 */
+
+template<StorageType Storage>
+__attribute__((target("avx512f,avx2,fma,f16c")))
+inline __m512 avx512Widen16(const uint16_t* p) {
+    __m256i packed = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    // maskz forms for the same GCC 12 -Wuninitialized reason as horizontalSum512
+    if constexpr (Storage == StorageType::Float16) {
+        return _mm512_maskz_cvtph_ps(0xFFFF, packed);
+    } else {
+        __m512i widened = _mm512_maskz_cvtepu16_epi32(0xFFFF, packed);
+        return _mm512_castsi512_ps(_mm512_maskz_slli_epi32(0xFFFF, widened, 16));
+    }
+}
+
+template<StorageType Storage, bool SquaredL2>
+__attribute__((target("avx512f,avx2,fma,f16c")))
+inline float avx512HalfDistance(const float* query, const uint16_t* row, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 v0 = avx512Widen16<Storage>(row + i);
+        __m512 v1 = avx512Widen16<Storage>(row + i + 16);
+        if constexpr (SquaredL2) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(query + i), v0);
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(query + i + 16), v1);
+            acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+            acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+        } else {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), v0, acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i + 16), v1, acc1);
+        }
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m512 v = avx512Widen16<Storage>(row + i);
+        if constexpr (SquaredL2) {
+            __m512 d = _mm512_sub_ps(_mm512_loadu_ps(query + i), v);
+            acc0 = _mm512_fmadd_ps(d, d, acc0);
+        } else {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), v, acc0);
+        }
+    }
+    float sum = horizontalSum512(_mm512_add_ps(acc0, acc1));
+    // Masked 16-bit loads need AVX-512BW, so the last few elements finish with AVX2
+    if (i < n) {
+        sum += avx2HalfDistance<Storage, SquaredL2>(query + i, row + i, n - i);
+    }
+    return sum;
+}
+
+template<StorageType Storage, bool SquaredL2>
+__attribute__((target("avx512f,avx2,fma,f16c")))
+inline void avx512HalfDistanceBatch(const float* query, const uint16_t* rows, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = avx512HalfDistance<Storage, SquaredL2>(query, rows + r * n, n);
+    }
+}
+
+template<StorageType Storage>
+__attribute__((target("avx512f,avx2,fma,f16c")))
+inline void avx512Decode(const uint16_t* in, float* out, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm512_storeu_ps(out + i, avx512Widen16<Storage>(in + i));
+    }
+    avx2Decode<Storage>(in + i, out + i, n - i);
+}
+
+#endif // DISTANCE_KERNELS_X86
+
+// Picks the widest kernel set the running CPU supports for one storage format.
+template<StorageType Storage>
+inline HalfKernels detectHalfKernels() {
+#ifdef DISTANCE_KERNELS_X86
+    __builtin_cpu_init();
+    bool f16c = __builtin_cpu_supports("f16c");
+    if (__builtin_cpu_supports("avx512f") && f16c) {
+        return { SimdLevel::AVX512, avx512HalfDistanceBatch<Storage, true>, avx512HalfDistanceBatch<Storage, false>,
+                 avx2Encode<Storage>, avx512Decode<Storage> };
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && f16c) {
+        return { SimdLevel::AVX2, avx2HalfDistanceBatch<Storage, true>, avx2HalfDistanceBatch<Storage, false>,
+                 avx2Encode<Storage>, avx2Decode<Storage> };
+    }
+#endif
+    return { SimdLevel::Scalar, scalarHalfDistanceBatch<Storage, true>, scalarHalfDistanceBatch<Storage, false>,
+             scalarEncode<Storage>, scalarDecode<Storage> };
+}
+
+// Kernel table for a 16-bit storage type, detected once on first use.
+inline const HalfKernels& getHalfKernels(StorageType storage) {
+    static const HalfKernels float16Kernels = detectHalfKernels<StorageType::Float16>();
+    static const HalfKernels bfloat16Kernels = detectHalfKernels<StorageType::BFloat16>();
+    return storage == StorageType::BFloat16 ? bfloat16Kernels : float16Kernels;
+}
+
+#endif // HALF_PRECISION_HPP
@@ -9,8 +9,13 @@
 #include <random>
 #include <numeric>
 #include <stdexcept>
+#include <atomic>
+#include <memory>
 
 #include "VectorSearchAlgorithm.hpp"
+#include "Distances.hpp"
+#include "ScalarQuantizer.hpp"
+#include "VectorStore.hpp"
 
 template<typename T>
 class InvertedFileIndex : public VectorSearchAlgorithm<T> {
@@ -18,82 +23,292 @@ public:
     int vector_len;
     int num_centroids; 
     int retrain_threshold;
+    // Search SQ8 codes instead of the rows; with a rerank factor the best
+    // num_results * rerank_factor codes are rescored against the exact rows,
+    // without one the ranking comes from the codes alone
+    bool quantized;
+    int rerank_factor;
+    // Distance evaluations cut short by findClosest, for tuning
+    std::atomic<uint64_t> abandonedEvaluations{0};
 
-    // Constructor initializes and trains the model on the initial dataset
-    InvertedFileIndex(const std::vector<std::pair<T, std::vector<float>>>& inputData,
+    // Constructor initializes and trains the model on every row of the store
+    InvertedFileIndex(std::shared_ptr<const VectorStore<T>> store,
+                      const VectorSpace& space,
                       int vector_len, 
                       int num_centroids, 
-                      int retrain_threshold = 1
-    ) : data(inputData), 
-        clusters(num_centroids),
-        vector_len(vector_len),
+                      int retrain_threshold = 1,
+                      bool quantized = false,
+                      int rerank_factor = 0
+    ) : vector_len(vector_len),
         num_centroids(num_centroids),
-        retrain_threshold(retrain_threshold) {
-        if (data.size() < static_cast<size_t>(num_centroids)) {
+        retrain_threshold(retrain_threshold),
+        quantized(quantized),
+        rerank_factor(rerank_factor),
+        store(std::move(store)),
+        indexedRows(this->store->size()),
+        clusters(num_centroids),
+        space(space) {
+        if (indexedRows < static_cast<size_t>(num_centroids)) {
             throw std::invalid_argument("Data size must be larger than the number of centroids.");
         }
+        if (quantized) {
+            // The bins are fitted once to the initial data; later points are encoded with them
+            quantizer.train(this->store->vectors());
+            codes = quantizer.encode(this->store->vectors());
+        }
         initializeCentroids();
         retrain();
     }
 
-    // Adds a new data point and retrains the model if necessary
-    void add(const T& id, const std::vector<float>& vec) {
-        if (vec.size() != static_cast<size_t>(vector_len)) {
-            throw std::invalid_argument("Vector length does not match the specified vector_len.");
+    // Reads an index written by save(); the section tag has already been read
+    InvertedFileIndex(std::shared_ptr<const VectorStore<T>> store, SnapshotReader& snapshot) : store(std::move(store)) {
+        vector_len = snapshot.read<int32_t>();
+        num_centroids = snapshot.read<int32_t>();
+        retrain_threshold = snapshot.read<int32_t>();
+        quantized = snapshot.read<uint8_t>() != 0;
+        rerank_factor = snapshot.read<int32_t>();
+        space = VectorSpace(snapshot);
+        indexedRows = snapshot.read<uint64_t>();
+        nodesAddedSinceLastRetrain = snapshot.read<int32_t>();
+        centroids = snapshot.readVector<float>();
+
+        size_t offsetCount = 0, memberCount = 0;
+        const uint64_t* offsets = snapshot.readArray<uint64_t>(offsetCount);
+        const int32_t* members = snapshot.readArray<int32_t>(memberCount);
+        if (offsetCount != static_cast<size_t>(num_centroids) + 1 || offsets[num_centroids] != memberCount) {
+            throw std::runtime_error("Snapshot index clusters are malformed.");
         }
-        data.push_back({id, vec});
+        clusters.resize(num_centroids);
+        for (int i = 0; i < num_centroids; ++i) {
+            clusters[i].assign(members + offsets[i], members + offsets[i + 1]);
+        }
+        rowSlots = snapshot.readVector<ClusterSlot>();
+        quantizer = ScalarQuantizer(snapshot);
+        codes = snapshot.readVector<uint8_t>();
+        if (rowSlots.size() != indexedRows || (quantized && codes.size() != indexedRows * vector_len)) {
+            throw std::runtime_error("Snapshot index doesn't cover its rows.");
+        }
+    }
+
+    // Indexes a row appended to the store after the index was built. Rows are
+    // indexed in store order, so an index that sees every append and removal
+    // covers the whole store.
+    void add(size_t id) {
+        append(id);
         if (++nodesAddedSinceLastRetrain >= retrain_threshold) {
             retrain();
             nodesAddedSinceLastRetrain = 0;
         }
     }
 
+    // A batch of rows is clustered by one retrain at most, however many thresholds it spans
+    void addRows(size_t first, size_t end) override {
+        for (size_t id = first; id < end; ++id) {
+            append(id);
+        }
+        nodesAddedSinceLastRetrain += end - first;
+        if (nodesAddedSinceLastRetrain >= retrain_threshold) {
+            retrain();
+            nodesAddedSinceLastRetrain = 0;
+        }
+    }
+
+    void addRow(size_t id) override {
+        add(id);
+    }
+
+    // Drops row id from its cluster and renumbers the last indexed row, codes
+    // included, to id, matching the store's swap-remove
+    void removeRow(size_t id) override {
+        if (id >= indexedRows || store->size() != indexedRows) {
+            throw std::logic_error("The index is out of step with its store.");
+        }
+        size_t last = indexedRows - 1;
+        leaveCluster(id);
+        if (id != last) {
+            rowSlots[id] = rowSlots[last];
+            if (rowSlots[id].cluster >= 0) {
+                clusters[rowSlots[id].cluster][rowSlots[id].slot] = id;
+            }
+            if (quantized) {
+                std::copy(codes.begin() + last * vector_len, codes.begin() + (last + 1) * vector_len, codes.begin() + id * vector_len);
+            }
+        }
+        rowSlots.pop_back();
+        if (quantized) {
+            codes.resize(codes.size() - vector_len);
+        }
+        --indexedRows;
+    }
+
+    // Every cluster member, slot and code follows its row to the new id
+    void permuteRows(const std::vector<size_t>& newIds) override {
+        if (newIds.size() != indexedRows) {
+            throw std::logic_error("The index is out of step with its store.");
+        }
+        std::vector<ClusterSlot> permutedSlots(indexedRows);
+        std::vector<uint8_t> permutedCodes(codes.size());
+        for (size_t id = 0; id < indexedRows; ++id) {
+            permutedSlots[newIds[id]] = rowSlots[id];
+            if (quantized) {
+                std::copy(codes.begin() + id * vector_len, codes.begin() + (id + 1) * vector_len,
+                          permutedCodes.begin() + newIds[id] * vector_len);
+            }
+        }
+        for (auto& cluster : clusters) {
+            for (int& member : cluster) {
+                member = newIds[member];
+            }
+        }
+        rowSlots.swap(permutedSlots);
+        codes.swap(permutedCodes);
+    }
+
     std::vector<std::pair<T, std::vector<float>>> searchClosest(const std::vector<float>& vec, int num_results) override {
         return findClosest(vec, num_results);
     }
 
+    std::vector<size_t> searchRows(const std::vector<float>& vec, int num_results) override {
+        std::vector<size_t> rows;
+        for (const auto& [distance, id] : closestRows(vec, num_results)) {
+            rows.push_back(id);
+        }
+        return rows;
+    }
+
     // Finds the num_results closest vectors to the input vector
     std::vector<std::pair<T, std::vector<float>>> findClosest(const std::vector<float>& vec, int num_results) {
-        std::vector<std::pair<float, T>> distances; // Pair of distance and ID
-
-        for (const auto& item : data) {
-            float distance = euclideanDistance(item.second, vec);
-            distances.emplace_back(distance, item.first);
-        }
+        // Keys and vectors of the closest rows, straight from the store by id
+        return store->entries(searchRows(vec, num_results));
+    }
 
-        // Sort by distance
-        std::nth_element(distances.begin(), distances.begin() + num_results, distances.end());
-        distances.resize(num_results);
+    // Parameters, centroids, the clusters as offsets into one array of row ids, where
+    // each row sits in them, then the quantizer and codes
+    void save(SnapshotWriter& snapshot) const override {
+        snapshot.section(SnapshotSection::InvertedFile);
+        snapshot.write<int32_t>(vector_len);
+        snapshot.write<int32_t>(num_centroids);
+        snapshot.write<int32_t>(retrain_threshold);
+        snapshot.write<uint8_t>(quantized);
+        snapshot.write<int32_t>(rerank_factor);
+        space.save(snapshot);
+        snapshot.write<uint64_t>(indexedRows);
+        snapshot.write<int32_t>(nodesAddedSinceLastRetrain);
+        snapshot.writeArray(centroids);
 
-        // Retrieve the corresponding data points
-        std::vector<std::pair<T, std::vector<float>>> results;
-        for (const auto& dist : distances) {
-            auto it = std::find_if(data.begin(), data.end(), [&dist](const auto& item) {
-                return item.first == dist.second;
-            });
-            if (it != data.end()) {
-                results.push_back(*it);
-            }
+        std::vector<uint64_t> offsets(1, 0);
+        std::vector<int32_t> members;
+        for (const auto& cluster : clusters) {
+            members.insert(members.end(), cluster.begin(), cluster.end());
+            offsets.push_back(members.size());
         }
+        snapshot.writeArray(offsets);
+        snapshot.writeArray(members);
+        snapshot.writeArray(rowSlots);
+        quantizer.save(snapshot);
+        snapshot.writeArray(codes);
+    }
 
-        return results;
+    // Bytes held by the index itself; the rows belong to the shared store
+    size_t memoryBytes() const {
+        size_t clusterBytes = 0;
+        for (const auto& cluster : clusters) {
+            clusterBytes += cluster.capacity() * sizeof(int);
+        }
+        return centroids.capacity() * sizeof(float) + clusterBytes + codes.capacity() + quantizer.memoryBytes();
     }
 
 private:
-    std::vector<std::pair<T, std::vector<float>>> data;
-    std::vector<std::vector<float>> centroids;
-    std::vector<std::vector<std::pair<T, std::vector<float>>>> clusters;
+    // The collection's rows; the index covers the first indexedRows of them
+    std::shared_ptr<const VectorStore<T>> store;
+    size_t indexedRows;
+    // Centroids back to back, num_centroids rows of vector_len floats
+    std::vector<float> centroids;
+    // Row indices of the points assigned to each centroid
+    std::vector<std::vector<int>> clusters;
+    // Where each row sits in clusters, so a row leaves its cluster in constant time
+    struct ClusterSlot {
+        int cluster;
+        int slot;
+    };
+    std::vector<ClusterSlot> rowSlots;
+    VectorSpace space;
+    std::vector<float> centroidDistances;
     int nodesAddedSinceLastRetrain = 0;
+    // SQ8 codes of every indexed row, vector_len bytes per row, when quantized
+    ScalarQuantizer quantizer;
+    std::vector<uint8_t> codes;
+
+    // Distances and ids of the num_results closest rows, nearest first
+    std::vector<std::pair<float, size_t>> closestRows(const std::vector<float>& vec, int num_results) {
+        if (quantized) {
+            return closestRowsQuantized(vec, num_results);
+        }
+
+        // One pass over the contiguous rows; rows that can't beat the current
+        // num_results-th best are abandoned part way through, deleted rows are skipped
+        TopK topK(std::max(num_results, 0));
+        abandonedEvaluations += space.scanTopK(vec.data(), store->vectors(), 0, indexedRows, topK, &store->tombstones());
+        return topK.takeSorted();
+    }
+
+    std::vector<std::pair<float, size_t>> closestRowsQuantized(const std::vector<float>& vec, int num_results) {
+        size_t count = std::max(num_results, 0);
+        size_t shortlist = rerank_factor > 0 ? count * rerank_factor : count;
+
+        TopK topK(shortlist);
+        quantizer.scanTopK(quantizer.prepareQuery(vec.data(), space.metric), codes.data(), indexedRows, 0, topK,
+                           &store->tombstones());
+        auto closest = topK.takeSorted();
+        if (rerank_factor > 0) {
+            closest = rerankExact(space, vec.data(), closest, store->vectors(), count);
+        }
+        return closest;
+    }
+
+    // Encodes row id and leaves it to be clustered at the next retrain
+    void append(size_t id) {
+        if (id != indexedRows) {
+            throw std::invalid_argument("Rows must be added to the index in store order.");
+        }
+        std::vector<float> scratch;
+        if (quantized) {
+            codes.resize(codes.size() + vector_len);
+            quantizer.encode(store->row(id, scratch), codes.data() + codes.size() - vector_len);
+        }
+        rowSlots.push_back({-1, -1}); // Clustered at the next retrain
+        ++indexedRows;
+    }
+
+    // Takes row id out of its cluster by moving the cluster's last row into its slot
+    void leaveCluster(size_t id) {
+        ClusterSlot position = rowSlots[id];
+        if (position.cluster < 0) {
+            return;
+        }
+        auto& cluster = clusters[position.cluster];
+        int moved = cluster.back();
+        cluster[position.slot] = moved;
+        rowSlots[moved].slot = position.slot;
+        cluster.pop_back();
+        rowSlots[id] = {-1, -1};
+    }
+
+    const float* row(size_t id, std::vector<float>& scratch) const {
+        return store->row(id, scratch);
+    }
 
     // Initializes centroids by randomly selecting data points
     void initializeCentroids() {
-        std::vector<int> indices(data.size());
+        std::vector<int> indices(indexedRows);
         std::iota(indices.begin(), indices.end(), 0);
         std::shuffle(indices.begin(), indices.end(), std::mt19937(std::random_device{}()));
 
-        centroids.clear();
+        centroids.resize(static_cast<size_t>(num_centroids) * vector_len);
+        std::vector<float> scratch;
         for (int i = 0; i < num_centroids; ++i) {
-            centroids.push_back(data[indices[i]].second);
+            const float* vec = row(indices[i], scratch);
+            std::copy(vec, vec + vector_len, centroids.data() + static_cast<size_t>(i) * vector_len);
         }
     }
 
@@ -110,11 +325,14 @@ private:
     // Assigns each data point to the nearest centroid
     bool assignToNearestCentroids() {
         bool centroidsChanged = false;
-        std::vector<std::vector<std::pair<T, std::vector<float>>>> newClusters(num_centroids);
+        std::vector<std::vector<int>> newClusters(num_centroids);
+        std::vector<float> scratch;
         
-        for (const auto& item : data) {
-            int nearestCentroidIndex = findNearestCentroid(item.second);
-            newClusters[nearestCentroidIndex].push_back(item);
+        rowSlots.resize(indexedRows);
+        for (size_t i = 0; i < indexedRows; ++i) {
+            int nearestCentroidIndex = findNearestCentroid(row(i, scratch));
+            rowSlots[i] = {nearestCentroidIndex, static_cast<int>(newClusters[nearestCentroidIndex].size())};
+            newClusters[nearestCentroidIndex].push_back(i);
         }
 
         // Compare newClusters with clusters to determine if centroids have changed
@@ -133,25 +351,29 @@ private:
     // Updates centroids based on current cluster assignments
     bool updateCentroids() {
         bool anyCentroidMoved = false;
-        std::vector<std::vector<float>> newCentroids(num_centroids, std::vector<float>(vector_len, 0.0));
+        std::vector<float> newCentroid(vector_len);
+        std::vector<float> scratch;
         
         // Accumulate all vectors assigned to each centroid
         for (int i = 0; i < num_centroids; ++i) {
+            std::fill(newCentroid.begin(), newCentroid.end(), 0.0f);
             if (!clusters[i].empty()) {
-                for (const auto& pair : clusters[i]) {
+                for (int index : clusters[i]) {
+                    const float* vec = row(index, scratch);
                     for (int j = 0; j < vector_len; ++j) {
-                        newCentroids[i][j] += pair.second[j];
+                        newCentroid[j] += vec[j];
                     }
                 }
                 for (int j = 0; j < vector_len; ++j) {
-                    newCentroids[i][j] /= clusters[i].size();
+                    newCentroid[j] /= clusters[i].size();
                 }
             }
 
             // Check if the centroid has moved significantly
-            if (euclideanDistance(centroids[i], newCentroids[i]) >= convergenceThreshold) {
+            float* centroid = centroids.data() + static_cast<size_t>(i) * vector_len;
+            if (centroidShift(centroid, newCentroid.data()) >= convergenceThreshold) {
                 anyCentroidMoved = true;
-                centroids[i] = newCentroids[i];
+                std::copy(newCentroid.begin(), newCentroid.end(), centroid);
             }
         }
 
@@ -159,26 +381,15 @@ private:
     }
 
     // Finds the index of the nearest centroid to a given vector
-    int findNearestCentroid(const std::vector<float>& vec) {
-        float minDistance = std::numeric_limits<float>::max();
-        int nearestIndex = -1;
-        for (int i = 0; i < num_centroids; ++i) {
-            float distance = euclideanDistance(vec, centroids[i]);
-            if (distance < minDistance) {
-                minDistance = distance;
-                nearestIndex = i;
-            }
-        }
-        return nearestIndex;
+    int findNearestCentroid(const float* vec) {
+        centroidDistances.resize(num_centroids);
+        space.distanceBatch(vec, centroids.data(), num_centroids, centroidDistances.data());
+        return std::min_element(centroidDistances.begin(), centroidDistances.end()) - centroidDistances.begin();
     }
 
-    float euclideanDistance(const std::vector<float>& vec1, const std::vector<float>& vec2) {
-        float sum = 0.0;
-        for (int i = 0; i < vector_len; ++i) {
-            float diff = vec1[i] - vec2[i];
-            sum += diff * diff;
-        }
-        return std::sqrt(sum);
+    // Euclidean movement of a centroid between iterations, independent of the search metric
+    float centroidShift(const float* vec1, const float* vec2) {
+        return std::sqrt(space.kernels.squaredL2(vec1, vec2, vector_len));
     }
 };
 
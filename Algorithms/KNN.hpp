@@ -9,14 +9,11 @@
 #include <numeric>
 #include <functional>
 
+#include "DistanceKernels.hpp"
+
 // Default squared Euclidean distance function
-float defaultSquaredDistance(const std::vector<float>& a, const std::vector<float>& b) {
-    float sum = 0.0f;
-    for (size_t i = 0; i < a.size(); ++i) {
-        float diff = a[i] - b[i];
-        sum += diff * diff;
-    }
-    return sum; // Squared distance, without taking square root
+inline float defaultSquaredDistance(const std::vector<float>& a, const std::vector<float>& b) {
+    return getDistanceKernels().squaredL2(a.data(), b.data(), a.size()); // Squared distance, without taking square root
 }
 
 template<int vector_len, int num_centroids>
@@ -29,14 +26,18 @@ public:
 
 private:
     DataSet centroids;
-    std::vector<DataSet> clusters; // Cluster assignments
+    // The same centroids back to back, scored against a vector in one batched call
+    std::vector<float> centroidBlock;
+    std::vector<std::vector<int>> clusters; // Indices of the training vectors assigned to each centroid
     static constexpr float convergenceThreshold = 0.001f;
     DistanceFunction distanceFunction;
 
 public:
-    KNN(DistanceFunction distFunc = defaultSquaredDistance)
+    // Without a distance function, squared L2 is evaluated by the batched kernels
+    KNN(DistanceFunction distFunc = nullptr)
     : clusters(num_centroids), distanceFunction(distFunc) {
         centroids.resize(num_centroids, Vector(vector_len, 0.0f));
+        packCentroids();
     }
 
     void train(const DataSet& data) {
@@ -44,11 +45,17 @@ public:
         bool centroidsChanged;
         do {
             centroidsChanged = assignToNearestCentroids(data);
-            centroidsChanged = updateCentroids() || centroidsChanged;
+            centroidsChanged = updateCentroids(data) || centroidsChanged;
         } while (centroidsChanged);
     }
 
     int predict(const Vector& vec) const {
+        if (!distanceFunction) {
+            float distances[num_centroids];
+            kernels().squaredL2Batch(vec.data(), centroidBlock.data(), num_centroids, vector_len, distances);
+            return std::min_element(distances, distances + num_centroids) - distances;
+        }
+
         int nearestIndex = 0;
         float minDistance = std::numeric_limits<float>::max();
         for (int i = 0; i < num_centroids; ++i) {
@@ -62,6 +69,14 @@ public:
     }
 
 private:
+    void packCentroids() {
+        centroidBlock.clear();
+        centroidBlock.reserve(num_centroids * vector_len);
+        for (const auto& centroid : centroids) {
+            centroidBlock.insert(centroidBlock.end(), centroid.begin(), centroid.end());
+        }
+    }
+
     void initializeCentroids(const DataSet& data) {
         std::vector<int> indices(data.size());
         std::iota(indices.begin(), indices.end(), 0);
@@ -70,15 +85,16 @@ private:
         for (int i = 0; i < num_centroids; ++i) {
             centroids[i] = data[indices[i] % data.size()];
         }
+        packCentroids();
     }
 
     bool assignToNearestCentroids(const DataSet& data) {
         bool centroidsChanged = false;
-        std::vector<std::vector<std::vector<float>>> newClusters(num_centroids);
+        std::vector<std::vector<int>> newClusters(num_centroids);
         
-        for (const auto& vec : data) {
-            int nearestCentroidIndex = predict(vec);
-            newClusters[nearestCentroidIndex].push_back(vec);
+        for (size_t i = 0; i < data.size(); ++i) {
+            int nearestCentroidIndex = predict(data[i]);
+            newClusters[nearestCentroidIndex].push_back(i);
         }
 
         // Compare newClusters with clusters to determine if centroids have changed
@@ -94,14 +110,14 @@ private:
         return centroidsChanged;
     }
 
-    bool updateCentroids() {
+    bool updateCentroids(const DataSet& data) {
         bool anyCentroidMoved = false;
         for (int i = 0; i < num_centroids; ++i) {
             Vector newCentroid(vector_len, 0.0f);
             if (!clusters[i].empty()) {
-                for (const auto& vec : clusters[i]) {
+                for (int index : clusters[i]) {
                     for (int j = 0; j < vector_len; ++j) {
-                        newCentroid[j] += vec[j];
+                        newCentroid[j] += data[index][j];
                     }
                 }
                 for (int j = 0; j < vector_len; ++j) {
@@ -114,17 +130,26 @@ private:
                 }
             }
         }
+        if (anyCentroidMoved) {
+            packCentroids();
+        }
         return anyCentroidMoved;
     }
 
+    // Kernels with loops unrolled for vector_len
+    static const DistanceKernels& kernels() {
+        static const DistanceKernels fixedKernels = fixedDimensionKernels<vector_len>();
+        return fixedKernels;
+    }
+
+    // Squared distance with loops unrolled for vector_len
+    static float squaredDistance(const Vector& a, const Vector& b) {
+        return kernels().squaredL2(a.data(), b.data(), vector_len);
+    }
+
     // This uses the original euclideanDistance for internal centroid movement checks
     static float euclideanDistance(const Vector& a, const Vector& b) {
-        float sum = 0.0f;
-        for (int i = 0; i < vector_len; ++i) {
-            float diff = a[i] - b[i];
-            sum += diff * diff;
-        }
-        return std::sqrt(sum);
+        return std::sqrt(squaredDistance(a, b));
     }
 };
 
@@ -0,0 +1,351 @@
+#ifndef KEY_TABLE_HPP
+#define KEY_TABLE_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+
+// The key of every row of a store, by row id, and the row id of every key that can
+// still be looked up. A row's key stays readable after it is unindexed (a deleted
+// row keeps its key until the row is removed) and a new row may then take the key.
+//
+// Integer keys are held as they are, next to a hash index of them.
+template<typename K>
+class KeyTable {
+public:
+    // What key() hands out
+    using View = const K&;
+
+    size_t size() const { return keys.size(); }
+
+    void reserve(size_t count) {
+        keys.reserve(count);
+        ids.reserve(count);
+    }
+
+    // Row id of key, or size() if no indexed row has it
+    size_t find(const K& key) const {
+        auto it = ids.find(key);
+        return it == ids.end() ? keys.size() : it->second;
+    }
+
+    // Adds key as the next row without indexing it
+    void appendUnindexed(const K& key) {
+        keys.push_back(key);
+    }
+
+    void append(const K& key) {
+        appendUnindexed(key);
+        index(keys.size() - 1);
+    }
+
+    // Makes row findable by its key
+    void index(size_t row) {
+        ids[keys[row]] = row;
+    }
+
+    // Row keeps its key but can't be found by it any more
+    void unindex(size_t row) {
+        auto it = ids.find(keys[row]);
+        if (it != ids.end() && it->second == row) {
+            ids.erase(it);
+        }
+    }
+
+    // Drops unindexed row; the last row takes its id, and stays findable if it was
+    void remove(size_t row) {
+        size_t last = keys.size() - 1;
+        if (row != last) {
+            auto it = ids.find(keys[last]);
+            if (it != ids.end() && it->second == last) {
+                it->second = row;
+            }
+            keys[row] = std::move(keys[last]);
+        }
+        keys.pop_back();
+    }
+
+    // Row id becomes newIds[id], indexed or not
+    void permute(const std::vector<size_t>& newIds) {
+        std::vector<K> permuted(keys.size());
+        for (size_t row = 0; row < keys.size(); ++row) {
+            permuted[newIds[row]] = std::move(keys[row]);
+        }
+        keys.swap(permuted);
+        for (auto& entry : ids) {
+            entry.second = newIds[entry.second];
+        }
+    }
+
+    View key(size_t row) const { return keys[row]; }
+
+    // Appends the key of row to a response
+    void appendText(size_t row, std::string& out) const {
+        out += std::to_string(keys[row]);
+    }
+
+    void shrinkToFit() {
+        keys.shrink_to_fit();
+        ids.rehash(0);
+    }
+
+    // Bytes held by the keys and, roughly, the hash index
+    size_t memoryBytes() const {
+        size_t indexBytes = ids.bucket_count() * sizeof(void*) + ids.size() * (sizeof(K) + sizeof(size_t) + 2 * sizeof(void*));
+        return keys.capacity() * sizeof(K) + indexBytes;
+    }
+
+private:
+    std::vector<K> keys;
+    std::unordered_map<K, size_t> ids;
+};
+
+// String keys are interned: their bytes sit back to back in one arena, each row
+// refers to its key by an 8-byte offset into it, so the arena isn't capped at 4 GiB,
+// and the index is an open-addressing table of 4-byte row ids that compares through
+// the arena. A key costs its length plus about 20 bytes, with no allocation of its
+// own, and is only copied out as a string when a response or a search result needs it.
+template<>
+class KeyTable<std::string> {
+public:
+    using View = std::string_view;
+
+    size_t size() const { return offsets.size(); }
+
+    void reserve(size_t count) {
+        offsets.reserve(count);
+        if (2 * count > slots.size()) {
+            rehash(2 * count);
+        }
+    }
+
+    size_t find(std::string_view key) const {
+        if (slots.empty()) {
+            return size();
+        }
+        for (size_t slot = hash(key) & (slots.size() - 1);; slot = (slot + 1) & (slots.size() - 1)) {
+            uint32_t row = slots[slot];
+            if (row == emptySlot) {
+                return size();
+            }
+            if (this->key(row) == key) {
+                return row;
+            }
+        }
+    }
+
+    void appendUnindexed(std::string_view key) {
+        if (size() >= emptySlot) {
+            throw std::length_error("Too many keys for 32-bit row ids.");
+        }
+        if (key.size() > std::numeric_limits<uint32_t>::max()) {
+            throw std::length_error("Key is too long.");
+        }
+        uint64_t offset = bytes.size();
+        uint32_t length = key.size();
+        bytes.resize(offset + sizeof(length) + length);
+        std::memcpy(bytes.data() + offset, &length, sizeof(length));
+        std::memcpy(bytes.data() + offset + sizeof(length), key.data(), length);
+        offsets.push_back(offset);
+    }
+
+    void append(std::string_view key) {
+        appendUnindexed(key);
+        index(size() - 1);
+    }
+
+    void index(size_t row) {
+        // Kept at most half full, so probes stay short
+        if (2 * (indexed + 1) > slots.size()) {
+            rehash(std::max<size_t>(16, 2 * slots.size()));
+        }
+        place(row);
+        ++indexed;
+    }
+
+    void unindex(size_t row) {
+        size_t slot = slotOf(row);
+        if (slot == slots.size()) {
+            return;
+        }
+        // Backward-shift deletion: later entries of the probe run move up into the
+        // hole, so lookups never need to step over a deleted slot
+        size_t mask = slots.size() - 1;
+        size_t hole = slot;
+        for (size_t next = (hole + 1) & mask; slots[next] != emptySlot; next = (next + 1) & mask) {
+            size_t home = hash(key(slots[next])) & mask;
+            // The entry may fill the hole if its home isn't cyclically in (hole, next]
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                slots[hole] = slots[next];
+                hole = next;
+            }
+        }
+        slots[hole] = emptySlot;
+        --indexed;
+    }
+
+    void remove(size_t row) {
+        size_t last = size() - 1;
+        deadBytes += sizeof(uint32_t) + key(row).size();
+        if (row != last) {
+            size_t slot = slotOf(last);
+            if (slot != slots.size()) {
+                slots[slot] = row;
+            }
+            offsets[row] = offsets[last];
+        }
+        offsets.pop_back();
+    }
+
+    // The keys stay where they are in the arena and in the index; only the row ids
+    // pointing at them change
+    void permute(const std::vector<size_t>& newIds) {
+        std::vector<uint64_t> permuted(offsets.size());
+        for (size_t row = 0; row < offsets.size(); ++row) {
+            permuted[newIds[row]] = offsets[row];
+        }
+        offsets.swap(permuted);
+        for (uint32_t& slot : slots) {
+            if (slot != emptySlot) {
+                slot = newIds[slot];
+            }
+        }
+    }
+
+    std::string_view key(size_t row) const {
+        uint32_t length;
+        std::memcpy(&length, bytes.data() + offsets[row], sizeof(length));
+        return std::string_view(bytes.data() + offsets[row] + sizeof(length), length);
+    }
+
+    void appendText(size_t row, std::string& out) const {
+        out += key(row);
+    }
+
+    // Packs the arena to the keys of the rows still present
+    void shrinkToFit() {
+        if (deadBytes > 0) {
+            std::vector<char> packed;
+            packed.reserve(bytes.size() - deadBytes);
+            for (size_t row = 0; row < offsets.size(); ++row) {
+                size_t length = sizeof(uint32_t) + key(row).size();
+                const char* from = bytes.data() + offsets[row];
+                offsets[row] = packed.size();
+                packed.insert(packed.end(), from, from + length);
+            }
+            bytes.swap(packed);
+            deadBytes = 0;
+        }
+        bytes.shrink_to_fit();
+        offsets.shrink_to_fit();
+        size_t wanted = 16;
+        while (wanted < 2 * indexed) {
+            wanted *= 2;
+        }
+        if (wanted < slots.size()) {
+            rehash(wanted);
+        }
+    }
+
+    size_t memoryBytes() const {
+        return bytes.capacity() + offsets.capacity() * sizeof(uint64_t) + slots.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    static constexpr uint32_t emptySlot = std::numeric_limits<uint32_t>::max();
+
+    // Keys back to back, each a 4-byte length and then its bytes
+    std::vector<char> bytes;
+    // Where each row's key starts in bytes
+    std::vector<uint64_t> offsets;
+    // Row ids of the indexed keys, by hash, a power of two of them
+    std::vector<uint32_t> slots;
+    size_t indexed = 0;
+    // Arena bytes of removed rows, given back by shrinkToFit()
+    size_t deadBytes = 0;
+
+    static size_t hash(std::string_view key) {
+        return std::hash<std::string_view>()(key);
+    }
+
+    // Slot holding row, or slots.size() if row isn't indexed
+    size_t slotOf(size_t row) const {
+        if (slots.empty()) {
+            return slots.size();
+        }
+        size_t mask = slots.size() - 1;
+        for (size_t slot = hash(key(row)) & mask; slots[slot] != emptySlot; slot = (slot + 1) & mask) {
+            if (slots[slot] == row) {
+                return slot;
+            }
+        }
+        return slots.size();
+    }
+
+    void place(size_t row) {
+        size_t mask = slots.size() - 1;
+        size_t slot = hash(key(row)) & mask;
+        while (slots[slot] != emptySlot) {
+            slot = (slot + 1) & mask;
+        }
+        slots[slot] = row;
+    }
+
+    void rehash(size_t minimum) {
+        size_t count = 16;
+        while (count < minimum) {
+            count *= 2;
+        }
+        std::vector<uint32_t> old(count, emptySlot);
+        old.swap(slots);
+        for (uint32_t row : old) {
+            if (row != emptySlot) {
+                place(row);
+            }
+        }
+    }
+};
+
+// Reads a key as the server receives it. Integer keys must be whole numbers.
+inline bool parseKey(const std::string& text, std::string& key) {
+    key = text;
+    return true;
+}
+
+template<typename K>
+bool parseKey(const std::string& text, K& key) {
+    static_assert(std::is_integral<K>::value, "Keys are strings or integers");
+    if (text.empty()) {
+        return false;
+    }
+    char* end = nullptr;
+    errno = 0;
+    if (std::is_signed<K>::value) {
+        long long value = std::strtoll(text.c_str(), &end, 10);
+        if (value < std::numeric_limits<K>::min() || value > std::numeric_limits<K>::max()) {
+            return false;
+        }
+        key = static_cast<K>(value);
+    } else {
+        if (text[0] == '-') {
+            return false;
+        }
+        unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+        if (value > std::numeric_limits<K>::max()) {
+            return false;
+        }
+        key = static_cast<K>(value);
+    }
+    return errno == 0 && *end == '\0';
+}
+
+#endif // KEY_TABLE_HPP
@@ -0,0 +1,203 @@
+#ifndef NODE_ORDERING_HPP
+#define NODE_ORDERING_HPP
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <numeric>
+#include <utility>
+#include <cstdint>
+#include <algorithm>
+#include <strings.h>
+
+// How rows are renumbered after a graph is built so that a node's neighbors sit near
+// it in the store, and a hop reads rows, links and codes from pages it has just read.
+enum class NodeOrdering : uint8_t {
+    None = 0,
+    BFS = 1,    // Breadth-first from the graph's entry point
+    RCM = 2,    // Reverse Cuthill-McKee: breadth-first by increasing degree, reversed
+    Gorder = 3  // Greedy: next comes the node with the most edges into the last few placed
+};
+
+// Parses an ordering name from the protocol ("none", "bfs", "rcm", "gorder").
+inline bool parseNodeOrdering(const std::string& name, NodeOrdering& ordering) {
+    if (strcasecmp(name.c_str(), "none") == 0) {
+        ordering = NodeOrdering::None;
+    } else if (strcasecmp(name.c_str(), "bfs") == 0) {
+        ordering = NodeOrdering::BFS;
+    } else if (strcasecmp(name.c_str(), "rcm") == 0) {
+        ordering = NodeOrdering::RCM;
+    } else if (strcasecmp(name.c_str(), "gorder") == 0) {
+        ordering = NodeOrdering::Gorder;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// The edges searches follow between a store's rows, as offsets into one array of
+// targets per row, and the row searches start from
+struct RowGraph {
+    std::vector<size_t> offsets;
+    std::vector<uint32_t> targets;
+    size_t start = 0;
+
+    size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+    size_t degree(size_t row) const { return offsets[row + 1] - offsets[row]; }
+    const uint32_t* begin(size_t row) const { return targets.data() + offsets[row]; }
+    const uint32_t* end(size_t row) const { return targets.data() + offsets[row + 1]; }
+};
+
+// New id of every row of graph under ordering, a permutation of [0, size). Edges are
+// taken both ways, since a graph's edges are mostly returned and either end may be
+// where a search comes from.
+inline std::vector<size_t> localityOrder(const RowGraph& directed, NodeOrdering ordering) {
+    size_t count = directed.size();
+    std::vector<size_t> newIds(count);
+    std::iota(newIds.begin(), newIds.end(), 0);
+    if (ordering == NodeOrdering::None || count == 0) {
+        return newIds;
+    }
+
+    // Undirected, each list sorted without repeats
+    RowGraph graph;
+    graph.start = directed.start < count ? directed.start : 0;
+    graph.offsets.assign(count + 1, 0);
+    for (size_t row = 0; row < count; ++row) {
+        for (const uint32_t* target = directed.begin(row); target != directed.end(row); ++target) {
+            ++graph.offsets[row + 1];
+            ++graph.offsets[*target + 1];
+        }
+    }
+    std::partial_sum(graph.offsets.begin(), graph.offsets.end(), graph.offsets.begin());
+    graph.targets.resize(graph.offsets.back());
+    std::vector<size_t> fill(graph.offsets.begin(), graph.offsets.end() - 1);
+    for (size_t row = 0; row < count; ++row) {
+        for (const uint32_t* target = directed.begin(row); target != directed.end(row); ++target) {
+            graph.targets[fill[row]++] = *target;
+            graph.targets[fill[*target]++] = row;
+        }
+    }
+    size_t kept = 0;
+    for (size_t row = 0; row < count; ++row) {
+        uint32_t* first = graph.targets.data() + graph.offsets[row];
+        uint32_t* last = graph.targets.data() + graph.offsets[row + 1];
+        std::sort(first, last);
+        last = std::unique(first, last);
+        graph.offsets[row] = kept;
+        kept = std::copy(first, last, graph.targets.data() + kept) - graph.targets.data();
+    }
+    graph.offsets[count] = kept;
+    graph.targets.resize(kept);
+
+    // Rows in their new order; a walk that runs dry goes on from a row not yet placed
+    std::vector<uint32_t> order;
+    order.reserve(count);
+    std::vector<uint8_t> placed(count, 0);
+    size_t nextUnplaced = 0;
+    auto restart = [&]() {
+        while (nextUnplaced < count && placed[nextUnplaced]) {
+            ++nextUnplaced;
+        }
+        return nextUnplaced;
+    };
+
+    if (ordering == NodeOrdering::BFS || ordering == NodeOrdering::RCM) {
+        std::vector<uint32_t> neighbors;
+        // Cuthill-McKee starts each component from a node of least degree
+        std::vector<uint32_t> byDegree;
+        if (ordering == NodeOrdering::RCM) {
+            byDegree.resize(count);
+            std::iota(byDegree.begin(), byDegree.end(), 0);
+            std::stable_sort(byDegree.begin(), byDegree.end(), [&](uint32_t a, uint32_t b) {
+                return graph.degree(a) < graph.degree(b);
+            });
+        }
+        size_t nextByDegree = 0;
+        size_t root = graph.start;
+        while (order.size() < count) {
+            if (ordering == NodeOrdering::RCM) {
+                while (placed[byDegree[nextByDegree]]) {
+                    ++nextByDegree;
+                }
+                root = byDegree[nextByDegree];
+            } else if (placed[root]) {
+                root = restart();
+            }
+            size_t head = order.size();
+            placed[root] = 1;
+            order.push_back(root);
+            for (; head < order.size(); ++head) {
+                neighbors.clear();
+                for (const uint32_t* next = graph.begin(order[head]); next != graph.end(order[head]); ++next) {
+                    if (!placed[*next]) {
+                        placed[*next] = 1;
+                        neighbors.push_back(*next);
+                    }
+                }
+                if (ordering == NodeOrdering::RCM) {
+                    std::stable_sort(neighbors.begin(), neighbors.end(), [&](uint32_t a, uint32_t b) {
+                        return graph.degree(a) < graph.degree(b);
+                    });
+                }
+                order.insert(order.end(), neighbors.begin(), neighbors.end());
+            }
+        }
+        if (ordering == NodeOrdering::RCM) {
+            std::reverse(order.begin(), order.end());
+        }
+    } else {
+        // Gorder's neighbor score over a sliding window of the last placed rows. Its
+        // sibling score (shared in-neighbors) is left out: it costs degree squared per
+        // row, and a search graph's edges already link most rows that share neighbors.
+        constexpr size_t window = 5;
+        std::vector<uint32_t> score(count, 0);
+        std::priority_queue<std::pair<uint32_t, uint32_t>> best;
+        auto adjust = [&](uint32_t row, bool entering) {
+            for (const uint32_t* next = graph.begin(row); next != graph.end(row); ++next) {
+                if (placed[*next]) {
+                    continue;
+                }
+                if (entering) {
+                    best.emplace(++score[*next], *next);
+                } else {
+                    --score[*next];
+                }
+            }
+        };
+        size_t seed = graph.start;
+        while (order.size() < count) {
+            // Entries left behind by a score that has since changed are put back at the
+            // score the row has now
+            uint32_t row = count;
+            while (!best.empty()) {
+                auto [queued, candidate] = best.top();
+                best.pop();
+                if (placed[candidate]) {
+                    continue;
+                }
+                if (queued == score[candidate]) {
+                    row = candidate;
+                    break;
+                }
+                best.emplace(score[candidate], candidate);
+            }
+            if (row == count) {
+                row = placed[seed] ? restart() : seed;
+            }
+            placed[row] = 1;
+            order.push_back(row);
+            adjust(row, true);
+            if (order.size() > window) {
+                adjust(order[order.size() - 1 - window], false);
+            }
+        }
+    }
+
+    for (size_t position = 0; position < count; ++position) {
+        newIds[order[position]] = position;
+    }
+    return newIds;
+}
+
+#endif // NODE_ORDERING_HPP
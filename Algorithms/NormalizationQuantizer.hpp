@@ -5,6 +5,7 @@
 #include <cmath>
 #include <algorithm>
 #include <numeric>
+#include <stdexcept>
 
 class NormalizationQuantizer {
 private:
@@ -36,6 +37,9 @@ public:
         }) / data.size();
         
         stdDev = std::sqrt(variance);
+        if (stdDev == 0.0f) {
+            stdDev = 1.0f; // Constant data, any scale puts it in one bin
+        }
 
         // Assuming normalized data is within 3 standard deviations from the mean
         minValue = -3.0f;
@@ -51,6 +55,20 @@ public:
         int bin = static_cast<int>((normalizedValue - minValue) / binSize);
         return std::min(std::max(bin, 0), numBins - 1); // Ensure bin is within range
     }
+
+    // Value at the center of a bin, the inverse of quantize up to the bin width
+    float dequantize(int bin) const {
+        return lowerBound() + (bin + 0.5f) * binWidth();
+    }
+
+    // Start of bin 0 and the width of a bin, in the units of the original values
+    float lowerBound() const {
+        return mean + minValue * stdDev;
+    }
+
+    float binWidth() const {
+        return binSize * stdDev;
+    }
 };
 
 #endif // NORMALIZATIONQUANTIZER_HPP
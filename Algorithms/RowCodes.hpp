@@ -0,0 +1,386 @@
+#ifndef ROW_CODES_HPP
+#define ROW_CODES_HPP
+
+#include <vector>
+#include <string>
+#include <random>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <strings.h>
+
+#include "ScalarQuantizer.hpp"
+#include "Distances.hpp"
+#include "Snapshot.hpp"
+
+// How a graph scores the nodes it walks through: on the rows themselves, or on compact
+// codes of them, reranked on the rows at the end.
+enum class Compression : uint8_t {
+    None = 0,
+    SQ8 = 1, // One byte per dimension
+    PQ = 2   // One byte per subspace of ProductQuantizer8::subspaceWidth dimensions
+};
+
+// Parses a compression name from the protocol ("none", "sq8", "pq").
+inline bool parseCompression(const std::string& name, Compression& compression) {
+    if (strcasecmp(name.c_str(), "none") == 0) {
+        compression = Compression::None;
+    } else if (strcasecmp(name.c_str(), "sq8") == 0) {
+        compression = Compression::SQ8;
+    } else if (strcasecmp(name.c_str(), "pq") == 0) {
+        compression = Compression::PQ;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline const char* compressionName(Compression compression) {
+    switch (compression) {
+        case Compression::SQ8: return "sq8";
+        case Compression::PQ: return "pq";
+        default: return "none";
+    }
+}
+
+// Product quantizer with its sizes set at run time. A row is cut into subspaces of
+// about subspaceWidth dimensions, and each slice is replaced by the index of the
+// nearest of 256 centroids trained for its subspace by k-means, so a row becomes one
+// byte per subspace. A query is scored against codes through a table of its distance
+// to every centroid of every subspace, built once per query.
+class ProductQuantizer8 {
+public:
+    static constexpr int numCentroids = 256;
+    static constexpr int subspaceWidth = 4;
+    // Rows sampled to train the centroids, and the k-means rounds run over them
+    static constexpr size_t maxTrainingRows = 16384;
+    static constexpr int trainingIterations = 10;
+
+    ProductQuantizer8() : dim(0) {}
+
+    // Reads the centroids written by save()
+    explicit ProductQuantizer8(SnapshotReader& snapshot) {
+        dim = snapshot.read<int32_t>();
+        offsets = snapshot.readVector<int32_t>();
+        centroids = snapshot.readVector<float>();
+        if (offsets.empty() || offsets.front() != 0 || offsets.back() != dim
+            || centroids.size() != static_cast<size_t>(numCentroids) * dim) {
+            throw std::runtime_error("Snapshot product quantizer is malformed.");
+        }
+    }
+
+    void save(SnapshotWriter& snapshot) const {
+        snapshot.write<int32_t>(dim);
+        snapshot.writeArray(offsets);
+        snapshot.writeArray(centroids);
+    }
+
+    // Bytes per code
+    size_t codeSize() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+
+    void train(const VectorBlock& rows) {
+        if (rows.empty()) {
+            throw std::invalid_argument("Data for training the product quantizer cannot be empty");
+        }
+        dim = rows.dimension();
+        // Subspaces of subspaceWidth dimensions, the last few one wider if it doesn't divide
+        int subspaces = std::max(1, dim / subspaceWidth);
+        offsets.resize(subspaces + 1);
+        for (int s = 0; s <= subspaces; ++s) {
+            offsets[s] = static_cast<int>(static_cast<long long>(dim) * s / subspaces);
+        }
+
+        size_t stride = std::max<size_t>(1, rows.size() / maxTrainingRows);
+        size_t sampled = (rows.size() + stride - 1) / stride;
+        std::vector<float> sample(sampled * dim);
+        for (size_t r = 0, s = 0; r < rows.size(); r += stride, ++s) {
+            rows.decode(r, sample.data() + s * dim);
+        }
+
+        centroids.assign(static_cast<size_t>(numCentroids) * dim, 0.0f);
+        std::mt19937 gen(std::mt19937::default_seed);
+        for (size_t s = 0; s + 1 < offsets.size(); ++s) {
+            trainSubspace(sample, sampled, s, gen);
+        }
+    }
+
+    void encode(const float* vec, uint8_t* code) const {
+        const DistanceKernels& kernels = getDistanceKernels();
+        float distances[numCentroids];
+        for (size_t s = 0; s < codeSize(); ++s) {
+            int width = offsets[s + 1] - offsets[s];
+            kernels.squaredL2Batch(vec + offsets[s], subspaceCentroids(s), numCentroids, width, distances);
+            code[s] = std::min_element(distances, distances + numCentroids) - distances;
+        }
+    }
+
+    // Fills table with the query's distance to every centroid, numCentroids per subspace.
+    // Smaller is closer, as with VectorSpace: inner products are negated.
+    void prepareQuery(const float* query, Metric metric, std::vector<float>& table) const {
+        const DistanceKernels& kernels = getDistanceKernels();
+        table.resize(codeSize() * numCentroids);
+        for (size_t s = 0; s < codeSize(); ++s) {
+            int width = offsets[s + 1] - offsets[s];
+            float* out = table.data() + s * numCentroids;
+            if (metric == Metric::L2) {
+                kernels.squaredL2Batch(query + offsets[s], subspaceCentroids(s), numCentroids, width, out);
+            } else {
+                kernels.innerProductBatch(query + offsets[s], subspaceCentroids(s), numCentroids, width, out);
+                for (int c = 0; c < numCentroids; ++c) {
+                    out[c] = -out[c];
+                }
+            }
+        }
+    }
+
+    float distance(const float* table, const uint8_t* code) const {
+        float sum = 0.0f;
+        for (size_t s = 0; s < codeSize(); ++s) {
+            sum += table[s * numCentroids + code[s]];
+        }
+        return sum;
+    }
+
+    size_t memoryBytes() const {
+        return centroids.capacity() * sizeof(float) + offsets.capacity() * sizeof(int32_t);
+    }
+
+private:
+    int dim;
+    // Subspace s covers dimensions [offsets[s], offsets[s + 1])
+    std::vector<int32_t> offsets;
+    // Each subspace's centroids back to back, numCentroids * width floats from numCentroids * offsets[s]
+    std::vector<float> centroids;
+
+    const float* subspaceCentroids(size_t s) const {
+        return centroids.data() + static_cast<size_t>(numCentroids) * offsets[s];
+    }
+
+    // Lloyd's k-means over the sample's slice of subspace s, started from sampled rows.
+    // A centroid left without rows is moved onto a random row.
+    void trainSubspace(const std::vector<float>& sample, size_t sampled, size_t s, std::mt19937& gen) {
+        const DistanceKernels& kernels = getDistanceKernels();
+        int width = offsets[s + 1] - offsets[s];
+        std::vector<float> slices(sampled * width);
+        for (size_t r = 0; r < sampled; ++r) {
+            std::copy_n(sample.data() + r * dim + offsets[s], width, slices.data() + r * width);
+        }
+
+        float* subspace = centroids.data() + static_cast<size_t>(numCentroids) * offsets[s];
+        std::uniform_int_distribution<size_t> pick(0, sampled - 1);
+        for (int c = 0; c < numCentroids; ++c) {
+            size_t r = sampled >= static_cast<size_t>(numCentroids) ? c * (sampled / numCentroids) : pick(gen);
+            std::copy_n(slices.data() + r * width, width, subspace + c * width);
+        }
+
+        std::vector<int> assignment(sampled);
+        std::vector<float> sums(static_cast<size_t>(numCentroids) * width);
+        std::vector<size_t> counts(numCentroids);
+        float distances[numCentroids];
+        for (int iteration = 0; iteration < trainingIterations; ++iteration) {
+            for (size_t r = 0; r < sampled; ++r) {
+                kernels.squaredL2Batch(slices.data() + r * width, subspace, numCentroids, width, distances);
+                assignment[r] = std::min_element(distances, distances + numCentroids) - distances;
+            }
+            std::fill(sums.begin(), sums.end(), 0.0f);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t r = 0; r < sampled; ++r) {
+                ++counts[assignment[r]];
+                for (int d = 0; d < width; ++d) {
+                    sums[assignment[r] * width + d] += slices[r * width + d];
+                }
+            }
+            for (int c = 0; c < numCentroids; ++c) {
+                const float* from = counts[c] ? sums.data() + c * width : slices.data() + pick(gen) * width;
+                for (int d = 0; d < width; ++d) {
+                    subspace[c * width + d] = counts[c] ? from[d] / counts[c] : from[d];
+                }
+            }
+        }
+    }
+};
+
+// Compact codes of every row of a store, by row id, kept next to a graph so a search
+// hop reads a few bytes instead of the row. Distances against codes are approximate;
+// a search over them reranks what it finds on the rows.
+//
+// Codes trained on a handful of rows rank the rest at random, so a graph over a store
+// that is still filling trains them only once it holds minTrainingRows rows, and
+// scores rows exactly until then. They are trained again each time the rows have
+// grown retrainGrowth times over, until they have been trained on finalTrainingRows.
+class RowCodes {
+public:
+    static constexpr size_t minTrainingRows = 1024;
+    static constexpr size_t retrainGrowth = 2;
+    static constexpr size_t finalTrainingRows = 65536;
+
+    // A query prepared for one kind of code
+    struct Query {
+        QuantizedQuery sq8;
+        std::vector<float> table;
+    };
+
+    RowCodes() : type(Compression::None), metric(Metric::L2), codeSize(0), trainedRows(0) {}
+
+    // Trains the codes on the rows and encodes them all
+    RowCodes(Compression type, const VectorBlock& rows, Metric metric)
+        : type(type), metric(metric), codeSize(0), trainedRows(rows.size()) {
+        if (type == Compression::SQ8) {
+            sq8.train(rows);
+            codeSize = sq8.dimension();
+        } else if (type == Compression::PQ) {
+            pq.train(rows);
+            codeSize = pq.codeSize();
+        }
+        encodeRows(rows, rows.size());
+    }
+
+    // Reads codes written by save()
+    explicit RowCodes(SnapshotReader& snapshot) : RowCodes() {
+        type = static_cast<Compression>(snapshot.read<uint8_t>());
+        if (type == Compression::None) {
+            return;
+        }
+        metric = static_cast<Metric>(snapshot.read<int32_t>());
+        if (type == Compression::SQ8) {
+            sq8 = ScalarQuantizer(snapshot);
+            codeSize = sq8.dimension();
+        } else if (type == Compression::PQ) {
+            pq = ProductQuantizer8(snapshot);
+            codeSize = pq.codeSize();
+        } else {
+            throw std::runtime_error("Snapshot has an unknown compression.");
+        }
+        trainedRows = snapshot.read<uint64_t>();
+        codes = snapshot.readVector<uint8_t>();
+        if (codeSize == 0 || codes.size() % codeSize != 0) {
+            throw std::runtime_error("Snapshot codes are malformed.");
+        }
+    }
+
+    // The kind, then the quantizer and the rows it was trained on, then every code
+    void save(SnapshotWriter& snapshot) const {
+        snapshot.write<uint8_t>(static_cast<uint8_t>(type));
+        if (type == Compression::None) {
+            return;
+        }
+        snapshot.write<int32_t>(static_cast<int32_t>(metric));
+        if (type == Compression::SQ8) {
+            sq8.save(snapshot);
+        } else {
+            pq.save(snapshot);
+        }
+        snapshot.write<uint64_t>(trainedRows);
+        snapshot.writeArray(codes);
+    }
+
+    Compression compression() const { return type; }
+    bool enabled() const { return type != Compression::None; }
+
+    // Whether codes of type are due to be trained, again or for the first time, over a
+    // store of count rows
+    bool needsTraining(Compression wanted, size_t count) const {
+        if (wanted == Compression::None || count < minTrainingRows) {
+            return false;
+        }
+        if (type != wanted) {
+            return true;
+        }
+        return trainedRows < finalTrainingRows && count >= trainedRows * retrainGrowth;
+    }
+    size_t size() const { return codeSize ? codes.size() / codeSize : 0; }
+
+    // Encodes the rows from size() up to count
+    void encodeRows(const VectorBlock& rows, size_t count) {
+        if (!enabled() || count <= size()) {
+            return;
+        }
+        size_t first = size();
+        codes.resize(count * codeSize);
+        std::vector<float> row(rows.dimension());
+        for (size_t r = first; r < count; ++r) {
+            rows.decode(r, row.data());
+            if (type == Compression::SQ8) {
+                sq8.encode(row.data(), codes.data() + r * codeSize);
+            } else {
+                pq.encode(row.data(), codes.data() + r * codeSize);
+            }
+        }
+    }
+
+    // Drops row id; the last row takes its id
+    void removeRow(size_t id) {
+        if (!enabled() || id >= size()) {
+            return;
+        }
+        size_t last = size() - 1;
+        std::memmove(codes.data() + id * codeSize, codes.data() + last * codeSize, codeSize);
+        codes.resize(last * codeSize);
+    }
+
+    // Keeps only the rows in originalIds, row i taking the code of row originalIds[i]
+    template<typename Id>
+    void keepRows(const std::vector<Id>& originalIds) {
+        if (!enabled()) {
+            return;
+        }
+        std::vector<uint8_t> kept(originalIds.size() * codeSize);
+        for (size_t i = 0; i < originalIds.size(); ++i) {
+            std::memcpy(kept.data() + i * codeSize, codes.data() + originalIds[i] * codeSize, codeSize);
+        }
+        codes.swap(kept);
+    }
+
+    // Row id takes id newIds[id]; every row must have its code
+    void permute(const std::vector<size_t>& newIds) {
+        if (!enabled()) {
+            return;
+        }
+        if (size() != newIds.size()) {
+            throw std::logic_error("The codes are out of step with their rows.");
+        }
+        std::vector<uint8_t> permuted(codes.size());
+        for (size_t id = 0; id < size(); ++id) {
+            std::memcpy(permuted.data() + newIds[id] * codeSize, codes.data() + id * codeSize, codeSize);
+        }
+        codes.swap(permuted);
+    }
+
+    // Fills out for query, reusing its buffers
+    void prepare(const float* query, Query& out) const {
+        if (type == Compression::SQ8) {
+            sq8.prepareQuery(query, metric, out.sq8);
+        } else if (type == Compression::PQ) {
+            pq.prepareQuery(query, metric, out.table);
+        }
+    }
+
+    // Approximate distance from a prepared query to row id, smaller is closer
+    float distance(const Query& query, size_t id) const {
+        const uint8_t* code = codes.data() + id * codeSize;
+        if (type == Compression::PQ) {
+            return pq.distance(query.table.data(), code);
+        }
+        float result;
+        sq8.distanceBatch(query.sq8, code, 1, &result);
+        return result;
+    }
+
+    size_t memoryBytes() const {
+        return codes.capacity() + sq8.memoryBytes() + pq.memoryBytes();
+    }
+
+private:
+    Compression type;
+    Metric metric;
+    ScalarQuantizer sq8;
+    ProductQuantizer8 pq;
+    size_t codeSize;
+    // Rows the quantizer was trained on
+    size_t trainedRows;
+    std::vector<uint8_t> codes;
+};
+
+#endif // ROW_CODES_HPP
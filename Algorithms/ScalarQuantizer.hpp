@@ -0,0 +1,390 @@
+#ifndef SCALAR_QUANTIZER_HPP
+#define SCALAR_QUANTIZER_HPP
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "NormalizationQuantizer.hpp"
+#include "Distances.hpp"
+
+// Kernels between a float query and 8-bit codes. A code c in dimension d stands for
+// base[d] + scale[d] * c, so both metrics are folded into per-query vectors:
+//   squared L2:    sum (shifted[d] - scale[d] * c)^2, with shifted = query - base
+//   inner product: bias + sum scaled[d] * c,          with scaled = query * scale
+struct SQ8Kernels {
+    SimdLevel level;
+    // One query against count codes of length n stored back to back
+    void (*squaredL2Batch)(const float* shifted, const float* scale, const uint8_t* codes, size_t count, size_t n, float* out);
+    void (*innerProductBatch)(const float* scaled, const uint8_t* codes, size_t count, size_t n, float* out);
+};
+
+/* Scalar fallback */
+
+inline float scalarSQ8SquaredL2(const float* shifted, const float* scale, const uint8_t* code, size_t n) {
+    float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (size_t i = 0; i < n; ++i) {
+        float d = shifted[i] - scale[i] * code[i];
+        acc[i % 4] += d * d;
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+inline float scalarSQ8InnerProduct(const float* scaled, const uint8_t* code, size_t n) {
+    float acc[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+    for (size_t i = 0; i < n; ++i) {
+        acc[i % 4] += scaled[i] * code[i];
+    }
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+inline void scalarSQ8SquaredL2Batch(const float* shifted, const float* scale, const uint8_t* codes, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = scalarSQ8SquaredL2(shifted, scale, codes + r * n, n);
+    }
+}
+
+inline void scalarSQ8InnerProductBatch(const float* scaled, const uint8_t* codes, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = scalarSQ8InnerProduct(scaled, codes + r * n, n);
+    }
+}
+
+#ifdef DISTANCE_KERNELS_X86
+
+/* AVX2 + FMA: eight codes zero-extended to int32 and converted per step */
+
+__attribute__((target("avx2,fma")))
+inline __m256 avx2WidenCodes8(const uint8_t* p) {
+    __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(packed));
+}
+
+__attribute__((target("avx2,fma")))
+inline float avx2SQ8SquaredL2(const float* shifted, const float* scale, const uint8_t* code, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i), avx2WidenCodes8(code + i), _mm256_loadu_ps(shifted + i));
+        __m256 d1 = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i + 8), avx2WidenCodes8(code + i + 8), _mm256_loadu_ps(shifted + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i), avx2WidenCodes8(code + i), _mm256_loadu_ps(shifted + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+    float sum = horizontalSum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        float d = shifted[i] - scale[i] * code[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+inline float avx2SQ8InnerProduct(const float* scaled, const uint8_t* code, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(scaled + i), avx2WidenCodes8(code + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(scaled + i + 8), avx2WidenCodes8(code + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(scaled + i), avx2WidenCodes8(code + i), acc0);
+    }
+    float sum = horizontalSum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        sum += scaled[i] * code[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+inline void avx2SQ8SquaredL2Batch(const float* shifted, const float* scale, const uint8_t* codes, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = avx2SQ8SquaredL2(shifted, scale, codes + r * n, n);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+inline void avx2SQ8InnerProductBatch(const float* scaled, const uint8_t* codes, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = avx2SQ8InnerProduct(scaled, codes + r * n, n);
+    }
+}
+
+/* AVX-512 */
+
+__attribute__((target("avx512f,avx2,fma")))
+inline __m512 avx512WidenCodes16(const uint8_t* p) {
+    __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    // maskz forms for the same GCC 12 -Wuninitialized reason as horizontalSum512
+    return _mm512_maskz_cvtepi32_ps(0xFFFF, _mm512_maskz_cvtepu8_epi32(0xFFFF, packed));
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+inline float avx512SQ8SquaredL2(const float* shifted, const float* scale, const uint8_t* code, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512 d0 = _mm512_fnmadd_ps(_mm512_loadu_ps(scale + i), avx512WidenCodes16(code + i), _mm512_loadu_ps(shifted + i));
+        __m512 d1 = _mm512_fnmadd_ps(_mm512_loadu_ps(scale + i + 16), avx512WidenCodes16(code + i + 16), _mm512_loadu_ps(shifted + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_fnmadd_ps(_mm512_loadu_ps(scale + i), avx512WidenCodes16(code + i), _mm512_loadu_ps(shifted + i));
+        acc0 = _mm512_fmadd_ps(d, d, acc0);
+    }
+    float sum = horizontalSum512(_mm512_add_ps(acc0, acc1));
+    if (i < n) {
+        sum += avx2SQ8SquaredL2(shifted + i, scale + i, code + i, n - i);
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+inline float avx512SQ8InnerProduct(const float* scaled, const uint8_t* code, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(scaled + i), avx512WidenCodes16(code + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(scaled + i + 16), avx512WidenCodes16(code + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(scaled + i), avx512WidenCodes16(code + i), acc0);
+    }
+    float sum = horizontalSum512(_mm512_add_ps(acc0, acc1));
+    if (i < n) {
+        sum += avx2SQ8InnerProduct(scaled + i, code + i, n - i);
+    }
+    return sum;
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+inline void avx512SQ8SquaredL2Batch(const float* shifted, const float* scale, const uint8_t* codes, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = avx512SQ8SquaredL2(shifted, scale, codes + r * n, n);
+    }
+}
+
+__attribute__((target("avx512f,avx2,fma")))
+inline void avx512SQ8InnerProductBatch(const float* scaled, const uint8_t* codes, size_t count, size_t n, float* out) {
+    for (size_t r = 0; r < count; ++r) {
+        out[r] = avx512SQ8InnerProduct(scaled, codes + r * n, n);
+    }
+}
+
+#endif // DISTANCE_KERNELS_X86
+
+// Picks the widest SQ8 kernel set the running CPU supports.
+inline SQ8Kernels detectSQ8Kernels() {
+#ifdef DISTANCE_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return { SimdLevel::AVX512, avx512SQ8SquaredL2Batch, avx512SQ8InnerProductBatch };
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return { SimdLevel::AVX2, avx2SQ8SquaredL2Batch, avx2SQ8InnerProductBatch };
+    }
+#endif
+    return { SimdLevel::Scalar, scalarSQ8SquaredL2Batch, scalarSQ8InnerProductBatch };
+}
+
+// SQ8 kernel table for this process, detected once on first use.
+inline const SQ8Kernels& getSQ8Kernels() {
+    static const SQ8Kernels kernels = detectSQ8Kernels();
+    return kernels;
+}
+
+// A query folded into the form the SQ8 kernels take for one metric
+struct QuantizedQuery {
+    Metric metric;
+    std::vector<float> shifted; // L2: query minus each dimension's bin 0 value
+    std::vector<float> scaled;  // Inner product: query times each dimension's bin width
+    float bias = 0.0f;          // Inner product: query dotted with the bin 0 values
+};
+
+// Per-dimension 8-bit scalar quantizer. Each dimension gets its own 256-bin
+// NormalizationQuantizer, so a collection is encoded at one byte per float with
+// bins fitted to that dimension's spread. Distances against the codes are
+// approximate; rerankExact() restores exact order over a shortlist.
+class ScalarQuantizer {
+public:
+    static constexpr int numBins = 256;
+    // Rows sampled to fit the bins; more adds little and slows training down
+    static constexpr size_t maxTrainingRows = 65536;
+
+    ScalarQuantizer() : dim(0) {}
+
+    explicit ScalarQuantizer(int dimension) : dim(dimension) {}
+
+    // Reads the bins written by save()
+    explicit ScalarQuantizer(SnapshotReader& snapshot) {
+        dim = snapshot.read<int32_t>();
+        base = snapshot.readVector<float>();
+        scale = snapshot.readVector<float>();
+        lowerBound = snapshot.readVector<float>();
+        inverseScale.resize(scale.size());
+        for (size_t d = 0; d < scale.size(); ++d) {
+            inverseScale[d] = 1.0f / scale[d];
+        }
+    }
+
+    void save(SnapshotWriter& snapshot) const {
+        snapshot.write<int32_t>(dim);
+        snapshot.writeArray(base);
+        snapshot.writeArray(scale);
+        snapshot.writeArray(lowerBound);
+    }
+
+    int dimension() const { return dim; }
+    bool trained() const { return !scale.empty(); }
+
+    // Fits one quantizer per dimension to the rows
+    void train(const VectorBlock& rows) {
+        if (rows.empty()) {
+            throw std::invalid_argument("Data for training the scalar quantizer cannot be empty");
+        }
+        dim = rows.dimension();
+        size_t stride = std::max<size_t>(1, rows.size() / maxTrainingRows);
+        size_t sampled = (rows.size() + stride - 1) / stride;
+
+        // Gather the sample column by column for the per-dimension quantizers
+        std::vector<std::vector<float>> columns(dim, std::vector<float>(sampled));
+        std::vector<float> row(dim);
+        for (size_t r = 0, s = 0; r < rows.size(); r += stride, ++s) {
+            rows.decode(r, row.data());
+            for (int d = 0; d < dim; ++d) {
+                columns[d][s] = row[d];
+            }
+        }
+
+        quantizers.assign(dim, NormalizationQuantizer(numBins));
+        base.resize(dim);
+        scale.resize(dim);
+        inverseScale.resize(dim);
+        lowerBound.resize(dim);
+        for (int d = 0; d < dim; ++d) {
+            quantizers[d].learnNormalizationParameters(columns[d]);
+            lowerBound[d] = quantizers[d].lowerBound();
+            scale[d] = quantizers[d].binWidth();
+            inverseScale[d] = 1.0f / scale[d];
+            base[d] = quantizers[d].dequantize(0);
+        }
+    }
+
+    // Same bins as NormalizationQuantizer::quantize, from the precomputed bounds
+    void encode(const float* vec, uint8_t* code) const {
+        for (int d = 0; d < dim; ++d) {
+            float bin = (vec[d] - lowerBound[d]) * inverseScale[d];
+            code[d] = static_cast<uint8_t>(std::min(std::max(bin, 0.0f), static_cast<float>(numBins - 1)));
+        }
+    }
+
+    // Every row of the block into one contiguous buffer, dimension bytes per row
+    std::vector<uint8_t> encode(const VectorBlock& rows) const {
+        std::vector<uint8_t> codes(rows.size() * dim);
+        std::vector<float> row(dim);
+        for (size_t r = 0; r < rows.size(); ++r) {
+            rows.decode(r, row.data());
+            encode(row.data(), codes.data() + r * dim);
+        }
+        return codes;
+    }
+
+    void decode(const uint8_t* code, float* out) const {
+        for (int d = 0; d < dim; ++d) {
+            out[d] = base[d] + scale[d] * code[d];
+        }
+    }
+
+    QuantizedQuery prepareQuery(const float* query, Metric metric) const {
+        QuantizedQuery prepared;
+        prepareQuery(query, metric, prepared);
+        return prepared;
+    }
+
+    // Same, into a query whose buffers are reused
+    void prepareQuery(const float* query, Metric metric, QuantizedQuery& prepared) const {
+        prepared.metric = metric;
+        prepared.bias = 0.0f;
+        if (metric == Metric::L2) {
+            prepared.shifted.resize(dim);
+            for (int d = 0; d < dim; ++d) {
+                prepared.shifted[d] = query[d] - base[d];
+            }
+        } else {
+            prepared.scaled.resize(dim);
+            for (int d = 0; d < dim; ++d) {
+                prepared.scaled[d] = query[d] * scale[d];
+                prepared.bias += query[d] * base[d];
+            }
+        }
+    }
+
+    // Approximate distances, smaller is closer as with VectorSpace
+    void distanceBatch(const QuantizedQuery& query, const uint8_t* codes, size_t count, float* out) const {
+        const SQ8Kernels& kernels = getSQ8Kernels();
+        if (query.metric == Metric::L2) {
+            kernels.squaredL2Batch(query.shifted.data(), scale.data(), codes, count, dim, out);
+            return;
+        }
+        kernels.innerProductBatch(query.scaled.data(), codes, count, dim, out);
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = -(out[i] + query.bias);
+        }
+    }
+
+    // Offers count codes to topK, numbered from firstIndex, passing over numbers in skip
+    void scanTopK(const QuantizedQuery& query, const uint8_t* codes, size_t count, size_t firstIndex, TopK& topK,
+                  const Tombstones* skip = nullptr) const {
+        constexpr size_t blockSize = 64;
+        float distances[blockSize];
+        for (size_t start = 0; start < count; start += blockSize) {
+            size_t rows = std::min(blockSize, count - start);
+            distanceBatch(query, codes + start * dim, rows, distances);
+            for (size_t i = 0; i < rows; ++i) {
+                if (!skip || !skip->test(firstIndex + start + i)) {
+                    topK.push(distances[i], firstIndex + start + i);
+                }
+            }
+        }
+    }
+
+    // Bytes held by the trained parameters, not counting any codes
+    size_t memoryBytes() const {
+        return (base.capacity() + scale.capacity() + inverseScale.capacity() + lowerBound.capacity()) * sizeof(float)
+             + quantizers.capacity() * sizeof(NormalizationQuantizer);
+    }
+
+private:
+    int dim;
+    std::vector<NormalizationQuantizer> quantizers;
+    std::vector<float> base;         // Value of code 0 in each dimension (bin center)
+    std::vector<float> scale;        // Bin width in each dimension
+    std::vector<float> inverseScale;
+    std::vector<float> lowerBound;   // Start of bin 0 in each dimension
+};
+
+// Rescores a shortlist of (approximate distance, row) pairs against the exact rows and
+// keeps the k closest, closest first.
+inline std::vector<std::pair<float, size_t>> rerankExact(const VectorSpace& space, const float* query,
+                                                         const std::vector<std::pair<float, size_t>>& candidates,
+                                                         const VectorBlock& rows, size_t k) {
+    TopK topK(k);
+    float distance;
+    for (const auto& candidate : candidates) {
+        space.distanceBatch(query, rows, candidate.second, 1, &distance);
+        topK.push(distance, candidate.second);
+    }
+    return topK.takeSorted();
+}
+
+#endif // SCALAR_QUANTIZER_HPP
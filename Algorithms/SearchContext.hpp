@@ -0,0 +1,111 @@
+#ifndef SEARCH_CONTEXT_HPP
+#define SEARCH_CONTEXT_HPP
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+// Working memory of one best-first graph search: which nodes it has visited, the
+// candidates left to expand and the nearest nodes found so far. Each thread keeps one
+// per node id type and reuses it, so once its arrays have grown to fit the graph and
+// the ef asked for, a search allocates nothing.
+//
+// A node counts as visited when its stamp equals the current epoch, so starting a
+// search unmarks every node by bumping the epoch instead of clearing the stamps.
+template<typename Id>
+class SearchContext {
+public:
+    using Entry = std::pair<float, Id>;
+
+    // The calling thread's context. A search must be done with it before the next
+    // one on the same thread begins.
+    static SearchContext& local() {
+        static thread_local SearchContext context;
+        return context;
+    }
+
+    // Starts a search over node ids [0, nodeCount)
+    void begin(size_t nodeCount) {
+        if (stamps.size() < nodeCount) {
+            stamps.resize(nodeCount, 0);
+        }
+        if (++epoch == 0) {
+            // The epoch wrapped: old stamps could match it again
+            std::fill(stamps.begin(), stamps.end(), 0);
+            epoch = 1;
+        }
+        candidates.clear();
+        nearest.clear();
+    }
+
+    // Marks id visited; false if it already was
+    bool visit(Id id) {
+        if (stamps[id] == epoch) {
+            return false;
+        }
+        stamps[id] = epoch;
+        return true;
+    }
+
+    // Candidates are kept as a min-heap on distance
+    bool hasCandidates() const { return !candidates.empty(); }
+
+    void pushCandidate(float distance, Id id) {
+        candidates.emplace_back(distance, id);
+        std::push_heap(candidates.begin(), candidates.end(), std::greater<Entry>());
+    }
+
+    Entry popCandidate() {
+        std::pop_heap(candidates.begin(), candidates.end(), std::greater<Entry>());
+        Entry closest = candidates.back();
+        candidates.pop_back();
+        return closest;
+    }
+
+    // The nearest nodes are kept as a max-heap on distance, at most ef of them
+    size_t nearestCount() const { return nearest.size(); }
+
+    float farthest() const { return nearest.front().first; }
+
+    void pushNearest(float distance, Id id, size_t ef) {
+        nearest.emplace_back(distance, id);
+        std::push_heap(nearest.begin(), nearest.end());
+        if (nearest.size() > ef) {
+            std::pop_heap(nearest.begin(), nearest.end());
+            nearest.pop_back();
+        }
+    }
+
+    // The nearest nodes, closest first. They stay in the context until the next search.
+    const std::vector<Entry>& sortedNearest() {
+        std::sort_heap(nearest.begin(), nearest.end());
+        return nearest;
+    }
+
+    // Scores the nearest nodes again with distanceOf and keeps the ef closest, for a
+    // search walked on approximate distances and finished on exact ones
+    template<typename Distance>
+    void rescoreNearest(Distance&& distanceOf, size_t ef) {
+        for (auto& entry : nearest) {
+            entry.first = distanceOf(entry.second);
+        }
+        std::make_heap(nearest.begin(), nearest.end());
+        while (nearest.size() > ef) {
+            std::pop_heap(nearest.begin(), nearest.end());
+            nearest.pop_back();
+        }
+    }
+
+    // Room for copying out a neighbor list, for graphs whose lists are locked
+    std::vector<Id> neighbors;
+
+private:
+    std::vector<uint32_t> stamps;
+    uint32_t epoch = 0;
+    std::vector<Entry> candidates;
+    std::vector<Entry> nearest;
+};
+
+#endif // SEARCH_CONTEXT_HPP
@@ -0,0 +1,294 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <stdexcept>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A snapshot is one file: a header, then a section for each structure, which writes
+// and reads its own fields in order. Arrays are written raw and 64-byte aligned, so
+// a reader that maps the file can use them where they lie: collection rows are page
+// aligned and served from the mapping as they are (see VectorBlock), and graphs and
+// lists are stored flat so loading them is one pass over the ids, with no distances.
+//
+// Numbers are stored in the machine's byte order. The header records it, and a
+// snapshot written on a machine of the other order is refused rather than swapped.
+
+enum class SnapshotSection : uint32_t {
+    Collection = 1,
+    Store,
+    HNSW,
+    Vamana,
+    InvertedFile,
+    Annoy,
+    DiskVamana,
+};
+
+struct SnapshotFormat {
+    static constexpr char magic[8] = {'V', 'E', 'C', 'S', 'N', 'A', 'P', '\0'};
+    static constexpr uint32_t version = 8;
+    static constexpr uint32_t byteOrderMark = 0x01020304;
+    static constexpr size_t arrayAlignment = 64;
+    static constexpr size_t pageAlignment = 4096;
+};
+
+// Writes a snapshot next to path and moves it over path on commit(), so a crash
+// mid-save leaves the previous snapshot in place
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(const std::string& path) : path(path), temporaryPath(path + ".tmp") {
+        fd = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open snapshot file " + temporaryPath + " for writing.");
+        }
+        writeBytes(SnapshotFormat::magic, sizeof(SnapshotFormat::magic));
+        write(SnapshotFormat::version);
+        write(SnapshotFormat::byteOrderMark);
+    }
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    ~SnapshotWriter() {
+        if (fd >= 0) {
+            ::close(fd);
+            ::unlink(temporaryPath.c_str());
+        }
+    }
+
+    template<typename V>
+    void write(const V& value) {
+        static_assert(std::is_trivially_copyable<V>::value, "Only plain values are written as they are");
+        writeBytes(&value, sizeof(V));
+    }
+
+    void writeBytes(const void* data, size_t bytes) {
+        const char* bytesIn = static_cast<const char*>(data);
+        buffer.insert(buffer.end(), bytesIn, bytesIn + bytes);
+        offset += bytes;
+        if (buffer.size() >= flushBytes) {
+            flush();
+        }
+    }
+
+    // Pads with zeros up to the next multiple of alignment
+    void align(size_t alignment) {
+        static const char zeros[SnapshotFormat::pageAlignment] = {};
+        size_t padding = (alignment - offset % alignment) % alignment;
+        writeBytes(zeros, padding);
+    }
+
+    // A count, then the values raw at the next 64-byte boundary
+    template<typename V>
+    void writeArray(const V* values, size_t count) {
+        static_assert(std::is_trivially_copyable<V>::value, "Only plain values are written as they are");
+        write<uint64_t>(count);
+        align(SnapshotFormat::arrayAlignment);
+        writeBytes(values, count * sizeof(V));
+    }
+
+    template<typename V>
+    void writeArray(const std::vector<V>& values) {
+        writeArray(values.data(), values.size());
+    }
+
+    void writeString(std::string_view value) {
+        write<uint64_t>(value.size());
+        writeBytes(value.data(), value.size());
+    }
+
+    template<typename K>
+    void writeKey(const K& key) {
+        if constexpr (std::is_same<K, std::string>::value) {
+            writeString(key);
+        } else {
+            write(key);
+        }
+    }
+
+    // A string key handed out as a view, say from an interned arena
+    void writeKey(std::string_view key) {
+        writeString(key);
+    }
+
+    void section(SnapshotSection kind) {
+        write(kind);
+    }
+
+    size_t position() const { return offset; }
+
+    // Flushes, syncs and moves the finished snapshot over path
+    void commit() {
+        flush();
+        if (::fsync(fd) != 0 || ::close(fd) != 0) {
+            fd = -1;
+            ::unlink(temporaryPath.c_str());
+            throw std::runtime_error("Could not write snapshot file " + temporaryPath + ".");
+        }
+        fd = -1;
+        if (std::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+            ::unlink(temporaryPath.c_str());
+            throw std::runtime_error("Could not move snapshot into place at " + path + ".");
+        }
+    }
+
+private:
+    static constexpr size_t flushBytes = 1 << 20;
+
+    std::string path;
+    std::string temporaryPath;
+    int fd = -1;
+    size_t offset = 0;
+    std::vector<char> buffer;
+
+    void flush() {
+        size_t written = 0;
+        while (written < buffer.size()) {
+            ssize_t rv = ::write(fd, buffer.data() + written, buffer.size() - written);
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rv <= 0) {
+                throw std::runtime_error("Could not write snapshot file " + temporaryPath + ".");
+            }
+            written += static_cast<size_t>(rv);
+        }
+        buffer.clear();
+    }
+};
+
+// Maps a snapshot and reads it back section by section. The mapping is private, so
+// arrays handed out in place may be written to without touching the file, and it
+// stays mapped for as long as anything holds mapping().
+class SnapshotReader {
+public:
+    explicit SnapshotReader(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open snapshot file " + path + ".");
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Could not read snapshot file " + path + ".");
+        }
+        size = static_cast<size_t>(info.st_size);
+        if (size == 0) {
+            ::close(fd);
+            throw std::runtime_error("Snapshot file " + path + " is empty.");
+        }
+        void* data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::runtime_error("Could not map snapshot file " + path + ".");
+        }
+        size_t mappedSize = size;
+        base = std::shared_ptr<unsigned char>(static_cast<unsigned char*>(data),
+                                              [mappedSize](unsigned char* p) { ::munmap(p, mappedSize); });
+
+        char magic[sizeof(SnapshotFormat::magic)];
+        std::memcpy(magic, take(sizeof(magic)), sizeof(magic));
+        if (std::memcmp(magic, SnapshotFormat::magic, sizeof(magic)) != 0) {
+            throw std::runtime_error(path + " is not a snapshot.");
+        }
+        if (read<uint32_t>() != SnapshotFormat::version) {
+            throw std::runtime_error("Snapshot " + path + " was written by an unsupported version.");
+        }
+        if (read<uint32_t>() != SnapshotFormat::byteOrderMark) {
+            throw std::runtime_error("Snapshot " + path + " was written with a different byte order.");
+        }
+    }
+
+    template<typename V>
+    V read() {
+        static_assert(std::is_trivially_copyable<V>::value, "Only plain values are read as they are");
+        V value;
+        std::memcpy(&value, take(sizeof(V)), sizeof(V));
+        return value;
+    }
+
+    void align(size_t alignment) {
+        take((alignment - offset % alignment) % alignment);
+    }
+
+    // An array written by SnapshotWriter::writeArray, in place in the mapping
+    template<typename V>
+    V* readArray(size_t& count) {
+        count = read<uint64_t>();
+        align(SnapshotFormat::arrayAlignment);
+        if (count > (size - offset) / sizeof(V)) {
+            throw std::runtime_error("Snapshot is truncated.");
+        }
+        return reinterpret_cast<V*>(take(count * sizeof(V)));
+    }
+
+    // The same array copied out
+    template<typename V>
+    std::vector<V> readVector() {
+        size_t count = 0;
+        const V* values = readArray<V>(count);
+        return std::vector<V>(values, values + count);
+    }
+
+    std::string readString() {
+        size_t length = read<uint64_t>();
+        if (length > size - offset) {
+            throw std::runtime_error("Snapshot is truncated.");
+        }
+        return std::string(reinterpret_cast<const char*>(take(length)), length);
+    }
+
+    template<typename K>
+    K readKey() {
+        if constexpr (std::is_same<K, std::string>::value) {
+            return readString();
+        } else {
+            return read<K>();
+        }
+    }
+
+    // The next bytes, in place in the mapping
+    unsigned char* readBytes(size_t bytes) {
+        return take(bytes);
+    }
+
+    SnapshotSection section() {
+        return read<SnapshotSection>();
+    }
+
+    void expect(SnapshotSection kind) {
+        if (section() != kind) {
+            throw std::runtime_error("Snapshot section is out of order.");
+        }
+    }
+
+    // Keeps the mapped file alive for arrays used in place
+    std::shared_ptr<void> mapping() const { return base; }
+
+private:
+    std::shared_ptr<unsigned char> base;
+    size_t size = 0;
+    size_t offset = 0;
+
+    unsigned char* take(size_t bytes) {
+        if (bytes > size - offset) {
+            throw std::runtime_error("Snapshot is truncated.");
+        }
+        unsigned char* at = base.get() + offset;
+        offset += bytes;
+        return at;
+    }
+};
+
+#endif // SNAPSHOT_HPP
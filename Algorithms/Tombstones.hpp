@@ -0,0 +1,86 @@
+#ifndef TOMBSTONES_HPP
+#define TOMBSTONES_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+// One bit per row id, set for rows that were deleted but are still in the store.
+// Searches step over them while graphs keep routing through them, until a
+// compaction relinks the graphs and removes the rows for good.
+class Tombstones {
+public:
+    bool test(size_t id) const {
+        size_t word = id >> 6;
+        return word < words.size() && ((words[word] >> (id & 63)) & 1);
+    }
+
+    void set(size_t id) {
+        if (words.size() <= (id >> 6)) {
+            words.resize((id >> 6) + 1, 0);
+        }
+        if (!test(id)) {
+            words[id >> 6] |= uint64_t(1) << (id & 63);
+            ++setCount;
+        }
+    }
+
+    void reset(size_t id) {
+        if (test(id)) {
+            words[id >> 6] &= ~(uint64_t(1) << (id & 63));
+            --setCount;
+        }
+    }
+
+    size_t count() const { return setCount; }
+    bool any() const { return setCount > 0; }
+
+    // The set ids in increasing order
+    std::vector<size_t> ids() const {
+        std::vector<size_t> result;
+        result.reserve(setCount);
+        for (size_t word = 0; word < words.size(); ++word) {
+            for (uint64_t bits = words[word]; bits != 0; bits &= bits - 1) {
+                result.push_back((word << 6) + __builtin_ctzll(bits));
+            }
+        }
+        return result;
+    }
+
+    // Forgets ids from rows on
+    void truncate(size_t rows) {
+        size_t keep = (rows + 63) >> 6;
+        if (keep < words.size()) {
+            for (size_t word = keep; word < words.size(); ++word) {
+                setCount -= __builtin_popcountll(words[word]);
+            }
+            words.resize(keep);
+        }
+        if ((rows & 63) != 0 && keep > 0 && keep <= words.size()) {
+            uint64_t mask = (uint64_t(1) << (rows & 63)) - 1;
+            setCount -= __builtin_popcountll(words[keep - 1] & ~mask);
+            words[keep - 1] &= mask;
+        }
+    }
+
+    // Moves each set id to newIds[id]
+    void permute(const std::vector<size_t>& newIds) {
+        std::vector<size_t> set = ids();
+        std::fill(words.begin(), words.end(), 0);
+        setCount = 0;
+        for (size_t id : set) {
+            this->set(newIds[id]);
+        }
+    }
+
+    void shrinkToFit() { words.shrink_to_fit(); }
+
+    size_t memoryBytes() const { return words.capacity() * sizeof(uint64_t); }
+
+private:
+    std::vector<uint64_t> words;
+    size_t setCount = 0;
+};
+
+#endif // TOMBSTONES_HPP
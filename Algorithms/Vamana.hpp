@@ -4,225 +4,680 @@
 #include <iostream>
 #include <vector>
 #include <memory>
-#include <queue>
 #include <set>
 #include <random>
 #include <unordered_set>
 #include <functional>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 #include "VectorSearchAlgorithm.hpp"
 #include "DirectedGraphNode.hpp"
 #include "Distances.hpp"
+#include "VectorStore.hpp"
+#include "SearchContext.hpp"
+#include "RowCodes.hpp"
 
 template<typename T>
 class Vamana : public VectorSearchAlgorithm<T> {
 public:
-    using NodeValueType = std::pair<T, std::vector<float>>;
+    // A node is the id of its row in the collection's store
+    using NodeValueType = size_t;
     using Node = DirectedGraphNode<NodeValueType>;
 
+    // The node of each store row, by id
     std::vector<std::shared_ptr<Node>> nodes;
+    // Value of a node taken out of the graph. Edges to such a node can remain in graphs
+    // saved before every edge was recorded at both ends; search steps over them.
+    static constexpr NodeValueType removedNode = std::numeric_limits<NodeValueType>::max();
     float alpha;
     int vector_len; 
     int R;
     int nq;
-    float (*distanceFunction)(const std::vector<float>&, const std::vector<float>&);
-
-    Vamana(const std::vector<std::pair<T, std::vector<float>>>& nodeValues, 
+    // What searchRows scores nodes on while walking the graph. With codes, it keeps
+    // ef * rerank_factor nodes and rescores them on their rows for the ef returned.
+    // The build and search() always work on the rows, and so does searchRows until the
+    // codes have enough rows to be trained on (RowCodes::minTrainingRows).
+    Compression compression;
+    int rerank_factor;
+    // Size of the list a build keeps while searching for each node's neighbors, and
+    // how many threads it runs on (0 for every core)
+    int L;
+    int threads;
+    VectorSpace space;
+    std::shared_ptr<const VectorStore<T>> store;
+
+    Vamana(std::shared_ptr<const VectorStore<T>> store, 
+           const VectorSpace& space,
            float alpha,
            int vector_len,
            int R,
            int nq = 1,
-           float (*distanceFunction)(const std::vector<float>&, const std::vector<float>&) = defaultDistance) 
+           Compression compression = Compression::None,
+           int rerank_factor = 4,
+           int L = 100,
+           int threads = 0,
+           uint32_t seed = std::mt19937::default_seed)
            : alpha(alpha),
              vector_len(vector_len),
              R(R),
              nq(nq),
-             distanceFunction(distanceFunction) {
+             compression(compression),
+             rerank_factor(rerank_factor),
+             L(L),
+             threads(threads),
+             space(space),
+             store(std::move(store)),
+             seed(seed) {
+        if (rerank_factor <= 0) {
+            throw std::invalid_argument("The rerank factor must be positive.");
+        }
+        if (R <= 0 || L <= 0) {
+            throw std::invalid_argument("The degree and build list size must be positive.");
+        }
+        if (codes.needsTraining(compression, this->store->size())) {
+            codes = RowCodes(compression, this->store->vectors(), space.metric);
+        }
+        std::vector<NodeValueType> nodeValues(this->store->size());
+        std::iota(nodeValues.begin(), nodeValues.end(), 0);
         build_rng(nodeValues);
     }
 
+    // Reads a graph written by save(), wiring the nodes back up from the stored ids.
+    // The section tag has already been read.
+    Vamana(std::shared_ptr<const VectorStore<T>> store, SnapshotReader& snapshot) : store(std::move(store)) {
+        alpha = snapshot.read<float>();
+        vector_len = snapshot.read<int32_t>();
+        R = snapshot.read<int32_t>();
+        nq = snapshot.read<int32_t>();
+        compression = static_cast<Compression>(snapshot.read<uint8_t>());
+        rerank_factor = snapshot.read<int32_t>();
+        L = snapshot.read<int32_t>();
+        threads = snapshot.read<int32_t>();
+        space = VectorSpace(snapshot);
+        if (rerank_factor <= 0 || R <= 0 || L <= 0) {
+            throw std::runtime_error("Snapshot graph is malformed.");
+        }
+
+        size_t count = 0;
+        const uint8_t* present = snapshot.readArray<uint8_t>(count);
+        nodes.resize(count);
+        for (size_t id = 0; id < count; ++id) {
+            if (present[id]) {
+                nodes[id] = std::make_shared<Node>(id);
+            }
+        }
+        auto nodeAt = [&](uint64_t id) {
+            if (id >= nodes.size() || !nodes[id]) {
+                throw std::runtime_error("Snapshot graph refers to a missing node.");
+            }
+            return nodes[id];
+        };
+        for (auto list : {&Node::outgoingAdjList, &Node::incomingAdjList}) {
+            size_t offsetCount = 0, edgeCount = 0;
+            const uint64_t* offsets = snapshot.readArray<uint64_t>(offsetCount);
+            const uint64_t* edges = snapshot.readArray<uint64_t>(edgeCount);
+            if (offsetCount != count + 1 || offsets[count] != edgeCount) {
+                throw std::runtime_error("Snapshot graph is malformed.");
+            }
+            for (size_t id = 0; id < count; ++id) {
+                if (!nodes[id]) {
+                    continue;
+                }
+                auto& adjacents = (*nodes[id]).*list;
+                adjacents.reserve(offsets[id + 1] - offsets[id]);
+                for (uint64_t edge = offsets[id]; edge < offsets[id + 1]; ++edge) {
+                    adjacents.push_back(nodeAt(edges[edge]));
+                }
+            }
+        }
+        uint64_t start = snapshot.read<uint64_t>();
+        if (start != removedNode) {
+            startNode = nodeAt(start);
+        }
+        codes = RowCodes(snapshot);
+        if (codes.enabled() && (codes.compression() != compression || codes.size() < count)) {
+            throw std::runtime_error("Snapshot graph codes are malformed.");
+        }
+    }
+
+    // Each edge is held at both ends, so every node is in a cycle of shared_ptrs; the
+    // lists are emptied for the nodes to be freed with the graph
+    ~Vamana() override {
+        for (auto& node : nodes) {
+            if (node) {
+                node->outgoingAdjList.clear();
+                node->incomingAdjList.clear();
+            }
+        }
+    }
+
     std::vector<std::pair<T, std::vector<float>>> searchClosest(const std::vector<float>& target, const int ef = 1) override {
-        // Perform the search to get a vector of shared pointers to nodes
-        auto nodes = search(target, ef);
-    
-        // Prepare the result vector with the appropriate format
-        std::vector<std::pair<T, std::vector<float>>> results;
-        results.reserve(nodes.size());
-
-        // Transform each node into the required format: a pair of T (node value) and vector<float> (node vector)
-        for (const auto& node : nodes) {
-            results.emplace_back(node->value.first, node->value.second);
+        // Each node's row key and vector, from the store
+        return store->entries(searchRows(target, ef));
+    }
+
+    std::vector<size_t> searchRows(const std::vector<float>& target, const int ef = 1) override {
+        return searchRows(target, ef, SearchOptions());
+    }
+
+    // Keeps a list of options.listSize nodes (at least k) and expands options.beamWidth
+    // of them per step, fetching all their neighbors' rows before scoring any
+    std::vector<size_t> searchRows(const std::vector<float>& target, int k, const SearchOptions& options) override {
+        // A node's value is its row id, so the rows come straight out of the search
+        auto& context = SearchContext<NodeValueType>::local();
+        size_t count = std::max(k, 1);
+        size_t list = std::max<size_t>(count, options.listSize);
+        if (!searchInto(context, target.data(), count, list, options.beamFor(list, 1), true)) {
+            return {};
+        }
+        const auto& nearest = context.sortedNearest();
+        std::vector<size_t> rows(std::min(count, nearest.size()));
+        for (size_t i = 0; i < rows.size(); ++i) {
+            rows[i] = nearest[i].second;
+        }
+        return rows;
+    }
+
+    // Links the row in as it arrives: a search for it from the start node, a prune of
+    // the nodes the search went through down to its edges, and an edge back to it from
+    // each of those, pruning any of them that goes over R. The row is searchable at once.
+    void addRow(size_t id) override {
+        if (nodes.size() <= id) {
+            nodes.resize(id + 1);
+        }
+        // A graph built before the collection had rows picks up its dimension from the store
+        if (space.dimension == 0) {
+            space = VectorSpace(store->dimension(), space.metric, space.storage);
+        }
+        // Codes are trained once there are enough rows, and again as the rows grow
+        if (codes.needsTraining(compression, store->size())) {
+            codes = RowCodes(compression, store->vectors(), space.metric);
         }
+        codes.encodeRows(store->vectors(), id + 1);
 
-        return results; 
+        auto node = std::make_shared<Node>(id);
+        if (!startNode) {
+            nodes[id] = node;
+            startNode = node;
+            return;
+        }
+        std::vector<float> scratch;
+        const float* vec = store->row(id, scratch);
+        auto& context = SearchContext<NodeValueType>::local();
+        std::vector<NodeValueType> expanded;
+        walk(context, [&](NodeValueType value) { return space.distance(vec, store->vectors(), value); }, L, 1, true, &expanded);
+        std::vector<std::shared_ptr<Node>> candidates;
+        candidates.reserve(expanded.size());
+        for (NodeValueType value : expanded) {
+            if (!store->isDeleted(value)) {
+                candidates.push_back(nodes[value]);
+            }
+        }
+
+        nodes[id] = node;
+        robust_prune(node, candidates);
+        for (const auto& target : node->outgoingAdjList) {
+            target->addIncomingEdge(node);
+        }
+        for (auto target : std::vector<std::shared_ptr<Node>>(node->outgoingAdjList)) {
+            addBackEdge(target, node);
+        }
     }
 
-    // Function to build the random neighborhood graph
-    void build_rng(const std::vector<std::pair<T, std::vector<float>>>& nodeValues) {
-        for (const auto& value : nodeValues) {
-            addNode(value);
+    // Unlinks the row's node and gives the store's last row id as its new id
+    void removeRow(size_t id) override {
+        unlink(id);
+        size_t last = store->size() - 1;
+        if (id != last && last < nodes.size()) {
+            if (nodes[last]) {
+                nodes[last]->value = id;
+            }
+            nodes[id] = std::move(nodes[last]);
         }
+        nodes.resize(std::min(nodes.size(), last));
+        codes.removeRow(id);
+    }
 
-        find_start_node();
+    // Each node moves to its row's new id and takes it as its value; edges hold the
+    // nodes themselves, so they follow
+    void permuteRows(const std::vector<size_t>& newIds) override {
+        std::vector<std::shared_ptr<Node>> permuted(newIds.size());
+        for (size_t id = 0; id < nodes.size(); ++id) {
+            if (nodes[id]) {
+                nodes[id]->value = newIds[id];
+                permuted[newIds[id]] = std::move(nodes[id]);
+            }
+        }
+        nodes.swap(permuted);
+        codes.permute(newIds);
+    }
 
-        // Randomize edges
-        for (auto& node : nodes) {
-            // Shuffle the nodes vector (excluding the current node)
-            auto start = nodes.begin();
-            auto end = nodes.end();
-            std::shuffle(start, end, std::default_random_engine(std::random_device()()));
-
-            // Add outgoing edges from the current node to the first R nodes (excluding itself)
-            int count = 0;
-            for (auto it = start; it != end && count < R; ++it) {
-                if (*it != node) {
-                    connectNodes(node, *it);
-                    ++count;
+    // The outgoing edges, from the start node
+    bool rowGraph(RowGraph& graph) override {
+        graph.offsets.assign(1, 0);
+        graph.targets.clear();
+        for (const auto& node : nodes) {
+            if (node) {
+                for (const auto& other : node->outgoingAdjList) {
+                    if (other->value != removedNode) {
+                        graph.targets.push_back(other->value);
+                    }
                 }
             }
+            graph.offsets.push_back(graph.targets.size());
         }
+        graph.start = startNode ? startNode->value : 0;
+        return true;
+    }
 
-        // Robust prune
-        for (auto& node : nodes) {
-            auto V = search(node->value.second);
-            robust_prune(node, V);
-            for (auto& inbound_node : node->incomingAdjList) {
-                if (inbound_node->incomingAdjList.size() > R) {
-                    std::vector<std::shared_ptr<Node>> list = inbound_node->incomingAdjList;
-                    list.push_back(node);
-                    robust_prune(inbound_node, list);
-                } else {
-                    inbound_node->addIncomingEdge(node);
+    // Parameters, which rows have nodes, the outgoing then the incoming edges as offsets
+    // into one array of node ids each, the start node and the codes. Edges to nodes
+    // already taken out of the graph are left behind.
+    void save(SnapshotWriter& snapshot) const override {
+        snapshot.section(SnapshotSection::Vamana);
+        snapshot.write<float>(alpha);
+        snapshot.write<int32_t>(vector_len);
+        snapshot.write<int32_t>(R);
+        snapshot.write<int32_t>(nq);
+        snapshot.write<uint8_t>(static_cast<uint8_t>(compression));
+        snapshot.write<int32_t>(rerank_factor);
+        snapshot.write<int32_t>(L);
+        snapshot.write<int32_t>(threads);
+        space.save(snapshot);
+
+        std::vector<uint8_t> present(nodes.size());
+        for (size_t id = 0; id < nodes.size(); ++id) {
+            present[id] = nodes[id] != nullptr;
+        }
+        snapshot.writeArray(present);
+
+        for (auto list : {&Node::outgoingAdjList, &Node::incomingAdjList}) {
+            std::vector<uint64_t> offsets(1, 0);
+            std::vector<uint64_t> edges;
+            for (const auto& node : nodes) {
+                if (node) {
+                    for (const auto& other : (*node).*list) {
+                        if (other->value != removedNode) {
+                            edges.push_back(other->value);
+                        }
+                    }
                 }
+                offsets.push_back(edges.size());
             }
+            snapshot.writeArray(offsets);
+            snapshot.writeArray(edges);
         }
+        snapshot.write<uint64_t>(startNode ? startNode->value : removedNode);
+        codes.save(snapshot);
     }
 
-    void robust_prune(std::shared_ptr<Node>& node, const std::vector<std::shared_ptr<Node>>& V) {
-        // Combine V with the outgoing adjacency list of the node
-        std::vector<std::shared_ptr<Node>> combinedList(V.size() + node->outgoingAdjList.size());
-        auto it = std::set_union(V.begin(), V.end(), node->outgoingAdjList.begin(), node->outgoingAdjList.end(), combinedList.begin());
-        combinedList.resize(it - combinedList.begin());
-
-        // Remove the node from the combined list if it exists
-        combinedList.erase(std::remove(combinedList.begin(), combinedList.end(), node), combinedList.end());
-
-        // Erase the node from its own outgoing adjacency list
-        node->outgoingAdjList.erase(std::remove_if(node->outgoingAdjList.begin(), node->outgoingAdjList.end(),
-                                                    [&](const auto& n) { return n == node; }),
-                                     node->outgoingAdjList.end());
-
-        // Create a set (min heap) out of V using the distance from the values of V to node
-        auto minCompare = [&](const std::shared_ptr<Node>& a, const std::shared_ptr<Node>& b) {
-            float distanceA = defaultDistance(a->value.second, node->value.second);
-            float distanceB = defaultDistance(b->value.second, node->value.second);
-            return distanceA > distanceB; // Invert the comparison for min heap
+    // Relinks the graph around the rows marked deleted in the store, so removing them
+    // afterwards leaves no holes: a node that points at deleted nodes is pruned again
+    // over its live neighbors and the live nodes its deleted neighbors point at. Deletes
+    // pile up until compaction hands them over as one batch, and only the nodes with an
+    // edge into the batch are visited, found from the deleted nodes' incoming edges.
+    void consolidateDeletes() override {
+        if (!store->tombstones().any()) {
+            return;
+        }
+        auto isDeleted = [&](const std::shared_ptr<Node>& node) {
+            return node->value != removedNode && store->isDeleted(node->value);
         };
-        std::set<std::shared_ptr<Node>, decltype(minCompare)> minHeap(minCompare);
-
-        for (const auto& n : combinedList) {
-            minHeap.insert(n);
+        std::vector<size_t> deleted = store->tombstones().ids();
+        std::vector<std::shared_ptr<Node>> affected;
+        std::unordered_set<Node*> listed;
+        for (size_t id : deleted) {
+            if (id >= nodes.size() || !nodes[id]) {
+                continue;
+            }
+            for (const auto& source : nodes[id]->incomingAdjList) {
+                if (source->value != removedNode && !isDeleted(source) && listed.insert(source.get()).second) {
+                    affected.push_back(source);
+                }
+            }
+        }
+        for (auto& node : affected) {
+            relinkAround(node);
         }
+        // Deleted nodes no longer need to know who points at them from the live graph
+        for (size_t id : deleted) {
+            if (id < nodes.size() && nodes[id]) {
+                auto& incoming = nodes[id]->incomingAdjList;
+                incoming.erase(std::remove_if(incoming.begin(), incoming.end(),
+                                              [&](const auto& source) { return !isDeleted(source); }),
+                               incoming.end());
+            }
+        }
+    }
 
-        // Other pruning logic here
-        while (!minHeap.empty()) {
-            // Process the top node in the min heap
-            auto topNode = *minHeap.begin();
-            minHeap.erase(minHeap.begin());
+    // Relinks from the nodes of rows [first, end) only; the deleted nodes' incoming edges
+    // are dropped as each is removed
+    void consolidateDeletesIn(size_t first, size_t end) override {
+        if (!store->tombstones().any()) {
+            return;
+        }
+        for (size_t id = first; id < std::min(end, nodes.size()); ++id) {
+            if (nodes[id] && !store->isDeleted(id)) {
+                relinkAround(nodes[id]);
+            }
+        }
+    }
 
-            // Add topNode to the outgoing edges of node
-            node->addOutgoingEdge(topNode);
+    // Builds the graph over the rows in nodeValues: R random edges per node, then a pass
+    // at alpha 1 that keeps only the nearest diverse edges, then a pass at the configured
+    // alpha that adds long-range ones. Each pass visits the nodes in random order on every
+    // thread, searching the graph for the node's row and pruning its edges from the nodes
+    // the search went through.
+    void build_rng(const std::vector<NodeValueType>& nodeValues) {
+        for (const auto& value : nodeValues) {
+            addNode(value);
+        }
+        if (nodes.empty()) {
+            return;
+        }
 
-            // Break the loop and return if the size of outgoing edges of node reaches R
-            if (node->outgoingAdjList.size() == R) {
-                break;
+        find_start_node();
+        BuildGraph graph;
+        graph.out.resize(nodes.size());
+
+        // Random edges, drawn per node so any thread can draw them: O(n * R), not O(n^2)
+        size_t degree = std::min<size_t>(R, nodeValues.size() - 1);
+        forEachRow(nodeValues, [&](NodeValueType value) {
+            std::minstd_rand rng(seed + value);
+            std::uniform_int_distribution<size_t> pick(0, nodeValues.size() - 1);
+            auto& out = graph.out[value];
+            while (out.size() < degree) {
+                NodeValueType other = nodeValues[pick(rng)];
+                if (other != value && std::find(out.begin(), out.end(), other) == out.end()) {
+                    out.push_back(other);
+                }
             }
+        });
 
-            // Make a copy of the heap
-            auto copyHeap = minHeap;
+        std::mt19937 rng(seed);
+        std::vector<NodeValueType> order = nodeValues;
+        std::vector<float> passes = {1.0f};
+        if (alpha != 1.0f) {
+            passes.push_back(alpha);
+        }
+        for (float passAlpha : passes) {
+            std::shuffle(order.begin(), order.end(), rng);
+            forEachRow(order, [&](NodeValueType value) {
+                linkNode(graph, value, passAlpha);
+            });
+        }
 
-            while (!copyHeap.empty()) {
-                auto elem = *copyHeap.begin();
-                copyHeap.erase(copyHeap.begin());
-                if (alpha * defaultDistance(elem->value.second, node->value.second) <= defaultDistance(topNode->value.second, node->value.second)) {
-                    minHeap.erase(elem);
+        // Back edges may have left some nodes over R
+        forEachRow(nodeValues, [&](NodeValueType value) {
+            auto& out = graph.out[value];
+            if (out.size() > static_cast<size_t>(R)) {
+                std::vector<float> scratch;
+                const float* vec = store->row(value, scratch);
+                std::vector<std::pair<float, NodeValueType>> candidates;
+                for (NodeValueType other : out) {
+                    candidates.emplace_back(space.distance(vec, store->vectors(), other), other);
                 }
+                out = prune(value, candidates, alpha);
+            }
+        });
+
+        for (NodeValueType value : nodeValues) {
+            for (NodeValueType other : graph.out[value]) {
+                connectNodes(nodes[value], nodes[other]);
             }
         }
     }
 
+    // Replaces node's outgoing edges with the nearest diverse ones among them and V
+    void robust_prune(std::shared_ptr<Node>& node, const std::vector<std::shared_ptr<Node>>& V) {
+        std::vector<float> scratch;
+        const float* nodeVec = store->row(node->value, scratch);
+        std::vector<std::pair<float, NodeValueType>> candidates;
+        for (const auto* list : {&V, &std::as_const(node->outgoingAdjList)}) {
+            for (const auto& other : *list) {
+                if (other != node && other->value != removedNode) {
+                    candidates.emplace_back(distanceTo(nodeVec, other), other->value);
+                }
+            }
+        }
+        node->outgoingAdjList.clear();
+        for (NodeValueType value : prune(node->value, candidates, alpha)) {
+            node->addOutgoingEdge(nodes[value]);
+        }
+    }
 
     // Greedy search function
     std::vector<std::shared_ptr<Node>> search(const std::vector<float>& queryVec, size_t ef = 1) {
+        return search(queryVec.data(), ef);
+    }
+
+    // Rows deleted from the store are walked through but left out of the results
+    std::vector<std::shared_ptr<Node>> search(const float* queryVec, size_t ef = 1) {
+        auto& context = SearchContext<NodeValueType>::local();
+        if (!searchInto(context, queryVec, ef, ef, 1, false)) {
+            return {};
+        }
+        const auto& nearest = context.sortedNearest();
+        std::vector<std::shared_ptr<Node>> result;
+        result.reserve(nearest.size());
+        for (const auto& [distance, value] : nearest) {
+            result.push_back(nodes[value]);
+        }
+        return result;
+    }
+
+private:
+    // Prunes a live node that points at deleted nodes again, over its live neighbors and
+    // the live nodes its deleted neighbors point at
+    void relinkAround(std::shared_ptr<Node> node) {
+        auto isDeleted = [&](const std::shared_ptr<Node>& other) {
+            return other->value != removedNode && store->isDeleted(other->value);
+        };
+        auto& outgoing = node->outgoingAdjList;
+        if (std::none_of(outgoing.begin(), outgoing.end(), isDeleted)) {
+            return;
+        }
+        std::vector<std::shared_ptr<Node>> candidates;
+        std::unordered_set<std::shared_ptr<Node>> seen;
+        auto consider = [&](const std::shared_ptr<Node>& next) {
+            if (next != node && next->value != removedNode && !isDeleted(next) && seen.insert(next).second) {
+                candidates.push_back(next);
+            }
+        };
+        for (const auto& neighbor : outgoing) {
+            if (!isDeleted(neighbor)) {
+                consider(neighbor);
+                continue;
+            }
+            for (const auto& next : neighbor->outgoingAdjList) {
+                consider(next);
+            }
+        }
+
+        // Replace the old edges with the pruned ones, on both ends
+        for (const auto& target : outgoing) {
+            auto& edges = target->incomingAdjList;
+            edges.erase(std::remove(edges.begin(), edges.end(), node), edges.end());
+        }
+        outgoing.clear();
+        robust_prune(node, candidates);
+        for (const auto& target : outgoing) {
+            target->addIncomingEdge(node);
+        }
+    }
+
+    // Takes a node out of the graph, dropping the edges to and from it that are
+    // recorded on both ends. A removed start node hands over to one of its neighbors.
+    void unlink(size_t id) {
+        if (id >= nodes.size() || !nodes[id]) {
+            return;
+        }
+        std::shared_ptr<Node> node = nodes[id];
+        for (auto& target : node->outgoingAdjList) {
+            auto& edges = target->incomingAdjList;
+            edges.erase(std::remove(edges.begin(), edges.end(), node), edges.end());
+        }
+        for (auto& source : node->incomingAdjList) {
+            auto& edges = source->outgoingAdjList;
+            edges.erase(std::remove(edges.begin(), edges.end(), node), edges.end());
+        }
+        if (startNode == node) {
+            startNode = nullptr;
+            for (const auto* candidates : {&node->outgoingAdjList, &nodes}) {
+                for (const auto& other : *candidates) {
+                    if (other && other != node && other->value != removedNode) {
+                        startNode = other;
+                        break;
+                    }
+                }
+                if (startNode) {
+                    break;
+                }
+            }
+        }
+        node->outgoingAdjList.clear();
+        node->incomingAdjList.clear();
+        node->value = removedNode;
+        nodes[id].reset();
+    }
 
-            std::unordered_set<std::shared_ptr<Node>> visited_nodes;
-        
-            // Max heap for nearest_neighbors based on distance
-            auto maxCompare = [](const std::pair<float, std::shared_ptr<Node>>& a, const std::pair<float, std::shared_ptr<Node>>& b) {
-                return a.first < b.first;
-            };
-            std::priority_queue<std::pair<float, std::shared_ptr<Node>>, 
-                                std::vector<std::pair<float, std::shared_ptr<Node>>>, 
-                                decltype(maxCompare)> nearest_neighbors(maxCompare);
-
-            // Min heap for candidates based on distance
-            auto minCompare = [](const std::pair<float, std::shared_ptr<Node>>& a, const std::pair<float, std::shared_ptr<Node>>& b) {
-                return a.first > b.first;
-            };
-            std::priority_queue<std::pair<float, std::shared_ptr<Node>>, 
-                                std::vector<std::pair<float, std::shared_ptr<Node>>>, 
-                                decltype(minCompare)> candidates(minCompare);
-
-            float initialDistance = defaultDistance(startNode->value.second, queryVec);
-            candidates.emplace(initialDistance, startNode);
-            nearest_neighbors.emplace(initialDistance, startNode);
-            visited_nodes.insert(startNode);
-
-            while (!candidates.empty()) {
-                auto current = candidates.top();
-                candidates.pop();
-
-                // If nearest_neighbors is full and current candidate is not closer, break
-                if (nearest_neighbors.size() > ef - 1 && current.first > nearest_neighbors.top().first) {
+    // Leaves the nearest live nodes to the query in context, by value: at least the k
+    // nearest, found with a list of list nodes. With onCodes, and codes to walk on, the
+    // list is at least k * rerank_factor long, and the k nearest on the codes are
+    // rescored on their rows. False if the graph is empty.
+    bool searchInto(SearchContext<NodeValueType>& context, const float* queryVec, size_t k, size_t list, int beamWidth,
+                    bool onCodes) const {
+        if (!startNode) {
+            return false;
+        }
+        auto exact = [&](NodeValueType value) { return space.distance(queryVec, store->vectors(), value); };
+        if (!onCodes || !codes.enabled()) {
+            walk(context, exact, list, beamWidth, true);
+            return true;
+        }
+        static thread_local RowCodes::Query query;
+        codes.prepare(queryVec, query);
+        walk(context, [&](NodeValueType value) { return codes.distance(query, value); },
+             std::max(list, k * rerank_factor), beamWidth, false);
+        context.rescoreNearest(exact, k);
+        return true;
+    }
+
+    // Best-first search from the start node, scoring nodes with distanceOf and keeping
+    // the ef nearest. Each step expands the beamWidth nearest candidates left, and with
+    // rowsScored, fetches the rows of all their new neighbors before scoring the first,
+    // so the memory reads overlap. Nodes are visited and queued by value, so the hot loop
+    // neither hashes nor copies shared pointers. With expanded, every node whose edges
+    // were followed is added to it.
+    template<typename Distance>
+    void walk(SearchContext<NodeValueType>& context, Distance&& distanceOf, size_t ef, int beamWidth, bool rowsScored,
+              std::vector<NodeValueType>* expanded = nullptr) const {
+        context.begin(nodes.size());
+        static thread_local std::vector<NodeValueType> frontier;
+        static thread_local std::vector<NodeValueType> fresh;
+
+        float initialDistance = distanceOf(startNode->value);
+        context.pushCandidate(initialDistance, startNode->value);
+        if (!store->isDeleted(startNode->value)) {
+            context.pushNearest(initialDistance, startNode->value, ef);
+        }
+        context.visit(startNode->value);
+
+        while (context.hasCandidates()) {
+            frontier.clear();
+            while (frontier.size() < static_cast<size_t>(beamWidth) && context.hasCandidates()) {
+                auto current = context.popCandidate();
+                // If the nearest are full and this candidate is not closer, none left is
+                if (context.nearestCount() >= ef && current.first > context.farthest()) {
                     break;
                 }
+                frontier.push_back(current.second);
+            }
+            if (frontier.empty()) {
+                break;
+            }
 
-                // Continue searching through adjacents
-                for (auto neighbor : current.second->outgoingAdjList) {
-                    if (visited_nodes.insert(neighbor).second) { // Node wasn't visited before
-                        float distance = defaultDistance(neighbor->value.second, queryVec);
-                        if (distance < nearest_neighbors.top().first || nearest_neighbors.size() < ef) {
-                            candidates.push({distance, neighbor});
-                            nearest_neighbors.push({distance, neighbor});
-                            if (nearest_neighbors.size() > ef) {
-                                nearest_neighbors.pop();
+            // The frontier's neighbors not visited before
+            fresh.clear();
+            for (NodeValueType current : frontier) {
+                if (expanded) {
+                    expanded->push_back(current);
+                }
+                for (const auto& neighbor : nodes[current]->outgoingAdjList) {
+                    NodeValueType value = neighbor->value;
+                    if (value != removedNode && context.visit(value)) {
+                        if (rowsScored) {
+                            // The row in the format it is stored in
+                            const VectorBlock& rows = store->vectors();
+                            if (rows.storage() == StorageType::Float32) {
+                                __builtin_prefetch(rows.floatRow(value));
+                            } else {
+                                __builtin_prefetch(rows.halfRow(value));
                             }
                         }
+                        fresh.push_back(value);
                     }
                 }
             }
+            for (NodeValueType value : fresh) {
+                float distance = distanceOf(value);
+                if (context.nearestCount() < ef || distance < context.farthest()) {
+                    context.pushCandidate(distance, value);
+                    if (!store->isDeleted(value)) {
+                        context.pushNearest(distance, value, ef);
+                    }
+                }
+            }
+        }
+    }
 
-            // Transfer from max heap to vector without reversing
-            std::vector<std::shared_ptr<Node>> result;
-            while (!nearest_neighbors.empty()) {
-                result.insert(result.begin(), nearest_neighbors.top().second); // Insert at the beginning
-                nearest_neighbors.pop();
+    // Adds the edge from -> to, recorded at both ends. A node over R edges is pruned
+    // back to R, and the nodes it lets go stop listing it as incoming.
+    void addBackEdge(const std::shared_ptr<Node>& from, const std::shared_ptr<Node>& to) {
+        auto& outgoing = from->outgoingAdjList;
+        if (std::find(outgoing.begin(), outgoing.end(), to) != outgoing.end()) {
+            return;
+        }
+        from->addOutgoingEdge(to);
+        to->addIncomingEdge(from);
+        if (outgoing.size() <= static_cast<size_t>(R)) {
+            return;
+        }
+        std::vector<std::shared_ptr<Node>> previous = outgoing;
+        std::shared_ptr<Node> node = from;
+        robust_prune(node, {});
+        for (const auto& target : previous) {
+            if (std::find(outgoing.begin(), outgoing.end(), target) == outgoing.end()) {
+                auto& edges = target->incomingAdjList;
+                edges.erase(std::remove(edges.begin(), edges.end(), from), edges.end());
             }
+        }
+    }
 
-            return result;
+    // Distance from the query to the row behind node
+    float distanceTo(const float* queryVec, const std::shared_ptr<Node>& node) const {
+        return space.distance(queryVec, store->vectors(), node->value);
     }
 
-private:
     // Function to find the start node closest to the average of all vectors in nodeValues
     void find_start_node() {
         if (nodes.empty()) {
             return;
         }
 
-        std::vector<float> averageVector(vector_len, 0.0f);
+        std::vector<float> averageVector(space.dimension, 0.0f);
+        std::vector<float> scratch;
         for (const auto& node : nodes) {
-            for (size_t i = 0; i < node->value.second.size(); ++i) {
-                averageVector[i] += node->value.second[i];
+            const float* vec = store->row(node->value, scratch);
+            for (size_t i = 0; i < averageVector.size(); ++i) {
+                averageVector[i] += vec[i];
             }
         }
 
@@ -234,7 +689,7 @@ private:
         std::shared_ptr<Node> closestNode = nullptr;
 
         for (const auto& node : nodes) {
-            float distance = defaultDistance(node->value.second, averageVector);
+            float distance = distanceTo(averageVector.data(), node);
             if (distance < minDistance) {
                 minDistance = distance;
                 closestNode = node;
@@ -245,6 +700,175 @@ private:
     }
 
     std::shared_ptr<Node> startNode;
+    // Codes of every row of the store, by id, when searchRows walks on codes
+    RowCodes codes;
+    // Draws the build's random edges and the order its passes visit the nodes in
+    uint32_t seed = std::mt19937::default_seed;
+
+    // Edge lists are locked by node id modulo this; a node's list is only ever locked
+    // on its own, so two nodes sharing a lock can't deadlock
+    static constexpr size_t lockStripes = 4096;
+    // Nodes a build thread takes at a time, and fewest worth starting another thread for
+    static constexpr size_t rowsPerBatch = 64;
+    static constexpr size_t rowsPerThread = 256;
+    // A node may gather this many times R back edges before they are pruned; the build
+    // ends by pruning every node back to R
+    static constexpr float degreeSlack = 1.3f;
+
+    // The graph while it is being built: each row's outgoing edges by row id
+    struct BuildGraph {
+        std::vector<std::vector<NodeValueType>> out;
+        std::vector<std::mutex> locks = std::vector<std::mutex>(lockStripes);
+
+        std::mutex& lock(NodeValueType value) { return locks[value % lockStripes]; }
+    };
+
+    // Runs work on every row, in order, in batches spread over the threads
+    template<typename Work>
+    void forEachRow(const std::vector<NodeValueType>& rows, Work&& work) const {
+        size_t workers = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
+        workers = std::min(workers, std::max<size_t>(1, rows.size() / rowsPerThread));
+        if (workers == 1) {
+            for (NodeValueType value : rows) {
+                work(value);
+            }
+            return;
+        }
+        std::atomic<size_t> next(0);
+        std::vector<std::future<void>> futures;
+        for (size_t w = 0; w < workers; ++w) {
+            futures.push_back(std::async(std::launch::async, [&]() {
+                for (size_t first = next.fetch_add(rowsPerBatch); first < rows.size(); first = next.fetch_add(rowsPerBatch)) {
+                    size_t end = std::min(rows.size(), first + rowsPerBatch);
+                    for (size_t i = first; i < end; ++i) {
+                        work(rows[i]);
+                    }
+                }
+            }));
+        }
+        for (auto& fut : futures) {
+            fut.get();
+        }
+    }
+
+    // One step of a build pass: searches the graph for the row, prunes the nodes the
+    // search went through and the row's current edges down to its new edges, and adds
+    // the edges back to it from each of them
+    void linkNode(BuildGraph& graph, NodeValueType value, float passAlpha) const {
+        std::vector<float> scratch;
+        const float* vec = store->row(value, scratch);
+        static thread_local std::vector<std::pair<float, NodeValueType>> candidates;
+        buildSearch(graph, vec, candidates);
+        std::vector<NodeValueType> current;
+        {
+            std::lock_guard<std::mutex> lock(graph.lock(value));
+            current = graph.out[value];
+        }
+        for (NodeValueType other : current) {
+            candidates.emplace_back(space.distance(vec, store->vectors(), other), other);
+        }
+        auto kept = prune(value, candidates, passAlpha);
+        {
+            std::lock_guard<std::mutex> lock(graph.lock(value));
+            graph.out[value] = kept;
+        }
+        for (NodeValueType other : kept) {
+            addBackEdge(graph, other, value, passAlpha);
+        }
+    }
+
+    // Adds the edge from -> to, pruning from's edges once they are over the slack
+    void addBackEdge(BuildGraph& graph, NodeValueType from, NodeValueType to, float passAlpha) const {
+        std::lock_guard<std::mutex> lock(graph.lock(from));
+        auto& out = graph.out[from];
+        if (std::find(out.begin(), out.end(), to) != out.end()) {
+            return;
+        }
+        if (out.size() < static_cast<size_t>(R * degreeSlack)) {
+            out.push_back(to);
+            return;
+        }
+        std::vector<float> scratch;
+        const float* vec = store->row(from, scratch);
+        std::vector<std::pair<float, NodeValueType>> candidates;
+        candidates.reserve(out.size() + 1);
+        for (NodeValueType other : out) {
+            candidates.emplace_back(space.distance(vec, store->vectors(), other), other);
+        }
+        candidates.emplace_back(space.distance(vec, store->vectors(), to), to);
+        out = prune(from, candidates, passAlpha);
+    }
+
+    // Best-first search of the graph being built, from the start node, keeping a list of
+    // L. Leaves in expanded every node whose edges it followed, with its distance to the
+    // query. Each edge list is copied out under its lock, as other threads change them.
+    void buildSearch(BuildGraph& graph, const float* queryVec, std::vector<std::pair<float, NodeValueType>>& expanded) const {
+        auto& context = SearchContext<NodeValueType>::local();
+        context.begin(graph.out.size());
+        expanded.clear();
+        static thread_local std::vector<NodeValueType> neighbors;
+        size_t list = static_cast<size_t>(L);
+
+        float initialDistance = distanceTo(queryVec, startNode);
+        context.pushCandidate(initialDistance, startNode->value);
+        context.pushNearest(initialDistance, startNode->value, list);
+        context.visit(startNode->value);
+        while (context.hasCandidates()) {
+            auto current = context.popCandidate();
+            if (context.nearestCount() >= list && current.first > context.farthest()) {
+                break;
+            }
+            expanded.push_back(current);
+            {
+                std::lock_guard<std::mutex> lock(graph.lock(current.second));
+                neighbors = graph.out[current.second];
+            }
+            for (NodeValueType value : neighbors) {
+                if (context.visit(value)) {
+                    float distance = space.distance(queryVec, store->vectors(), value);
+                    if (context.nearestCount() < list || distance < context.farthest()) {
+                        context.pushCandidate(distance, value);
+                        context.pushNearest(distance, value, list);
+                    }
+                }
+            }
+        }
+    }
+
+    // Robust prune: takes candidates nearest first, passing over any that a node already
+    // kept is closer to, by a factor of the round's alpha, than value is, until R are
+    // kept. The first round is at alpha 1 and each next one 1.2 times higher, up to
+    // pruneAlpha: a single round at a high alpha can fill every edge with near nodes that
+    // are all about as far from each other, and leave none to the rest of the graph.
+    // Candidates are (distance to value, node) and may repeat.
+    std::vector<NodeValueType> prune(NodeValueType value, std::vector<std::pair<float, NodeValueType>>& candidates,
+                                     float pruneAlpha) const {
+        std::sort(candidates.begin(), candidates.end());
+        std::vector<NodeValueType> kept;
+        std::vector<uint8_t> taken(candidates.size(), 0);
+        std::vector<float> scratch;
+        for (float round = std::min(1.0f, pruneAlpha); kept.size() < static_cast<size_t>(R); round = std::min(round * 1.2f, pruneAlpha)) {
+            for (size_t i = 0; i < candidates.size() && kept.size() < static_cast<size_t>(R); ++i) {
+                auto [distance, candidate] = candidates[i];
+                // Repeats of a node sort next to each other
+                if (taken[i] || candidate == value || (i > 0 && candidates[i - 1].second == candidate)) {
+                    continue;
+                }
+                const float* vec = store->row(candidate, scratch);
+                bool diverse = std::none_of(kept.begin(), kept.end(), [&](NodeValueType other) {
+                    return round * space.distance(vec, store->vectors(), other) <= distance;
+                });
+                if (diverse) {
+                    kept.push_back(candidate);
+                    taken[i] = 1;
+                }
+            }
+            if (round >= pruneAlpha) {
+                break;
+            }
+        }
+        return kept;
+    }
 
     // Method to add a new node
     void addNode(const NodeValueType& value) {
@@ -0,0 +1,279 @@
+#ifndef VECTOR_BLOCK_HPP
+#define VECTOR_BLOCK_HPP
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+
+#include "HalfPrecision.hpp"
+#include "Snapshot.hpp"
+
+// Rows of one dimension stored row-major in a collection's storage type.
+// Float32 rows go to the distance kernels as they are; 16-bit rows are kept
+// encoded and only widened inside the kernels or when a caller decodes one.
+//
+// Rows live in an arena of 64-byte aligned chunks. Each chunk holds twice the
+// rows of the one before it, so appending never moves existing rows (pointers
+// to them stay valid) and a row is found with a shift and a count of leading
+// zeros. Rows don't straddle chunks: a scan walks contiguousRows() at a time.
+//
+// A block loaded from a snapshot serves its rows from the mapped file as the first
+// chunk, without copying them. They are copied into a chunk of the block's own the
+// first time it grows past them.
+class VectorBlock {
+public:
+    static constexpr size_t alignment = 64;
+    static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+    static constexpr size_t minimumFirstChunkRows = 16;
+
+    VectorBlock() : dim(0), type(StorageType::Float32) {}
+
+    explicit VectorBlock(int dimension, StorageType storage = StorageType::Float32, bool hugePages = false)
+        : dim(dimension), type(storage), hugePages(hugePages) {}
+
+    // Reads a block written by save(), leaving the rows in the snapshot's mapping
+    explicit VectorBlock(SnapshotReader& snapshot, bool hugePages = false) : hugePages(hugePages) {
+        dim = snapshot.read<int32_t>();
+        type = static_cast<StorageType>(snapshot.read<int32_t>());
+        size_t rows = snapshot.read<uint64_t>();
+        snapshot.align(SnapshotFormat::pageAlignment);
+        unsigned char* data = snapshot.readBytes(rows * rowBytes());
+        if (rows == 0) {
+            return;
+        }
+        firstShift = 0;
+        while ((size_t(1) << firstShift) < std::max(rows, minimumFirstChunkRows)) {
+            ++firstShift;
+        }
+        chunks.emplace_back(data, ChunkDeleter{false});
+        borrowed = snapshot.mapping();
+        borrowedRows = rows;
+        count = rows;
+    }
+
+    VectorBlock(const VectorBlock& other)
+        : dim(other.dim), type(other.type), hugePages(other.hugePages), firstShift(other.firstShift) {
+        // Same chunk layout as other, so each run of rows copies in one go
+        growTo(other.count);
+        for (size_t start = 0; start < other.count; start += other.contiguousRows(start)) {
+            std::memcpy(rowPointer(start), other.rowPointer(start), other.contiguousRows(start) * rowBytes());
+        }
+        count = other.count;
+    }
+
+    VectorBlock& operator=(const VectorBlock& other) {
+        if (this != &other) {
+            VectorBlock copy(other);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    VectorBlock(VectorBlock&&) = default;
+    VectorBlock& operator=(VectorBlock&&) = default;
+
+    int dimension() const { return dim; }
+    StorageType storage() const { return type; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    // Makes room for at least rows rows. Before the first append this also sizes the
+    // first chunk, so a block that is reserved up front usually stays in one chunk.
+    void reserve(size_t rows) {
+        if (chunks.empty()) {
+            firstShift = 0;
+            while ((size_t(1) << firstShift) < std::max(rows, minimumFirstChunkRows)) {
+                ++firstShift;
+            }
+        }
+        growTo(rows);
+    }
+
+    void append(const float* vec) {
+        growTo(count + 1);
+        if (type == StorageType::Float32) {
+            std::memcpy(rowPointer(count), vec, rowBytes());
+        } else {
+            getHalfKernels(type).encode(vec, reinterpret_cast<uint16_t*>(rowPointer(count)), dim);
+        }
+        ++count;
+    }
+
+    void append(const std::vector<float>& vec) {
+        if (vec.size() != static_cast<size_t>(dim)) {
+            throw std::invalid_argument("Vector length does not match the block dimension.");
+        }
+        append(vec.data());
+    }
+
+    // Removes a row in constant time by moving the last row into its place
+    void swapRemove(size_t index) {
+        if (index + 1 < count) {
+            std::memcpy(rowPointer(index), rowPointer(count - 1), rowBytes());
+        }
+        --count;
+    }
+
+    // Moves row index to newIds[index], into chunks of the block's own laid out as before
+    void permute(const std::vector<size_t>& newIds) {
+        VectorBlock permuted(dim, type, hugePages);
+        permuted.firstShift = firstShift;
+        permuted.growTo(count);
+        for (size_t index = 0; index < count; ++index) {
+            std::memcpy(permuted.rowPointer(newIds[index]), rowPointer(index), rowBytes());
+        }
+        permuted.count = count;
+        *this = std::move(permuted);
+    }
+
+    // Writes the rows back to back, page aligned so a reader can map them in place
+    void save(SnapshotWriter& snapshot) const {
+        snapshot.write<int32_t>(dim);
+        snapshot.write<int32_t>(static_cast<int32_t>(type));
+        snapshot.write<uint64_t>(count);
+        snapshot.align(SnapshotFormat::pageAlignment);
+        for (size_t start = 0; start < count; start += contiguousRows(start)) {
+            snapshot.writeBytes(rowPointer(start), contiguousRows(start) * rowBytes());
+        }
+    }
+
+    // Forgets the rows but keeps the chunks for reuse
+    void clear() {
+        count = 0;
+    }
+
+    // Frees the chunks past the one holding the last row
+    void shrinkToFit() {
+        size_t used = count == 0 ? 0 : chunkOf(count - 1) + 1;
+        if (used < chunks.size()) {
+            chunks.resize(used);
+        }
+    }
+
+    // Writes row index widened to float32 into out, dimension floats
+    void decode(size_t index, float* out) const {
+        if (type == StorageType::Float32) {
+            std::copy(floatRow(index), floatRow(index) + dim, out);
+        } else {
+            getHalfKernels(type).decode(halfRow(index), out, dim);
+        }
+    }
+
+    std::vector<float> decode(size_t index) const {
+        std::vector<float> vec(dim);
+        decode(index, vec.data());
+        return vec;
+    }
+
+    // Raw rows in the block's storage type; only the accessor matching storage() is meaningful
+    const float* floatRow(size_t index) const { return reinterpret_cast<const float*>(rowPointer(index)); }
+    const uint16_t* halfRow(size_t index) const { return reinterpret_cast<const uint16_t*>(rowPointer(index)); }
+
+    // How many rows from index on sit back to back in index's chunk
+    size_t contiguousRows(size_t index) const {
+        size_t chunk = chunkOf(index);
+        return std::min(chunkStart(chunk) + chunkRows(chunk), count) - index;
+    }
+
+    // Bytes held by the chunks, or mapped for rows still served from a snapshot
+    size_t memoryBytes() const {
+        if (borrowed) {
+            return borrowedRows * rowBytes();
+        }
+        return capacity() * rowBytes();
+    }
+
+private:
+    // Chunks borrowed from a snapshot's mapping aren't freed
+    struct ChunkDeleter {
+        bool owned = true;
+        void operator()(unsigned char* chunk) const {
+            if (owned) {
+                std::free(chunk);
+            }
+        }
+    };
+
+    int dim;
+    StorageType type;
+    bool hugePages = false;
+    size_t count = 0;
+    size_t firstShift = 4; // The first chunk holds 2^firstShift rows
+    std::vector<std::unique_ptr<unsigned char[], ChunkDeleter>> chunks;
+    // The mapping the first chunk was borrowed from and the rows it has room for
+    std::shared_ptr<void> borrowed;
+    size_t borrowedRows = 0;
+
+    size_t rowBytes() const {
+        return static_cast<size_t>(dim) * (type == StorageType::Float32 ? sizeof(float) : sizeof(uint16_t));
+    }
+
+    size_t chunkRows(size_t chunk) const {
+        return size_t(1) << (firstShift + chunk);
+    }
+
+    // Rows in all the chunks before this one
+    size_t chunkStart(size_t chunk) const {
+        return ((size_t(1) << chunk) - 1) << firstShift;
+    }
+
+    size_t chunkOf(size_t index) const {
+        return 63 - __builtin_clzll((index >> firstShift) + 1);
+    }
+
+    unsigned char* rowPointer(size_t index) const {
+        size_t chunk = chunkOf(index);
+        return chunks[chunk].get() + (index - chunkStart(chunk)) * rowBytes();
+    }
+
+    size_t capacity() const {
+        return chunks.empty() ? 0 : chunkStart(chunks.size());
+    }
+
+    // Allocates chunks until rows rows fit
+    void growTo(size_t rows) {
+        if (borrowed && rows > borrowedRows) {
+            ownBorrowedRows();
+        }
+        while (capacity() < rows) {
+            chunks.emplace_back(allocateChunk(chunkRows(chunks.size()) * rowBytes()));
+        }
+    }
+
+    // Copies the rows served from a mapping into a first chunk of the block's own
+    void ownBorrowedRows() {
+        std::unique_ptr<unsigned char[], ChunkDeleter> chunk(allocateChunk(chunkRows(0) * rowBytes()));
+        std::memcpy(chunk.get(), chunks[0].get(), count * rowBytes());
+        chunks[0] = std::move(chunk);
+        borrowed.reset();
+        borrowedRows = 0;
+    }
+
+    // Chunks of a huge page or more are huge-page aligned and, when asked for, advised
+    // onto transparent huge pages so long scans take fewer TLB misses
+    unsigned char* allocateChunk(size_t bytes) const {
+        size_t chunkAlignment = alignment;
+        if (hugePages && bytes >= hugePageSize) {
+            chunkAlignment = hugePageSize;
+        }
+        bytes = std::max((bytes + chunkAlignment - 1) / chunkAlignment * chunkAlignment, chunkAlignment);
+        void* chunk = nullptr;
+        if (posix_memalign(&chunk, chunkAlignment, bytes) != 0) {
+            throw std::bad_alloc();
+        }
+#ifdef MADV_HUGEPAGE
+        if (chunkAlignment == hugePageSize) {
+            madvise(chunk, bytes, MADV_HUGEPAGE);
+        }
+#endif
+        return static_cast<unsigned char*>(chunk);
+    }
+};
+
+#endif // VECTOR_BLOCK_HPP
@@ -3,6 +3,30 @@
 
 #include <vector>
 #include <utility> // For std::pair
+#include <algorithm>
+#include <cstddef>
+
+#include "Snapshot.hpp"
+#include "NodeOrdering.hpp"
+
+// How hard one query searches, for trading speed for recall query by query. Zero leaves
+// the choice to the index.
+struct SearchOptions {
+    // Candidates a graph search keeps, at least the number of results asked for
+    int listSize = 0;
+    // Candidates a graph search expands at each step, at most the list size and
+    // maxBeamWidth, since each may hold a buffer while the step lasts
+    int beamWidth = 0;
+
+    static constexpr int maxBeamWidth = 64;
+
+    // The beam width for a list of list candidates, fallback if none was asked for
+    int beamFor(size_t list, int fallback) const {
+        int width = beamWidth > 0 ? beamWidth : fallback;
+        return static_cast<int>(std::min<size_t>({static_cast<size_t>(std::max(width, 1)), list,
+                                                   static_cast<size_t>(maxBeamWidth)}));
+    }
+};
 
 template<typename T>
 class VectorSearchAlgorithm {
@@ -15,6 +39,67 @@ public:
     // representing some metric or distance, and the second element is the closest vector found of type std::vector<T>.
     // If no vectors are available for comparison, returns an empty vector.
     virtual std::vector<std::pair<T, std::vector<float>>> searchClosest (const std::vector<float>& target, const int ef = 1) = 0;
+
+    // The same search, returning the ids of the closest rows in the store, nearest
+    // first. Nothing is copied out of the store, so the server writes its responses
+    // from these, resolving only the keys it sends.
+    virtual std::vector<size_t> searchRows (const std::vector<float>& target, const int ef = 1) = 0;
+
+    // The k closest rows, searched for with options. Indexes whose ef is their list size
+    // search with the larger of the two and keep the nearest k.
+    virtual std::vector<size_t> searchRows (const std::vector<float>& target, int k, const SearchOptions& options) {
+        std::vector<size_t> rows = searchRows(target, std::max(k, options.listSize));
+        rows.resize(std::min<size_t>(rows.size(), std::max(k, 0)));
+        return rows;
+    }
+
+    // Row id was just appended to the collection's store the algorithm indexes.
+    virtual void addRow(size_t id) = 0;
+
+    // Rows [first, end) were appended in one go, by a bulk load. Algorithms that can
+    // index a batch faster than one row at a time override this.
+    virtual void addRows(size_t first, size_t end) {
+        for (size_t id = first; id < end; ++id) {
+            addRow(id);
+        }
+    }
+
+    // Row id is about to be removed from the store, which then moves its last row
+    // into id. The algorithm forgets id and refers to the last row as id from then on.
+    virtual void removeRow(size_t id) = 0;
+
+    // Rows added that searches can't return, for indexes built once over the rows
+    // they had; only a rebuild takes them in. Indexes that take every row return 0.
+    virtual size_t unindexedRows() const { return 0; }
+
+    // The rows marked deleted in the store are about to be removed. Indexes that route
+    // through rows, like the graphs, relink around them here; others need do nothing.
+    virtual void consolidateDeletes() {}
+
+    // The same relinking, from the nodes of rows [first, end) only, so a compaction can
+    // spread it over calls that together cover every row. A deleted row removed before
+    // every node was relinked around it only takes the edges into it along.
+    virtual void consolidateDeletesIn(size_t first, size_t /*end*/) {
+        if (first == 0) {
+            consolidateDeletes();
+        }
+    }
+
+    // The store's rows are about to be renumbered, row id becoming newIds[id]. The
+    // algorithm refers to every row by its new id from then on.
+    virtual void permuteRows(const std::vector<size_t>& newIds) = 0;
+
+    // Fills graph with the edges searches follow between rows, for ordering the rows
+    // so that neighbors sit together. Only graphs have any; the others return false.
+    virtual bool rowGraph(RowGraph& /*graph*/) { return false; }
+
+    // Brings the structure up to date before save(), which only reads it. Indexes that
+    // queue changes apply them here; the others need do nothing.
+    virtual void prepareForSave() {}
+
+    // Writes the built structure to a snapshot, starting with its SnapshotSection tag.
+    // Each algorithm reads it back in a constructor taking the store and the reader.
+    virtual void save(SnapshotWriter& snapshot) const = 0;
 };
 
 #endif // VECTORSEARCHALGORITHM_HPP
@@ -0,0 +1,205 @@
+#ifndef VECTOR_STORE_HPP
+#define VECTOR_STORE_HPP
+
+#include <vector>
+#include <utility>
+#include <stdexcept>
+
+#include "VectorBlock.hpp"
+#include "Tombstones.hpp"
+#include "KeyTable.hpp"
+
+// A collection's keys and vectors, shared by every index built on the collection.
+// Indexes keep a pointer to the store and refer to rows by internal id, the row's
+// position in the store, so adding an index costs only its own structure.
+//
+// Ids are dense: a hash index maps each key to its id, and removing a row moves the
+// last row into the hole, so a lookup, a delete and turning an id back into its key
+// and vector all take constant time. Whoever removes a row tells the indexes first
+// (see VectorSearchAlgorithm::removeRow) so they can renumber the moved row. String
+// keys are interned (see KeyTable), so searches pass row ids around and a key is
+// only copied out for a result.
+//
+// A delete from the engine only marks the row: its key is freed at once and
+// searches skip it, but the row stays in place, so graphs can keep routing through
+// it until a compaction relinks them and removes the marked rows.
+template<typename T>
+class VectorStore {
+public:
+    VectorStore(int dimension = 0, StorageType storage = StorageType::Float32, bool hugePages = false)
+        : rows(dimension, storage, hugePages), hugePages(hugePages) {}
+
+    // Reads a store written by save(). The rows stay in the snapshot's mapping; the
+    // keys and their hash index are rebuilt.
+    explicit VectorStore(SnapshotReader& snapshot) {
+        snapshot.expect(SnapshotSection::Store);
+        hugePages = snapshot.read<uint8_t>() != 0;
+        size_t count = snapshot.read<uint64_t>();
+        keys.reserve(count);
+        for (size_t id = 0; id < count; ++id) {
+            keys.appendUnindexed(snapshot.readKey<T>());
+        }
+        for (uint64_t id : snapshot.readVector<uint64_t>()) {
+            deleted.set(id);
+        }
+        for (size_t id = 0; id < count; ++id) {
+            if (!deleted.test(id)) {
+                keys.index(id);
+            }
+        }
+        rows = VectorBlock(snapshot, hugePages);
+        if (rows.size() != keys.size()) {
+            throw std::runtime_error("Snapshot store has a different number of keys and rows.");
+        }
+    }
+
+    void save(SnapshotWriter& snapshot) const {
+        snapshot.section(SnapshotSection::Store);
+        snapshot.write<uint8_t>(hugePages);
+        snapshot.write<uint64_t>(keys.size());
+        for (size_t id = 0; id < keys.size(); ++id) {
+            snapshot.writeKey(keys.key(id));
+        }
+        std::vector<size_t> deletedIds = deleted.ids();
+        snapshot.writeArray(std::vector<uint64_t>(deletedIds.begin(), deletedIds.end()));
+        rows.save(snapshot);
+    }
+
+    int dimension() const { return rows.dimension(); }
+    StorageType storage() const { return rows.storage(); }
+    size_t size() const { return keys.size(); }
+    bool empty() const { return keys.size() == 0; }
+
+    // Fixes the dimension of a store that was created before its first row
+    void setDimension(int dimension) {
+        if (!empty()) {
+            throw std::logic_error("The dimension of a store with rows can't change.");
+        }
+        rows = VectorBlock(dimension, rows.storage(), hugePages);
+    }
+
+    void reserve(size_t count) {
+        keys.reserve(count);
+        rows.reserve(count);
+    }
+
+    // Appends a row and returns its id. Keys are unique.
+    size_t append(const T& key, const std::vector<float>& vec) {
+        if (keys.find(key) != keys.size()) {
+            throw std::invalid_argument("Key is already in the store.");
+        }
+        rows.append(vec);
+        keys.append(key);
+        return keys.size() - 1;
+    }
+
+    // Id of the row with this key, or size() if there is none
+    size_t find(typename KeyTable<T>::View key) const {
+        return keys.find(key);
+    }
+
+    // Removes row id; the last row takes its id
+    void remove(size_t id) {
+        if (id >= keys.size()) {
+            throw std::out_of_range("Row id is out of range.");
+        }
+        size_t last = keys.size() - 1;
+        if (!deleted.test(id)) {
+            keys.unindex(id);
+        }
+        keys.remove(id);
+        if (id != last) {
+            if (deleted.test(last)) {
+                deleted.set(id);
+            } else {
+                deleted.reset(id);
+            }
+        }
+        rows.swapRemove(id);
+        deleted.truncate(last);
+    }
+
+    // Deletes row id without moving anything: its key is free for reuse and searches
+    // skip it, but the row keeps its id until it is removed
+    void markDeleted(size_t id) {
+        if (id >= keys.size()) {
+            throw std::out_of_range("Row id is out of range.");
+        }
+        if (!deleted.test(id)) {
+            keys.unindex(id);
+            deleted.set(id);
+        }
+    }
+
+    // Renumbers every row, row id becoming newIds[id], so rows that are searched
+    // together can sit together. Tell the indexes first (see
+    // VectorSearchAlgorithm::permuteRows).
+    void permute(const std::vector<size_t>& newIds) {
+        if (newIds.size() != keys.size()) {
+            throw std::invalid_argument("A permutation must give every row a new id.");
+        }
+        keys.permute(newIds);
+        rows.permute(newIds);
+        deleted.permute(newIds);
+    }
+
+    bool isDeleted(size_t id) const { return deleted.test(id); }
+    size_t deletedCount() const { return deleted.count(); }
+    const Tombstones& tombstones() const { return deleted; }
+
+    // Gives back the memory left over after rows were removed
+    void shrinkToFit() {
+        keys.shrinkToFit();
+        rows.shrinkToFit();
+        deleted.shrinkToFit();
+    }
+
+    // The key of row id: a view into the key arena for string keys
+    typename KeyTable<T>::View key(size_t id) const { return keys.key(id); }
+
+    // Appends the key of row id to a response, without copying it out first
+    void appendKeyText(size_t id, std::string& out) const { keys.appendText(id, out); }
+
+    // Every row in the store's storage type, for the distance kernels
+    const VectorBlock& vectors() const { return rows; }
+
+    // Row id as float32: in place for float32 storage, otherwise decoded into scratch
+    const float* row(size_t id, std::vector<float>& scratch) const {
+        if (rows.storage() == StorageType::Float32) {
+            return rows.floatRow(id);
+        }
+        scratch.resize(rows.dimension());
+        rows.decode(id, scratch.data());
+        return scratch.data();
+    }
+
+    // The key and float32 vector of row id, as the search interface returns them
+    std::pair<T, std::vector<float>> entry(size_t id) const {
+        return {T(keys.key(id)), rows.decode(id)};
+    }
+
+    // Entries of rows ids, in order
+    std::vector<std::pair<T, std::vector<float>>> entries(const std::vector<size_t>& ids) const {
+        std::vector<std::pair<T, std::vector<float>>> results;
+        results.reserve(ids.size());
+        for (size_t id : ids) {
+            results.push_back(entry(id));
+        }
+        return results;
+    }
+
+    // Bytes held by the rows, the keys and their index
+    size_t memoryBytes() const {
+        return rows.memoryBytes() + keys.memoryBytes() + deleted.memoryBytes();
+    }
+
+private:
+    // Key of every row, and the row of every key not deleted
+    KeyTable<T> keys;
+    VectorBlock rows;
+    // Rows deleted but not yet removed
+    Tombstones deleted;
+    bool hugePages;
+};
+
+#endif // VECTOR_STORE_HPP
@@ -0,0 +1,378 @@
+#ifndef WRITE_AHEAD_LOG_HPP
+#define WRITE_AHEAD_LOG_HPP
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <type_traits>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// When an appended record is forced to disk
+enum class SyncPolicy {
+    Always,   // sync() waits until the record is on disk; concurrent callers share one fdatasync
+    Interval, // written at once, synced at most once per interval, so a power loss drops that much
+    Never,    // written at once and left to the OS: survives a crash of the process only
+};
+
+inline bool parseSyncPolicy(const std::string& name, SyncPolicy& policy) {
+    if (strcasecmp(name.c_str(), "always") == 0) {
+        policy = SyncPolicy::Always;
+    } else if (strcasecmp(name.c_str(), "interval") == 0) {
+        policy = SyncPolicy::Interval;
+    } else if (strcasecmp(name.c_str(), "never") == 0) {
+        policy = SyncPolicy::Never;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// One record's payload, built field by field
+class LogRecord {
+public:
+    template<typename V>
+    void put(const V& value) {
+        static_assert(std::is_trivially_copyable<V>::value, "Only plain values are logged as they are");
+        const char* in = reinterpret_cast<const char*>(&value);
+        bytes.insert(bytes.end(), in, in + sizeof(V));
+    }
+
+    void putString(const std::string& value) {
+        put<uint32_t>(value.size());
+        bytes.insert(bytes.end(), value.begin(), value.end());
+    }
+
+    template<typename K>
+    void putKey(const K& key) {
+        if constexpr (std::is_same<K, std::string>::value) {
+            putString(key);
+        } else {
+            put(key);
+        }
+    }
+
+    void putFloats(const std::vector<float>& values) {
+        put<uint32_t>(values.size());
+        const char* in = reinterpret_cast<const char*>(values.data());
+        bytes.insert(bytes.end(), in, in + values.size() * sizeof(float));
+    }
+
+    const std::vector<char>& data() const { return bytes; }
+
+private:
+    std::vector<char> bytes;
+};
+
+// Reads a payload back in the order it was built
+class LogRecordReader {
+public:
+    LogRecordReader(const char* data, size_t size) : at(data), end(data + size) {}
+
+    template<typename V>
+    V get() {
+        static_assert(std::is_trivially_copyable<V>::value, "Only plain values are logged as they are");
+        V value;
+        std::memcpy(&value, take(sizeof(V)), sizeof(V));
+        return value;
+    }
+
+    std::string getString() {
+        uint32_t length = get<uint32_t>();
+        return std::string(take(length), length);
+    }
+
+    template<typename K>
+    K getKey() {
+        if constexpr (std::is_same<K, std::string>::value) {
+            return getString();
+        } else {
+            return get<K>();
+        }
+    }
+
+    // Whether the whole record has been read
+    bool done() const { return at == end; }
+
+    std::vector<float> getFloats() {
+        uint32_t count = get<uint32_t>();
+        std::vector<float> values(count);
+        std::memcpy(values.data(), take(count * sizeof(float)), count * sizeof(float));
+        return values;
+    }
+
+private:
+    const char* at;
+    const char* end;
+
+    const char* take(size_t bytes) {
+        if (bytes > static_cast<size_t>(end - at)) {
+            throw std::runtime_error("Log record is truncated.");
+        }
+        const char* from = at;
+        at += bytes;
+        return from;
+    }
+};
+
+// An append-only log of records, each framed by its length and a CRC-32C so a
+// record torn by a crash is found on replay and cut off.
+//
+// append() only queues a record and numbers it. Under SyncPolicy::Always a caller
+// then waits in sync(); the first waiter writes everything queued so far and issues
+// one fdatasync for the lot while later writers queue up behind it, so a burst of
+// concurrent writers pays for a few syncs rather than one each.
+class WriteAheadLog {
+public:
+    WriteAheadLog(const std::string& path,
+                  SyncPolicy policy = SyncPolicy::Always,
+                  std::chrono::milliseconds interval = std::chrono::milliseconds(100))
+        : path(path), policy(policy), interval(interval), lastSync(std::chrono::steady_clock::now()) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open log file " + path + ".");
+        }
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+        try {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!failed && !pending.empty()) {
+                std::vector<char> batch;
+                batch.swap(pending);
+                writeAll(batch);
+                ::fdatasync(fd);
+            }
+        } catch (const std::exception&) {
+        }
+        ::close(fd);
+    }
+
+    // Calls apply with each intact record of the log at path, in order. A torn or
+    // corrupt record ends the log: it and anything after it are cut off so new
+    // records follow the last good one. Returns the number of records replayed.
+    static size_t replay(const std::string& path, const std::function<void(LogRecordReader&)>& apply) {
+        int in = ::open(path.c_str(), O_RDWR);
+        if (in < 0) {
+            if (errno == ENOENT) {
+                return 0;
+            }
+            throw std::runtime_error("Could not open log file " + path + ".");
+        }
+        std::vector<char> contents;
+        char buffer[1 << 16];
+        ssize_t rv;
+        while ((rv = ::read(in, buffer, sizeof(buffer))) != 0) {
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rv < 0) {
+                ::close(in);
+                throw std::runtime_error("Could not read log file " + path + ".");
+            }
+            contents.insert(contents.end(), buffer, buffer + rv);
+        }
+
+        size_t offset = 0;
+        size_t records = 0;
+        while (contents.size() - offset >= headerBytes) {
+            uint32_t length, checksum;
+            std::memcpy(&length, contents.data() + offset, sizeof(length));
+            std::memcpy(&checksum, contents.data() + offset + sizeof(length), sizeof(checksum));
+            const char* payload = contents.data() + offset + headerBytes;
+            if (length > contents.size() - offset - headerBytes || crc32c(payload, length) != checksum) {
+                break;
+            }
+            LogRecordReader record(payload, length);
+            apply(record);
+            offset += headerBytes + length;
+            ++records;
+        }
+        if (offset < contents.size() && ::ftruncate(in, offset) != 0) {
+            ::close(in);
+            throw std::runtime_error("Could not cut the torn end off log file " + path + ".");
+        }
+        ::close(in);
+        return records;
+    }
+
+    // Queues a record and returns its sequence number, for sync()
+    uint64_t append(const LogRecord& record) {
+        const std::vector<char>& payload = record.data();
+        uint32_t length = payload.size();
+        uint32_t checksum = crc32c(payload.data(), payload.size());
+
+        std::unique_lock<std::mutex> lock(mutex);
+        size_t start = pending.size();
+        pending.resize(start + headerBytes);
+        std::memcpy(pending.data() + start, &length, sizeof(length));
+        std::memcpy(pending.data() + start + sizeof(length), &checksum, sizeof(checksum));
+        pending.insert(pending.end(), payload.begin(), payload.end());
+        uint64_t sequence = ++appended;
+        if (policy != SyncPolicy::Always) {
+            // Nobody waits on these, so they go to the OS right away
+            flushLocked(lock, appended, intervalElapsed());
+        }
+        return sequence;
+    }
+
+    // Waits until every record up to sequence is as durable as the policy makes it.
+    // Under SyncPolicy::Interval, calling it now and then bounds how long records
+    // wait for a sync when appends stop.
+    void sync(uint64_t sequence) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (policy != SyncPolicy::Always) {
+            flushLocked(lock, appended, intervalElapsed() && durable < appended);
+            return;
+        }
+        flushLocked(lock, sequence, true);
+    }
+
+    void sync() {
+        uint64_t sequence;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sequence = appended;
+        }
+        sync(sequence);
+    }
+
+    // Whether some record appended under SyncPolicy::Always hasn't been synced yet
+    bool unsynced() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return policy == SyncPolicy::Always && durable < appended;
+    }
+
+    // Drops every record, once a snapshot holds what they describe
+    void truncate() {
+        std::unique_lock<std::mutex> lock(mutex);
+        flushLocked(lock, appended, false);
+        if (::ftruncate(fd, 0) != 0 || ::fdatasync(fd) != 0) {
+            throw std::runtime_error("Could not truncate log file " + path + ".");
+        }
+        durable = appended;
+        flushed.notify_all();
+    }
+
+    SyncPolicy syncPolicy() const { return policy; }
+
+    // fdatasync calls made so far, to see how well group commit batches
+    uint64_t syncCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return syncs;
+    }
+
+private:
+    static constexpr size_t headerBytes = 2 * sizeof(uint32_t);
+
+    std::string path;
+    SyncPolicy policy;
+    std::chrono::milliseconds interval;
+    std::chrono::steady_clock::time_point lastSync;
+    int fd = -1;
+
+    mutable std::mutex mutex;
+    std::condition_variable flushed;
+    std::vector<char> pending;  // Framed records not yet written
+    uint64_t appended = 0;      // Sequence number of the last record appended
+    uint64_t written = 0;       // ... written to the OS
+    uint64_t durable = 0;       // ... synced to disk
+    uint64_t syncs = 0;
+    bool flushing = false;      // A leader is writing a batch with the lock released
+    bool failed = false;
+
+    // Makes every record up to sequence written, and synced too if sync is set. One
+    // caller at a time leads: it takes all pending records, writes and syncs them
+    // without the lock, and wakes the others, whose records it may have covered.
+    void flushLocked(std::unique_lock<std::mutex>& lock, uint64_t sequence, bool sync) {
+        while ((sync ? durable : written) < sequence) {
+            if (failed) {
+                throw std::runtime_error("Log file " + path + " could not be written.");
+            }
+            if (flushing) {
+                flushed.wait(lock);
+                continue;
+            }
+            flushing = true;
+            std::vector<char> batch;
+            batch.swap(pending);
+            uint64_t batchEnd = appended;
+            bool batchSync = sync;
+            lock.unlock();
+            bool ok = true;
+            try {
+                writeAll(batch);
+                if (batchSync) {
+                    ok = ::fdatasync(fd) == 0;
+                }
+            } catch (const std::exception&) {
+                ok = false;
+            }
+            lock.lock();
+            flushing = false;
+            if (!ok) {
+                failed = true;
+            } else {
+                written = batchEnd;
+                if (batchSync) {
+                    durable = batchEnd;
+                    lastSync = std::chrono::steady_clock::now();
+                    ++syncs;
+                }
+            }
+            flushed.notify_all();
+        }
+    }
+
+    bool intervalElapsed() const {
+        return policy == SyncPolicy::Interval && std::chrono::steady_clock::now() - lastSync >= interval;
+    }
+
+    void writeAll(const std::vector<char>& batch) {
+        size_t done = 0;
+        while (done < batch.size()) {
+            ssize_t rv = ::write(fd, batch.data() + done, batch.size() - done);
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rv <= 0) {
+                throw std::runtime_error("Could not write log file " + path + ".");
+            }
+            done += static_cast<size_t>(rv);
+        }
+    }
+
+    // CRC-32C (Castagnoli), a byte at a time from a table
+    static uint32_t crc32c(const char* data, size_t size) {
+        static const std::vector<uint32_t> table = [] {
+            std::vector<uint32_t> entries(256);
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit) {
+                    crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+                }
+                entries[i] = crc;
+            }
+            return entries;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < size; ++i) {
+            crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+};
+
+#endif // WRITE_AHEAD_LOG_HPP
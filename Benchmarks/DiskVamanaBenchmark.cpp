@@ -0,0 +1,137 @@
+// Recall@10 against exact search, queries per second and blocks read per query of a
+// disk-resident Vamana index, over a range of ef and beam widths, on clustered random
+// vectors. Then at a fixed k of 10, over search list sizes with the entry cache of the
+// index and without it. Also times the build, which writes the index file.
+// Build: g++ -std=c++17 -O2 -pthread Benchmarks/DiskVamanaBenchmark.cpp -o disk_vamana_benchmark
+// Run: ./disk_vamana_benchmark [directory for the index, default .] [rows, default 100000]
+//      [dimension, default 128] [R, default 32] [build list size L, default 100]
+//      [I/O threads, default 4]; the directory should be on the disk being measured
+//      (tmpfs can't bypass the page cache, so its reads are memory copies).
+
+#include "../Algorithms/DiskVamana.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <unordered_set>
+#include <cstdio>
+
+// Gaussian blobs around random centres, closer to real embeddings than uniform noise
+std::vector<std::vector<float>> generateClusteredVectors(size_t count, size_t length, size_t clusters, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> centre(0.0f, 1.0f);
+    std::normal_distribution<float> spread(0.0f, 0.1f);
+    std::vector<std::vector<float>> centres(clusters, std::vector<float>(length));
+    for (auto& vec : centres) {
+        for (auto& val : vec) {
+            val = centre(gen);
+        }
+    }
+    std::vector<std::vector<float>> vectors(count, std::vector<float>(length));
+    for (auto& vec : vectors) {
+        const auto& around = centres[gen() % clusters];
+        for (size_t i = 0; i < length; ++i) {
+            vec[i] = around[i] + spread(gen);
+        }
+    }
+    return vectors;
+}
+
+// Recall@10, queries per second and blocks read per query of k-nearest searches with the
+// options, or of searches at ef if they are not set
+void measure(DiskVamana<uint64_t>& index, const std::vector<std::vector<float>>& queries,
+             const std::vector<std::unordered_set<size_t>>& truth, size_t k, int ef,
+             const SearchOptions& options = SearchOptions()) {
+    size_t found = 0;
+    uint64_t readsBefore = index.blockReads();
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < queries.size(); ++q) {
+        auto rows = options.listSize > 0 ? index.searchRows(queries[q], k, options) : index.searchRows(queries[q], ef);
+        for (size_t i = 0; i < std::min(k, rows.size()); ++i) {
+            found += truth[q].count(rows[i]);
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    std::cout << std::setprecision(3) << std::setw(12) << double(found) / (queries.size() * k)
+              << std::setprecision(0) << std::setw(12) << queries.size() / elapsed.count()
+              << std::setprecision(1) << std::setw(14) << double(index.blockReads() - readsBefore) / queries.size() << "\n";
+}
+
+int main(int argc, char** argv) {
+    const std::string path = std::string(argc > 1 ? argv[1] : ".") + "/disk_vamana_benchmark.index";
+    const size_t numVectors = argc > 2 ? std::stoul(argv[2]) : 100000;
+    const int dimension = argc > 3 ? std::stoi(argv[3]) : 128;
+    const int R = argc > 4 ? std::stoi(argv[4]) : 32;
+    const int L = argc > 5 ? std::stoi(argv[5]) : 100;
+    const int ioThreads = argc > 6 ? std::stoi(argv[6]) : 4;
+    constexpr size_t numQueries = 1000;
+    constexpr size_t k = 10;
+
+    auto data = generateClusteredVectors(numVectors, dimension, 100, 42);
+    auto queries = generateClusteredVectors(numQueries, dimension, 100, 42 + 1);
+
+    auto store = std::make_shared<VectorStore<uint64_t>>(dimension);
+    store->reserve(numVectors);
+    for (size_t i = 0; i < numVectors; ++i) {
+        store->append(i, data[i]);
+    }
+    VectorSpace space(dimension);
+
+    // The exact k nearest rows of every query
+    std::vector<std::unordered_set<size_t>> truth(numQueries);
+    for (size_t q = 0; q < numQueries; ++q) {
+        TopK topK(k);
+        space.scanTopK(queries[q].data(), store->vectors(), 0, numVectors, topK);
+        for (const auto& [distance, id] : topK.takeSorted()) {
+            truth[q].insert(id);
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    DiskVamana<uint64_t> index(store, space, path, 1.2f, R, L, 1, ioThreads, 0);
+    std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+    std::cout << numVectors << " vectors of dimension " << dimension << ", R " << R << ", L " << L
+              << ", built in " << std::fixed << std::setprecision(1) << buildTime.count() << " s, "
+              << (index.directReads() ? "direct" : "cached") << " reads on " << ioThreads << " I/O threads\n";
+
+    for (int beamWidth : {1, 2, 4, 8}) {
+        index.beam_width = beamWidth;
+        std::cout << "beam width " << beamWidth << "\n"
+                  << std::setw(6) << "ef" << std::setw(12) << "recall@10" << std::setw(12) << "QPS"
+                  << std::setw(14) << "reads/query" << "\n";
+        for (int ef : {10, 20, 40, 80, 160}) {
+            std::cout << std::setw(6) << ef;
+            measure(index, queries, truth, k, ef);
+        }
+    }
+
+    // The same file opened again from a snapshot of the index, with its entry cache
+    const std::string snapshotPath = path + ".snapshot";
+    index.cache_nodes = 4096;
+    {
+        SnapshotWriter writer(snapshotPath);
+        index.save(writer);
+        writer.commit();
+    }
+    SnapshotReader reader(snapshotPath);
+    reader.expect(SnapshotSection::DiskVamana);
+    DiskVamana<uint64_t> cached(store, reader);
+    for (auto* opened : {&index, &cached}) {
+        std::cout << (opened == &cached ? "4096" : "no") << " cached nodes, beam width 4\n"
+                  << std::setw(6) << "L" << std::setw(12) << "recall@10" << std::setw(12) << "QPS"
+                  << std::setw(14) << "reads/query" << "\n";
+        for (int listSize : {20, 40, 80, 160}) {
+            SearchOptions options;
+            options.listSize = listSize;
+            options.beamWidth = 4;
+            std::cout << std::setw(6) << listSize;
+            measure(*opened, queries, truth, k, 0, options);
+        }
+    }
+    std::remove(path.c_str());
+    std::remove(snapshotPath.c_str());
+
+    return 0;
+}
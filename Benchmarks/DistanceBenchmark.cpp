@@ -0,0 +1,81 @@
+// Compares distance kernels on the dimensions our collections use.
+// Build: g++ -std=c++17 -O2 Benchmarks/DistanceBenchmark.cpp -o distance_benchmark
+
+#include "../Algorithms/Distances.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+
+// The scalar loop every algorithm used before the kernel library
+static float originalDistance(const std::vector<float>& vec1, const std::vector<float>& vec2) {
+    float squaredDistance = 0.0f;
+    for (size_t i = 0; i < vec1.size(); ++i) {
+        squaredDistance += (vec1[i] - vec2[i]) * (vec1[i] - vec2[i]);
+    }
+    return squaredDistance;
+}
+
+std::vector<std::vector<float>> generateRandomVectors(size_t count, size_t length) {
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<float> dis(0.0f, 1.0f);
+    std::vector<std::vector<float>> vectors(count, std::vector<float>(length));
+    for (auto& vec : vectors) {
+        for (auto& val : vec) {
+            val = dis(gen);
+        }
+    }
+    return vectors;
+}
+
+// Runs one query against every vector, repeated, and returns nanoseconds per distance
+template<typename Func>
+double timeDistances(const std::vector<std::vector<float>>& data, const std::vector<float>& query, int repeats, Func distance) {
+    volatile float sink = 0.0f;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; ++r) {
+        float sum = 0.0f;
+        for (const auto& vec : data) {
+            sum += distance(vec, query);
+        }
+        sink = sink + sum;
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / (static_cast<double>(repeats) * data.size());
+}
+
+int main() {
+    constexpr int numVectors = 20000;
+    constexpr int repeats = 20;
+    const int dimensions[] = {96, 128, 384, 768};
+
+    std::cout << "Kernel instruction set: " << simdLevelName(getDistanceKernels().level) << "\n";
+    std::cout << std::setw(6) << "dim"
+              << std::setw(16) << "original ns"
+              << std::setw(16) << "generic ns"
+              << std::setw(16) << "fixed-dim ns"
+              << std::setw(10) << "speedup" << "\n";
+
+    for (int dim : dimensions) {
+        auto data = generateRandomVectors(numVectors, dim);
+        auto query = generateRandomVectors(1, dim)[0];
+        VectorSpace space(dim);
+
+        double original = timeDistances(data, query, repeats, originalDistance);
+        double generic = timeDistances(data, query, repeats, defaultDistance);
+        double fixed = timeDistances(data, query, repeats, [&space](const std::vector<float>& a, const std::vector<float>& b) {
+            return space.distance(a, b);
+        });
+
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(6) << dim
+                  << std::setw(16) << original
+                  << std::setw(16) << generic
+                  << std::setw(16) << fixed
+                  << std::setw(9) << original / fixed << "x\n";
+    }
+
+    return 0;
+}
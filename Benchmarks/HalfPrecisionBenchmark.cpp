@@ -0,0 +1,115 @@
+// Compares fp32, fp16 and bf16 vector storage: memory, exact-scan time and recall@k
+// of the 16-bit scans against the float32 results.
+// Build: g++ -std=c++17 -O2 Benchmarks/HalfPrecisionBenchmark.cpp -o half_precision_benchmark
+
+#include "../Algorithms/Distances.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <unordered_set>
+
+// Embedding-like data: points scattered around a few hundred cluster centers
+std::vector<std::vector<float>> generateClusteredVectors(size_t count, size_t length, std::mt19937& gen) {
+    constexpr size_t numClusters = 256;
+    std::normal_distribution<float> center(0.0f, 1.0f);
+    std::normal_distribution<float> spread(0.0f, 0.35f);
+    std::vector<std::vector<float>> centers(numClusters, std::vector<float>(length));
+    for (auto& c : centers) {
+        for (auto& val : c) {
+            val = center(gen);
+        }
+    }
+    std::uniform_int_distribution<size_t> pick(0, numClusters - 1);
+    std::vector<std::vector<float>> vectors(count, std::vector<float>(length));
+    for (auto& vec : vectors) {
+        const auto& c = centers[pick(gen)];
+        for (size_t i = 0; i < length; ++i) {
+            vec[i] = c[i] + spread(gen);
+        }
+    }
+    return vectors;
+}
+
+// Exact top k of every query over the block
+std::vector<std::vector<size_t>> scanAll(const VectorSpace& space, const VectorBlock& block,
+                                         const std::vector<std::vector<float>>& queries, int k, double& msPerQuery) {
+    std::vector<std::vector<size_t>> results;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& query : queries) {
+        TopK topK(k);
+        space.scanTopK(query.data(), block, 0, block.size(), topK);
+        std::vector<size_t> ids;
+        for (const auto& [distance, index] : topK.takeSorted()) {
+            ids.push_back(index);
+        }
+        results.push_back(std::move(ids));
+    }
+    auto end = std::chrono::steady_clock::now();
+    msPerQuery = std::chrono::duration<double, std::milli>(end - start).count() / queries.size();
+    return results;
+}
+
+double recall(const std::vector<std::vector<size_t>>& truth, const std::vector<std::vector<size_t>>& found) {
+    size_t hits = 0, total = 0;
+    for (size_t q = 0; q < truth.size(); ++q) {
+        std::unordered_set<size_t> expected(truth[q].begin(), truth[q].end());
+        for (size_t id : found[q]) {
+            hits += expected.count(id);
+        }
+        total += truth[q].size();
+    }
+    return static_cast<double>(hits) / total;
+}
+
+int main() {
+    constexpr int numVectors = 50000;
+    constexpr int numQueries = 200;
+    constexpr int k = 10;
+    const int dimensions[] = {128, 768};
+    const Metric metrics[] = {Metric::L2, Metric::InnerProduct};
+    const StorageType storages[] = {StorageType::Float32, StorageType::Float16, StorageType::BFloat16};
+
+    std::cout << "Half kernel instruction set: " << simdLevelName(getHalfKernels(StorageType::Float16).level) << "\n";
+    std::cout << std::setw(6) << "dim"
+              << std::setw(8) << "metric"
+              << std::setw(9) << "storage"
+              << std::setw(12) << "memory MB"
+              << std::setw(14) << "ms / query"
+              << std::setw(14) << "recall@" + std::to_string(k) << "\n";
+
+    for (int dim : dimensions) {
+        std::mt19937 gen(42);
+        auto data = generateClusteredVectors(numVectors, dim, gen);
+        auto queries = generateClusteredVectors(numQueries, dim, gen);
+
+        for (Metric metric : metrics) {
+            std::vector<std::vector<size_t>> truth;
+            for (StorageType storage : storages) {
+                VectorSpace space(dim, metric, storage);
+                VectorBlock block = space.makeBlock();
+                block.reserve(data.size());
+                for (const auto& vec : data) {
+                    block.append(vec);
+                }
+
+                double msPerQuery = 0.0;
+                auto found = scanAll(space, block, queries, k, msPerQuery);
+                if (storage == StorageType::Float32) {
+                    truth = found;
+                }
+
+                std::cout << std::fixed
+                          << std::setw(6) << dim
+                          << std::setw(8) << (metric == Metric::L2 ? "l2" : "ip")
+                          << std::setw(9) << storageTypeName(storage)
+                          << std::setprecision(1) << std::setw(12) << block.memoryBytes() / (1024.0 * 1024.0)
+                          << std::setprecision(3) << std::setw(14) << msPerQuery
+                          << std::setprecision(4) << std::setw(14) << recall(truth, found) << "\n";
+            }
+        }
+    }
+
+    return 0;
+}
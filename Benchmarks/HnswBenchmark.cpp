@@ -0,0 +1,155 @@
+// Recall@10 against exact search, and queries per second, of HNSW_graph over a range
+// of ef, on clustered random vectors, walking the graph on the rows, on SQ8 codes and on
+// PQ codes. Also times each build, and optionally lays the rows out along the graph
+// (bfs, rcm or gorder) before searching it. Then streams the rows into graphs that
+// start empty, searching them as the rows arrive, for the recall of each kind of codes
+// while a collection fills.
+// Build: g++ -std=c++17 -O2 -pthread Benchmarks/HnswBenchmark.cpp -o hnsw_benchmark
+// Run: ./hnsw_benchmark [rows, default 100000] [dimension, default 128] [efc, default 100]
+//      [M, default 16] [build threads, default every core] [rerank factor, default 4]
+//      [node ordering, default none]
+
+#include "../Algorithms/HNSW_graph.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <unordered_set>
+
+// Gaussian blobs around random centres, closer to real embeddings than uniform noise
+std::vector<std::vector<float>> generateClusteredVectors(size_t count, size_t length, size_t clusters, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> centre(0.0f, 1.0f);
+    std::normal_distribution<float> spread(0.0f, 0.1f);
+    std::vector<std::vector<float>> centres(clusters, std::vector<float>(length));
+    for (auto& vec : centres) {
+        for (auto& val : vec) {
+            val = centre(gen);
+        }
+    }
+    std::vector<std::vector<float>> vectors(count, std::vector<float>(length));
+    for (auto& vec : vectors) {
+        const auto& around = centres[gen() % clusters];
+        for (size_t i = 0; i < length; ++i) {
+            vec[i] = around[i] + spread(gen);
+        }
+    }
+    return vectors;
+}
+
+int main(int argc, char** argv) {
+    const size_t numVectors = argc > 1 ? std::stoul(argv[1]) : 100000;
+    const int dimension = argc > 2 ? std::stoi(argv[2]) : 128;
+    const int efc = argc > 3 ? std::stoi(argv[3]) : 100;
+    const int M = argc > 4 ? std::stoi(argv[4]) : 16;
+    const int threads = argc > 5 ? std::stoi(argv[5]) : 0;
+    const int rerankFactor = argc > 6 ? std::stoi(argv[6]) : 4;
+    NodeOrdering ordering = NodeOrdering::None;
+    if (argc > 7 && !parseNodeOrdering(argv[7], ordering)) {
+        std::cerr << "Unknown node ordering: " << argv[7] << "\n";
+        return 1;
+    }
+    constexpr size_t numQueries = 1000;
+    constexpr size_t k = 10;
+
+    auto data = generateClusteredVectors(numVectors, dimension, 100, 42);
+    auto queries = generateClusteredVectors(numQueries, dimension, 100, 42 + 1);
+
+    auto store = std::make_shared<VectorStore<uint64_t>>(dimension);
+    store->reserve(numVectors);
+    for (size_t i = 0; i < numVectors; ++i) {
+        store->append(i, data[i]);
+    }
+    VectorSpace space(dimension);
+
+    // The exact k nearest rows of every query
+    std::vector<std::unordered_set<size_t>> truth(numQueries);
+    for (size_t q = 0; q < numQueries; ++q) {
+        TopK topK(k);
+        space.scanTopK(queries[q].data(), store->vectors(), 0, numVectors, topK);
+        for (const auto& [distance, id] : topK.takeSorted()) {
+            truth[q].insert(id);
+        }
+    }
+
+    for (Compression compression : {Compression::None, Compression::SQ8, Compression::PQ}) {
+        auto start = std::chrono::steady_clock::now();
+        HNSW_graph<uint64_t> graph(store, space, 0.9f, dimension, 5, efc, M, threads,
+                                   std::mt19937::default_seed, compression, rerankFactor);
+        std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+        std::cout << numVectors << " vectors of dimension " << dimension << ", efc " << efc << ", M " << M
+                  << ", codes " << compressionName(compression) << ", rerank factor " << rerankFactor
+                  << ", built on " << (threads > 0 ? std::to_string(threads) : "all") << " threads in "
+                  << std::fixed << std::setprecision(1) << buildTime.count() << " s\n";
+
+        if (ordering != NodeOrdering::None) {
+            // Renumbers the rows, so the exact neighbors are renumbered with them
+            start = std::chrono::steady_clock::now();
+            RowGraph edges;
+            graph.rowGraph(edges);
+            std::vector<size_t> newIds = localityOrder(edges, ordering);
+            graph.permuteRows(newIds);
+            store->permute(newIds);
+            for (auto& rows : truth) {
+                std::unordered_set<size_t> renumbered;
+                for (size_t row : rows) {
+                    renumbered.insert(newIds[row]);
+                }
+                rows.swap(renumbered);
+            }
+            std::chrono::duration<double> orderTime = std::chrono::steady_clock::now() - start;
+            std::cout << "Rows reordered by " << argv[7] << " in " << orderTime.count() << " s\n";
+        }
+
+        std::cout << std::setw(6) << "ef" << std::setw(12) << "recall@10" << std::setw(12) << "QPS" << "\n";
+        for (int ef : {10, 20, 40, 80, 160}) {
+            size_t found = 0;
+            auto begin = std::chrono::steady_clock::now();
+            for (size_t q = 0; q < numQueries; ++q) {
+                auto rows = graph.searchRows(queries[q], ef);
+                for (size_t i = 0; i < std::min(k, rows.size()); ++i) {
+                    found += truth[q].count(rows[i]);
+                }
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+            std::cout << std::setw(6) << ef
+                      << std::setprecision(3) << std::setw(12) << double(found) / (numQueries * k)
+                      << std::setprecision(0) << std::setw(12) << numQueries / elapsed.count() << "\n";
+        }
+        std::cout << "\n";
+    }
+
+    std::cout << "Rows streamed into an empty graph, searched at ef 80 as they arrive\n"
+              << std::setw(8) << "codes" << std::setw(10) << "rows" << std::setw(12) << "recall@10" << "\n";
+    for (Compression compression : {Compression::None, Compression::SQ8, Compression::PQ}) {
+        auto streamed = std::make_shared<VectorStore<uint64_t>>(dimension);
+        streamed->reserve(numVectors);
+        HNSW_graph<uint64_t> graph(streamed, space, 0.9f, dimension, 5, efc, M, threads,
+                                   std::mt19937::default_seed, compression, rerankFactor);
+        size_t added = 0;
+        for (size_t checkpoint : {numVectors / 100, numVectors / 10, numVectors / 2, numVectors}) {
+            for (; added < checkpoint; ++added) {
+                graph.addRow(streamed->append(added, data[added]));
+            }
+            size_t found = 0;
+            for (size_t q = 0; q < numQueries; ++q) {
+                TopK topK(k);
+                space.scanTopK(queries[q].data(), streamed->vectors(), 0, added, topK);
+                std::unordered_set<size_t> exact;
+                for (const auto& [distance, id] : topK.takeSorted()) {
+                    exact.insert(id);
+                }
+                auto rows = graph.searchRows(queries[q], 80);
+                for (size_t i = 0; i < std::min(k, rows.size()); ++i) {
+                    found += exact.count(rows[i]);
+                }
+            }
+            std::cout << std::setw(8) << compressionName(compression) << std::setw(10) << added
+                      << std::setprecision(3) << std::setw(12) << double(found) / (numQueries * k) << "\n";
+        }
+    }
+
+    return 0;
+}
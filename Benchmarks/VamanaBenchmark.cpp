@@ -0,0 +1,176 @@
+// Build time of a Vamana graph, and its recall@10 against exact search and queries per
+// second over a range of ef, on clustered random vectors, and over search list sizes and
+// beam widths for a fixed k of 10. Then streams the last tenth of
+// the rows into a graph built on the rest, one insert at a time, deletes every tenth row
+// and compacts them away, timing each and measuring recall after. Last, streams the
+// rows into graphs that start empty and walk on SQ8 or PQ codes, searching them as the
+// rows arrive.
+// Build: g++ -std=c++17 -O2 -pthread Benchmarks/VamanaBenchmark.cpp -o vamana_benchmark
+// Run: ./vamana_benchmark [rows, default 100000] [dimension, default 128] [R, default 32]
+//      [build list size L, default 100] [alpha, default 1.2] [build threads, default every core]
+
+#include "../Algorithms/Vamana.hpp"
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <string>
+#include <unordered_set>
+
+// Gaussian blobs around random centres, closer to real embeddings than uniform noise
+std::vector<std::vector<float>> generateClusteredVectors(size_t count, size_t length, size_t clusters, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<float> centre(0.0f, 1.0f);
+    std::normal_distribution<float> spread(0.0f, 0.1f);
+    std::vector<std::vector<float>> centres(clusters, std::vector<float>(length));
+    for (auto& vec : centres) {
+        for (auto& val : vec) {
+            val = centre(gen);
+        }
+    }
+    std::vector<std::vector<float>> vectors(count, std::vector<float>(length));
+    for (auto& vec : vectors) {
+        const auto& around = centres[gen() % clusters];
+        for (size_t i = 0; i < length; ++i) {
+            vec[i] = around[i] + spread(gen);
+        }
+    }
+    return vectors;
+}
+
+// The exact k nearest rows of every query
+std::vector<std::unordered_set<size_t>> exactNeighbors(const VectorStore<uint64_t>& store, const VectorSpace& space,
+                                                       const std::vector<std::vector<float>>& queries, size_t k) {
+    std::vector<std::unordered_set<size_t>> truth(queries.size());
+    for (size_t q = 0; q < queries.size(); ++q) {
+        TopK topK(k);
+        space.scanTopK(queries[q].data(), store.vectors(), 0, store.size(), topK);
+        for (const auto& [distance, id] : topK.takeSorted()) {
+            truth[q].insert(id);
+        }
+    }
+    return truth;
+}
+
+// Recall@k of the graph at ef, or of its k nearest with the options if they are set,
+// and queries per second
+std::pair<double, double> measure(Vamana<uint64_t>& graph, const std::vector<std::vector<float>>& queries,
+                                  const std::vector<std::unordered_set<size_t>>& truth, size_t k, int ef,
+                                  const SearchOptions& options = SearchOptions()) {
+    size_t found = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t q = 0; q < queries.size(); ++q) {
+        auto rows = options.listSize > 0 ? graph.searchRows(queries[q], k, options) : graph.searchRows(queries[q], ef);
+        for (size_t i = 0; i < std::min(k, rows.size()); ++i) {
+            found += truth[q].count(rows[i]);
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    return {double(found) / (queries.size() * k), queries.size() / elapsed.count()};
+}
+
+int main(int argc, char** argv) {
+    const size_t numVectors = argc > 1 ? std::stoul(argv[1]) : 100000;
+    const int dimension = argc > 2 ? std::stoi(argv[2]) : 128;
+    const int R = argc > 3 ? std::stoi(argv[3]) : 32;
+    const int L = argc > 4 ? std::stoi(argv[4]) : 100;
+    const float alpha = argc > 5 ? std::stof(argv[5]) : 1.2f;
+    const int threads = argc > 6 ? std::stoi(argv[6]) : 0;
+    constexpr size_t numQueries = 1000;
+    constexpr size_t k = 10;
+
+    auto data = generateClusteredVectors(numVectors, dimension, 100, 42);
+    auto queries = generateClusteredVectors(numQueries, dimension, 100, 42 + 1);
+
+    auto store = std::make_shared<VectorStore<uint64_t>>(dimension);
+    store->reserve(numVectors);
+    for (size_t i = 0; i < numVectors; ++i) {
+        store->append(i, data[i]);
+    }
+    VectorSpace space(dimension);
+
+    auto truth = exactNeighbors(*store, space, queries, k);
+
+    auto start = std::chrono::steady_clock::now();
+    Vamana<uint64_t> graph(store, space, alpha, dimension, R, 1, Compression::None, 4, L, threads);
+    std::chrono::duration<double> buildTime = std::chrono::steady_clock::now() - start;
+    std::cout << numVectors << " vectors of dimension " << dimension << ", R " << R << ", L " << L
+              << ", alpha " << alpha << ", built on " << (threads > 0 ? std::to_string(threads) : "all")
+              << " threads in " << std::fixed << std::setprecision(1) << buildTime.count() << " s\n";
+
+    std::cout << std::setw(6) << "ef" << std::setw(12) << "recall@10" << std::setw(12) << "QPS" << "\n";
+    for (int ef : {10, 20, 40, 80, 160}) {
+        auto [recall, qps] = measure(graph, queries, truth, k, ef);
+        std::cout << std::setw(6) << ef
+                  << std::setprecision(3) << std::setw(12) << recall
+                  << std::setprecision(0) << std::setw(12) << qps << "\n";
+    }
+
+    std::cout << std::setw(6) << "L" << std::setw(6) << "beam" << std::setw(12) << "recall@10" << std::setw(12) << "QPS" << "\n";
+    for (int beamWidth : {1, 4}) {
+        for (int listSize : {20, 40, 80, 160}) {
+            SearchOptions options;
+            options.listSize = listSize;
+            options.beamWidth = beamWidth;
+            auto [recall, qps] = measure(graph, queries, truth, k, 0, options);
+            std::cout << std::setw(6) << listSize << std::setw(6) << beamWidth
+                      << std::setprecision(3) << std::setw(12) << recall
+                      << std::setprecision(0) << std::setw(12) << qps << "\n";
+        }
+    }
+
+    // Rows in store order, so the streamed graph's row ids match the full one's
+    const size_t initial = numVectors * 9 / 10;
+    auto streamed = std::make_shared<VectorStore<uint64_t>>(dimension);
+    streamed->reserve(numVectors);
+    for (size_t i = 0; i < initial; ++i) {
+        streamed->append(i, data[i]);
+    }
+    Vamana<uint64_t> stream(streamed, space, alpha, dimension, R, 1, Compression::None, 4, L, threads);
+    start = std::chrono::steady_clock::now();
+    for (size_t i = initial; i < numVectors; ++i) {
+        stream.addRow(streamed->append(i, data[i]));
+    }
+    std::chrono::duration<double> insertTime = std::chrono::steady_clock::now() - start;
+    auto [insertedRecall, insertedQps] = measure(stream, queries, truth, k, 80);
+    std::cout << "Inserted " << numVectors - initial << " rows into a graph of " << initial << " at "
+              << std::setprecision(2) << insertTime.count() * 1000 / (numVectors - initial) << " ms each; "
+              << "recall@10 at ef 80 " << std::setprecision(3) << insertedRecall << "\n";
+
+    // Highest ids first, as compaction does, so no deleted row is moved into a hole
+    for (size_t id = 0; id < streamed->size(); id += 10) {
+        streamed->markDeleted(id);
+    }
+    std::vector<size_t> deleted = streamed->tombstones().ids();
+    start = std::chrono::steady_clock::now();
+    stream.consolidateDeletes();
+    for (auto id = deleted.rbegin(); id != deleted.rend(); ++id) {
+        stream.removeRow(*id);
+        streamed->remove(*id);
+    }
+    std::chrono::duration<double> deleteTime = std::chrono::steady_clock::now() - start;
+    auto [deletedRecall, deletedQps] = measure(stream, queries, exactNeighbors(*streamed, space, queries, k), k, 80);
+    std::cout << "Deleted and compacted away " << deleted.size() << " rows in "
+              << std::setprecision(2) << deleteTime.count() << " s; "
+              << "recall@10 at ef 80 " << std::setprecision(3) << deletedRecall << "\n";
+
+    std::cout << "Rows streamed into an empty graph, searched at ef 80 as they arrive\n"
+              << std::setw(8) << "codes" << std::setw(10) << "rows" << std::setw(12) << "recall@10" << "\n";
+    for (Compression compression : {Compression::SQ8, Compression::PQ}) {
+        auto growing = std::make_shared<VectorStore<uint64_t>>(dimension);
+        growing->reserve(numVectors);
+        Vamana<uint64_t> filling(growing, space, alpha, dimension, R, 1, compression, 4, L, threads);
+        size_t added = 0;
+        for (size_t checkpoint : {numVectors / 100, numVectors / 10, numVectors / 2, numVectors}) {
+            for (; added < checkpoint; ++added) {
+                filling.addRow(growing->append(added, data[added]));
+            }
+            auto [recall, qps] = measure(filling, queries, exactNeighbors(*growing, space, queries, k), k, 80);
+            std::cout << std::setw(8) << compressionName(compression) << std::setw(10) << added
+                      << std::setprecision(3) << std::setw(12) << recall << "\n";
+        }
+    }
+
+    return 0;
+}
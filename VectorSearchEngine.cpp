@@ -53,9 +53,29 @@ std::vector<float> generateRandomVector(size_t length) {
     return result;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // With --integer-keys, serve collections keyed by 64-bit integers instead; with
+    // --index-dir <dir>, write disk indexes in dir instead of the working directory
+    bool integerKeys = false;
+    std::string indexDirectory = ".";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--integer-keys") {
+            integerKeys = true;
+        } else if (arg == "--index-dir" && i + 1 < argc) {
+            indexDirectory = argv[++i];
+        }
+    }
+    if (integerKeys) {
+        VectorSearchEngine<uint64_t> engine;
+        engine.setIndexDirectory(indexDirectory);
+        engine.serve_forever();
+        return 0;
+    }
+
     // Create an instance of the VectorSearchEngine
     VectorSearchEngine<std::string> engine;
+    engine.setIndexDirectory(indexDirectory);
 
     // Create a collection
     std::string collectionName = "ExampleCollection";
@@ -6,6 +6,7 @@
 #include <chrono>
 #include <iomanip>
 #include <algorithm> // For std::find_if
+#include <limits>
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -27,7 +28,10 @@
 #include "Algorithms/AnnoyTreeForest.hpp"
 #include "Algorithms/InvertedFileIndex.hpp"
 #include "Algorithms/Vamana.hpp"
+#include "Algorithms/DiskVamana.hpp"
 #include "Algorithms/VectorSearchAlgorithm.hpp"
+#include "Algorithms/VectorStore.hpp"
+#include "Algorithms/WriteAheadLog.hpp"
 
 #include <mutex>
 
@@ -36,18 +40,66 @@ class VectorSearchEngine {
 private:
 
     struct Collection {
-        std::vector<std::pair<T, std::vector<float>>> data;
+        // Keys and their vectors, in the collection's storage type, so fp16/bf16 collections
+        // hold half the bytes, in an aligned arena that grows without moving rows already
+        // added. The graph below and every algorithm built on the collection share this
+        // one store and refer to its rows by id.
+        std::shared_ptr<VectorStore<T>> store;
         std::shared_ptr<HNSW_graph<T>> hnswGraph;
+        // Algorithms built on the collection, kept in step with the store's rows
+        std::vector<std::shared_ptr<VectorSearchAlgorithm<T>>> algorithms;
+        // Metric and storage chosen at creation; dimension and kernels are fixed by the first vector added
+        Metric metric = Metric::L2;
+        StorageType storage = StorageType::Float32;
+        VectorSpace space;
+        size_t reserveSize;
+        // What the graph is built with, also chosen at creation
+        HnswParameters index;
+        // During a bulk load, rows from bulkFrom on are only in the store; the graph and
+        // algorithms take them all at once when the load ends
+        bool bulkLoading = false;
+        size_t bulkFrom = 0;
+        // A compaction spread over poll rounds: the rows deleted when it began, which are
+        // the ones it takes out, and how far it has got. Each index in turn, the graph
+        // first, is relinked around them a range of rows at a time; then they are removed.
+        struct Compaction {
+            bool active = false;
+            std::vector<size_t> deleted;
+            size_t index = 0;
+            size_t row = 0;
+        };
+        Compaction compaction;
 
         Collection(int reserveSize = 5000) 
-            : data(), 
-            hnswGraph(std::make_shared<HNSW_graph<T>>()) {  // Directly create HNSW_graph instance
-            data.reserve(reserveSize);
+            : store(std::make_shared<VectorStore<T>>()), 
+            hnswGraph(std::make_shared<HNSW_graph<T>>()),  // Directly create HNSW_graph instance
+            reserveSize(reserveSize) {
         }
     };
 
     std::map < std::string, Collection > collections;
     std::map < std::string, std::shared_ptr<VectorSearchAlgorithm<T>> > algorithms;
+    // Space each algorithm was built in, so queries can be prepared for its metric
+    std::map < std::string, VectorSpace > algorithmSpaces;
+    // Fraction of a collection's rows that may be deleted before it is compacted
+    double compactionThreshold = 0.1;
+    // Rows a compaction relinks or removes between two poll rounds, so requests wait
+    // for a bounded slice of it instead of the whole
+    size_t compactionStepRows = 1024;
+    // When open, every change to the collections is logged before it is applied
+    std::unique_ptr<WriteAheadLog> log;
+    // Order a collection's rows are renumbered in after a graph is built on it, and
+    // before it is written to a snapshot
+    NodeOrdering nodeOrdering = NodeOrdering::None;
+    // Directory disk indexes are written in; clients only name files inside it
+    std::string indexDirectory = ".";
+
+    enum class LogOperation : uint8_t {
+        CreateCollection = 1,
+        DeleteCollection,
+        Add,
+        Delete,
+    };
 
  
 public:
@@ -56,16 +108,37 @@ public:
 
     VectorSearchEngine() { }
 
-    void createCollection(const std::string& collectionName, int reserveSize = 5000) {
+    void createCollection(const std::string& collectionName, int reserveSize = 5000, Metric metric = Metric::L2,
+                          StorageType storage = StorageType::Float32, bool hugePages = false,
+                          const HnswParameters& index = HnswParameters()) {
         if (collections.find(collectionName) == collections.end()) {
+            if (log) {
+                LogRecord record;
+                record.put(LogOperation::CreateCollection);
+                record.putString(collectionName);
+                record.put<int32_t>(reserveSize);
+                record.put<int32_t>(static_cast<int32_t>(metric));
+                record.put<int32_t>(static_cast<int32_t>(storage));
+                record.put<uint8_t>(hugePages);
+                record.put<float>(index.mL);
+                record.put<int32_t>(index.num_layers);
+                record.put<int32_t>(index.efc);
+                record.put<int32_t>(index.M);
+                record.put<int32_t>(index.threads);
+                record.put<uint8_t>(static_cast<uint8_t>(index.compression));
+                record.put<int32_t>(index.rerank_factor);
+                log->append(record);
+            }
+
             Collection newCollection(reserveSize);
-            // Assuming HNSW_graph's constructor requires parameters
-            float mL = 0.9f; // Example parameter, adjust as necessary
-            int vector_len = 128; // Example parameter
-            int num_layers = 5; // Example parameter
-            int efc = 6; // Example parameter
-            // Create and assign a new HNSW_graph instance to the collection
-            newCollection.hnswGraph = std::make_shared<HNSW_graph<T>>(newCollection.data, mL, vector_len, num_layers, efc);
+            newCollection.metric = metric;
+            newCollection.storage = storage;
+            newCollection.index = index;
+            // Back large arena chunks with transparent huge pages when asked to
+            newCollection.store = std::make_shared<VectorStore<T>>(0, storage, hugePages);
+            newCollection.space = VectorSpace(0, metric, storage);
+            // The graph takes its dimension from the store once the first vector is added
+            newCollection.hnswGraph = std::make_shared<HNSW_graph<T>>(newCollection.store, newCollection.space, index);
 
             collections[collectionName] = std::move(newCollection);
         
@@ -79,6 +152,13 @@ public:
         // Check if the collection exists
         auto it = collections.find(collectionName);
         if (it != collections.end()) {
+            if (log) {
+                LogRecord record;
+                record.put(LogOperation::DeleteCollection);
+                record.putString(collectionName);
+                log->append(record);
+            }
+
             // The collection exists, proceed to delete
             collections.erase(it);
             return true; // Indicate successful deletion
@@ -93,14 +173,54 @@ public:
     bool addToCollection(const std::string& collectionName, const T& key, const std::vector<float>& values) {
         auto it = collections.find(collectionName);
         if (it != collections.end()) {
+            // The first vector decides the collection's dimension and which kernels it uses
+            if (it->second.space.dimension == 0) {
+                it->second.space = VectorSpace(values.size(), it->second.metric, it->second.storage);
+                it->second.store->setDimension(values.size());
+                it->second.store->reserve(it->second.reserveSize);
+                // Algorithms registered on the empty collection query in its space too
+                for (const auto& [algName, algorithm] : algorithms) {
+                    const auto& built = it->second.algorithms;
+                    if (std::find(built.begin(), built.end(), algorithm) != built.end()) {
+                        algorithmSpaces[algName] = it->second.space;
+                    }
+                }
+            } else if (values.size() != static_cast<size_t>(it->second.space.dimension)) {
+                std::cerr << "Vector length " << values.size() << " does not match collection '" << collectionName
+                          << "' dimension " << it->second.space.dimension << ".\n";
+                return false;
+            }
+
+            if (it->second.store->find(key) != it->second.store->size()) {
+                std::cerr << "Data point with key '" << key << "' already exists in collection '" << collectionName << "'.\n";
+                return false;
+            }
+
+            if (log) {
+                LogRecord record;
+                record.put(LogOperation::Add);
+                record.putString(collectionName);
+                record.putKey(key);
+                record.putFloats(values);
+                log->append(record);
+            }
+
+            // Cosine collections store unit vectors, so normalization happens once here
+            std::vector<float> prepared = it->second.space.prepared(values);
+
             // Collection exists, add the data point to it
-            it->second.data.emplace_back(key, values);
+            size_t id = it->second.store->append(key, prepared);
         
-            // Optionally, update the HNSW_graph for this collection if needed
-            // This would require calling a method on it->second.hnswGraph
-            // For example:
-            // it->second.hnswGraph->addData(key, values);
-            it->second.hnswGraph->insert( std::make_pair (key, values) );
+            // The collection's graph and algorithms pick up the new row by its id in the
+            // store, or all the rows of a bulk load when it ends
+            if (!it->second.bulkLoading) {
+                it->second.hnswGraph->addRow(id);
+                for (auto& algorithm : it->second.algorithms) {
+                    size_t unindexed = algorithm->unindexedRows();
+                    algorithm->addRow(id);
+                    reportUnindexed(algorithm, unindexed);
+                }
+            }
             return true; // Indicate successful addition
         } else {
             // Handle the case where the collection does not exist
@@ -125,29 +245,181 @@ public:
         }
 
         // Now, find the data point by key within the collection.
-        auto& dataPoints = collectionIt->second.data; // Reference to the collection's data vector.
-        auto dataPointIt = std::find_if(dataPoints.begin(), dataPoints.end(),
-                                        [&key](const std::pair<T, std::vector<float>>& item) {
-                                            return item.first == key;
-                                        });
+        auto& store = *collectionIt->second.store;
+        size_t id = store.find(key);
 
-        if (dataPointIt == dataPoints.end()) {
+        if (id == store.size()) {
             std::cerr << "Data point with key '" << key << "' not found in collection '" << collectionName << "'.\n";
             return false; // Data point does not exist within the collection.
         }
 
-        // The data point exists; remove it from the collection.
-        dataPoints.erase(dataPointIt);
+        if (log) {
+            LogRecord record;
+            record.put(LogOperation::Delete);
+            record.putString(collectionName);
+            record.putKey(key);
+            log->append(record);
+        }
 
-        // Optionally, if the HNSW_graph needs to be updated to reflect the deletion,
-        // you would call the appropriate method on the HNSW_graph instance here.
-        // Example (assuming such a method exists):
-        // collectionIt->second.hnswGraph->removeData(key);
+        // The data point exists. Marking it is enough for every search to skip it; the
+        // graphs keep routing through it until the collection is compacted.
+        store.markDeleted(id);
 
         return true; // Data point successfully deleted.
     }
 
+    // Removes a collection's deleted rows for good: the graph and algorithms relink
+    // around them, drop them one by one, and the store gives back the memory. Done at
+    // once, finishing any compaction of the collection already under way.
+    bool compactCollection(const std::string& collectionName) {
+        auto it = collections.find(collectionName);
+        if (it == collections.end()) {
+            std::cerr << "Collection '" << collectionName << "' not found.\n";
+            return false;
+        }
+
+        auto& collection = it->second;
+        // Indexes are renumbered row by row, so they must hold every row first
+        finishBulkLoad(collection);
+        beginCompaction(collection);
+        finishCompaction(collection);
+        return true;
+    }
+
+    // Starts compacting every collection whose deleted fraction has reached the
+    // threshold, and takes one step of every compaction under way. Returns the number
+    // still under way.
+    size_t compactDueCollections() {
+        size_t underway = 0;
+        for (auto& [name, collection] : collections) {
+            const auto& store = *collection.store;
+            if (collection.bulkLoading) {
+                continue;
+            }
+            if (!collection.compaction.active && store.deletedCount() > 0
+                && store.deletedCount() >= compactionThreshold * store.size()) {
+                beginCompaction(collection);
+            }
+            if (collection.compaction.active && !compactionStep(collection, compactionStepRows)) {
+                ++underway;
+            }
+        }
+        return underway;
+    }
+
+    void setCompactionThreshold(double threshold) {
+        compactionThreshold = threshold;
+    }
+
+    void setCompactionStepRows(size_t rows) {
+        compactionStepRows = std::max<size_t>(rows, 1);
+    }
+
+    void setIndexDirectory(const std::string& directory) {
+        indexDirectory = directory;
+    }
+
+    // Renumbers a collection's rows in ordering over one of its graphs, the named
+    // algorithm or by default the collection's own, so that the rows, links and codes
+    // a search hop reads sit close together. Keys and results don't change.
+    bool reorderCollection(const std::string& collectionName, NodeOrdering ordering, const std::string& algName = "") {
+        auto it = collections.find(collectionName);
+        if (it == collections.end()) {
+            std::cerr << "Collection '" << collectionName << "' not found.\n";
+            return false;
+        }
+        auto& collection = it->second;
+        finishBulkLoad(collection);
+        finishCompaction(collection);
+        std::shared_ptr<VectorSearchAlgorithm<T>> graph = collection.hnswGraph;
+        if (!algName.empty()) {
+            auto algorithm = algorithms.find(algName);
+            if (algorithm == algorithms.end() || std::find(collection.algorithms.begin(), collection.algorithms.end(),
+                                                           algorithm->second) == collection.algorithms.end()) {
+                std::cerr << "Algorithm '" << algName << "' not found on collection '" << collectionName << "'.\n";
+                return false;
+            }
+            graph = algorithm->second;
+        }
+        if (!reorderRows(collection, *graph, ordering)) {
+            std::cerr << "Algorithm '" << algName << "' is not a graph.\n";
+            return false;
+        }
+        return true;
+    }
+
+    // From now until endBulkLoad, rows added to the collection only go into its store.
+    // Searches don't see them until the load ends.
+    bool beginBulkLoad(const std::string& collectionName) {
+        auto it = collections.find(collectionName);
+        if (it == collections.end()) {
+            std::cerr << "Collection '" << collectionName << "' not found.\n";
+            return false;
+        }
+        if (!it->second.bulkLoading) {
+            // Rows only in the store can't be moved into the holes of removed ones
+            finishCompaction(it->second);
+            it->second.bulkLoading = true;
+            it->second.bulkFrom = it->second.store->size();
+        }
+        return true;
+    }
+
+    // Indexes the rows added since beginBulkLoad in one batch pass
+    bool endBulkLoad(const std::string& collectionName) {
+        auto it = collections.find(collectionName);
+        if (it == collections.end()) {
+            std::cerr << "Collection '" << collectionName << "' not found.\n";
+            return false;
+        }
+        finishBulkLoad(it->second);
+        return true;
+    }
+
+    // Ordering applied after every graph is built and before every snapshot is saved
+    void setNodeOrdering(NodeOrdering ordering) {
+        nodeOrdering = ordering;
+    }
+
+    // Replays the log at path onto the collections, then logs every later change to
+    // it. Start from the snapshot the log was begun after, if there is one. Changes
+    // are logged as they are made; syncLog() makes them durable.
+    bool openLog(const std::string& path, SyncPolicy policy = SyncPolicy::Always, int intervalMs = 100) {
+        try {
+            log.reset();
+            size_t replayed = WriteAheadLog::replay(path, [this](LogRecordReader& record) {
+                replayRecord(record);
+            });
+            log = std::make_unique<WriteAheadLog>(path, policy, std::chrono::milliseconds(intervalMs));
+            std::cout << "Replayed " << replayed << " logged changes from " << path << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Could not open log '" << path << "': " << e.what() << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    // Waits until the changes logged so far are as durable as the log's policy makes
+    // them. Writers that call it together share one sync of the log.
+    void syncLog() {
+        if (log) {
+            log->sync();
+        }
+    }
+
+    // Syncs of the log so far, to see how many changes each group commit covers
+    uint64_t logSyncCount() const {
+        return log ? log->syncCount() : 0;
+    }
+
     std::vector<std::pair<T, std::vector<float>>> queryCollection(const std::string& collectionName, const std::vector<float>& queryVector, int ef) {
+        auto rows = queryCollectionRows(collectionName, queryVector, ef);
+        auto it = collections.find(collectionName);
+        return it == collections.end() ? std::vector<std::pair<T, std::vector<float>>>() : it->second.store->entries(rows);
+    }
+
+    // Ids of the rows closest to the query in the collection's store, nearest first
+    std::vector<size_t> queryCollectionRows(const std::string& collectionName, const std::vector<float>& queryVector, int ef) {
         // Check if the collection exists
         auto it = collections.find(collectionName);
         if (it == collections.end()) {
@@ -160,14 +432,17 @@ public:
             std::cerr << "HNSW_graph for collection '" << collectionName << "' is not initialized.\n";
             return {}; // Return an empty vector to indicate failure
         }
+        if (!fitsSpace(it->second.space, queryVector, collectionName)) {
+            return {};
+        }
 
         // Perform the query on the HNSW_graph associated with the collection
         auto& hnswGraph = it->second.hnswGraph;
-        // Ensure the HNSW_graph has a method `searchClosest` that matches the expected signature
+        // Ensure the HNSW_graph has a method `searchRows` that matches the expected signature
         try {
-            return hnswGraph->searchClosest(queryVector, ef);
+            return hnswGraph->searchRows(it->second.space.prepared(queryVector), ef);
         } catch (const std::exception& e) {
-            // Catch exceptions if searchClosest could throw
+            // Catch exceptions if searchRows could throw
             std::cerr << "An error occurred during the query: " << e.what() << '\n';
             return {}; // Return an empty vector to indicate failure
         }
@@ -185,8 +460,16 @@ public:
         // Ensure T is derived from VectorSearchEngine
         static_assert(std::is_base_of<VectorSearchAlgorithm<T>, Alg>::value, "T must inherit from VectorSearchEngine");
 
-        // Create a new instance of T, passing in the forwarded arguments
-        auto algorithm = std::make_shared<Alg>(it->second.data, std::forward<Args>(args)...);
+        // The algorithm is built on every row, so a bulk load or compaction in progress
+        // is finished first
+        finishBulkLoad(it->second);
+        finishCompaction(it->second);
+
+        // Create a new instance of T, passing in the forwarded arguments. The algorithm indexes
+        // the collection's store in place, and the collection's space carries the kernels
+        // specialized for its dimension into it.
+        std::shared_ptr<const VectorStore<T>> store = it->second.store;
+        auto algorithm = std::make_shared<Alg>(store, it->second.space, std::forward<Args>(args)...);
 
         // Generate a unique name for the algorithm
         std::string uniqueName = name;
@@ -197,12 +480,113 @@ public:
         }
 
         // Add the newly created algorithm instance to the map
-        algorithms.emplace(algName, std::move(algorithm));
+        if (algorithms.emplace(algName, algorithm).second) {
+            it->second.algorithms.push_back(algorithm);
+        }
+        algorithmSpaces.emplace(algName, it->second.space);
+
+        // A new graph lays the collection's rows out along its own edges
+        if (nodeOrdering != NodeOrdering::None) {
+            reorderRows(it->second, *algorithm, nodeOrdering);
+        }
 
         // Return the name for confirmation or further use
         return uniqueName;
     }
 
+    // Writes every collection, with its store, its graph and the algorithms built on it,
+    // to a snapshot at path. The file at path is only replaced once the new one is complete.
+    bool saveSnapshot(const std::string& path) {
+        try {
+            // A snapshot's indexes cover every row
+            for (auto& [name, collection] : collections) {
+                finishBulkLoad(collection);
+                finishCompaction(collection);
+                if (nodeOrdering != NodeOrdering::None) {
+                    reorderRows(collection, *collection.hnswGraph, nodeOrdering);
+                }
+                // Saving only reads the indexes, so what each has queued is applied here
+                collection.hnswGraph->prepareForSave();
+                for (auto& algorithm : collection.algorithms) {
+                    algorithm->prepareForSave();
+                }
+            }
+            SnapshotWriter snapshot(path);
+            snapshot.write<uint64_t>(collections.size());
+            for (const auto& [name, collection] : collections) {
+                snapshot.section(SnapshotSection::Collection);
+                snapshot.writeString(name);
+                snapshot.write<int32_t>(static_cast<int32_t>(collection.metric));
+                snapshot.write<int32_t>(static_cast<int32_t>(collection.storage));
+                snapshot.write<uint64_t>(collection.reserveSize);
+                collection.index.save(snapshot);
+                collection.space.save(snapshot);
+                collection.store->save(snapshot);
+                collection.hnswGraph->save(snapshot);
+                snapshot.write<uint64_t>(collection.algorithms.size());
+                for (const auto& algorithm : collection.algorithms) {
+                    snapshot.writeString(algorithmName(algorithm));
+                    algorithm->save(snapshot);
+                }
+            }
+            snapshot.commit();
+            // The snapshot holds everything logged so far, so the log starts over
+            if (log) {
+                log->truncate();
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Could not save snapshot to '" << path << "': " << e.what() << '\n';
+            return false;
+        }
+        return true;
+    }
+
+    // Replaces every collection and algorithm with those in the snapshot at path. The
+    // rows are served from the mapped file and the indexes are wired back up without
+    // being rebuilt. Nothing changes if the snapshot can't be read.
+    bool loadSnapshot(const std::string& path) {
+        std::map<std::string, Collection> loadedCollections;
+        std::map<std::string, std::shared_ptr<VectorSearchAlgorithm<T>>> loadedAlgorithms;
+        std::map<std::string, VectorSpace> loadedSpaces;
+        try {
+            SnapshotReader snapshot(path);
+            size_t collectionCount = snapshot.read<uint64_t>();
+            for (size_t i = 0; i < collectionCount; ++i) {
+                snapshot.expect(SnapshotSection::Collection);
+                std::string name = snapshot.readString();
+                Collection collection;
+                collection.metric = static_cast<Metric>(snapshot.read<int32_t>());
+                collection.storage = static_cast<StorageType>(snapshot.read<int32_t>());
+                collection.reserveSize = snapshot.read<uint64_t>();
+                collection.index = HnswParameters(snapshot);
+                collection.space = VectorSpace(snapshot);
+                collection.store = std::make_shared<VectorStore<T>>(snapshot);
+                snapshot.expect(SnapshotSection::HNSW);
+                collection.hnswGraph = std::make_shared<HNSW_graph<T>>(collection.store, snapshot);
+                size_t algorithmCount = snapshot.read<uint64_t>();
+                for (size_t j = 0; j < algorithmCount; ++j) {
+                    std::string algName = snapshot.readString();
+                    auto algorithm = loadAlgorithm(collection.store, snapshot);
+                    collection.algorithms.push_back(algorithm);
+                    loadedAlgorithms[algName] = algorithm;
+                    loadedSpaces[algName] = collection.space;
+                }
+                loadedCollections[name] = std::move(collection);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Could not load snapshot from '" << path << "': " << e.what() << '\n';
+            return false;
+        }
+        collections = std::move(loadedCollections);
+        algorithms = std::move(loadedAlgorithms);
+        algorithmSpaces = std::move(loadedSpaces);
+        // Logged changes were made to the state just replaced
+        if (log) {
+            log->truncate();
+        }
+        return true;
+    }
+
     // Method to list all algorithm names
     std::vector<std::string> listAlgorithmNames() const {
         std::vector<std::string> names;
@@ -222,11 +606,14 @@ public:
     }
 
     // Method that takes an algorithm name, a query vector, and ef, then calls searchClosest
-    std::vector<std::pair<std::string, std::vector<float>>> queryAlgorithm(const std::string& algName, const std::vector<float>& queryVector, int ef) {
+    std::vector<std::pair<T, std::vector<float>>> queryAlgorithm(const std::string& algName, const std::vector<float>& queryVector, int ef) {
         auto it = algorithms.find(algName);
         if (it != algorithms.end()) {
+            if (!fitsSpace(algorithmSpaces[algName], queryVector, algName)) {
+                return {};
+            }
             // Algorithm found, perform the query
-            return it->second->searchClosest(queryVector, ef);
+            return it->second->searchClosest(algorithmSpaces[algName].prepared(queryVector), ef);
         } else {
             // Algorithm not found, handle the error or return an empty result
             std::cerr << "Algorithm '" << algName << "' not found.\n";
@@ -234,6 +621,293 @@ public:
         }
     }
 
+    // The same query, returning ids of rows in the store of the algorithm's collection.
+    // With options, ef is the number of results and the options tune the search for them.
+    std::vector<size_t> queryAlgorithmRows(const std::string& algName, const std::vector<float>& queryVector, int ef,
+                                           const SearchOptions& options = SearchOptions()) {
+        auto it = algorithms.find(algName);
+        if (it == algorithms.end()) {
+            std::cerr << "Algorithm '" << algName << "' not found.\n";
+            return {};
+        }
+        if (!fitsSpace(algorithmSpaces[algName], queryVector, algName)) {
+            return {};
+        }
+        if (options.listSize > 0 || options.beamWidth > 0) {
+            return it->second->searchRows(algorithmSpaces[algName].prepared(queryVector), ef, options);
+        }
+        return it->second->searchRows(algorithmSpaces[algName].prepared(queryVector), ef);
+    }
+
+private:
+    // Whether a query has the space's dimension: every kernel and code table reads
+    // exactly that many floats of it. An empty space has no rows to search.
+    static bool fitsSpace(const VectorSpace& space, const std::vector<float>& queryVector, const std::string& name) {
+        if (space.dimension == 0) {
+            return false;
+        }
+        if (queryVector.size() != static_cast<size_t>(space.dimension)) {
+            std::cerr << "Query length " << queryVector.size() << " does not match '" << name
+                      << "' dimension " << space.dimension << ".\n";
+            return false;
+        }
+        return true;
+    }
+
+    // The file a client's name stands for, inside the index directory. Absolute names
+    // and names with a ".." component, which could reach outside it, are refused.
+    bool indexPath(const std::string& name, std::string& path) const {
+        if (name.empty() || name.front() == '/') {
+            return false;
+        }
+        std::stringstream components(name);
+        std::string component;
+        while (std::getline(components, component, '/')) {
+            if (component == "..") {
+                return false;
+            }
+        }
+        path = indexDirectory + "/" + name;
+        return true;
+    }
+
+    // Builds an algorithm a client asked for. Parameters its constructor rejects, and
+    // a missing collection, are reported and answered with an error.
+    template<typename Alg, typename... Args>
+    uint32_t addRequestedAlgorithm(const std::string& algName, const std::string& name, Args&&... args) {
+        try {
+            if (addAlgorithm<Alg>(algName, name, std::forward<Args>(args)...).empty()) {
+                return RES_ERR;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Could not build '" << algName << "': " << e.what() << '\n';
+            return RES_ERR;
+        }
+        return RES_OK;
+    }
+
+    // Reports an algorithm that has just started leaving added rows out of its searches,
+    // as an index built once does, so its results aren't silently stale
+    void reportUnindexed(const std::shared_ptr<VectorSearchAlgorithm<T>>& algorithm, size_t before) const {
+        if (before > 0 || algorithm->unindexedRows() == 0) {
+            return;
+        }
+        for (const auto& [name, built] : algorithms) {
+            if (built == algorithm) {
+                std::cerr << "Algorithm '" << name << "' does not index rows added after it was built; "
+                          << "rebuild it to search them.\n";
+                return;
+            }
+        }
+    }
+
+    // Store of the collection the algorithm was built on
+    std::shared_ptr<const VectorStore<T>> algorithmStore(const std::string& algName) const {
+        auto algorithm = algorithms.find(algName);
+        if (algorithm != algorithms.end()) {
+            for (const auto& [name, collection] : collections) {
+                for (const auto& built : collection.algorithms) {
+                    if (built == algorithm->second) {
+                        return collection.store;
+                    }
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // The keys of rows, one per line, written straight from the store's key arena
+    static std::string keyLines(const VectorStore<T>* store, const std::vector<size_t>& rows) {
+        std::string val;
+        if (!store) {
+            return val;
+        }
+        for (size_t row : rows) {
+            if (!val.empty()) {
+                val += "\n"; // Add a newline between keys, but not before the first key
+            }
+            store->appendKeyText(row, val);
+        }
+        return val;
+    }
+
+    // Name the algorithm was registered under
+    std::string algorithmName(const std::shared_ptr<VectorSearchAlgorithm<T>>& algorithm) const {
+        for (const auto& [name, registered] : algorithms) {
+            if (registered == algorithm) {
+                return name;
+            }
+        }
+        return {};
+    }
+
+    // Applies one logged change through the same path that made it
+    void replayRecord(LogRecordReader& record) {
+        auto operation = record.get<LogOperation>();
+        std::string collectionName = record.getString();
+        switch (operation) {
+            case LogOperation::CreateCollection: {
+                int reserveSize = record.get<int32_t>();
+                Metric metric = static_cast<Metric>(record.get<int32_t>());
+                StorageType storage = static_cast<StorageType>(record.get<int32_t>());
+                bool hugePages = record.get<uint8_t>() != 0;
+                // Collections logged before they took index parameters get the defaults
+                HnswParameters index;
+                if (!record.done()) {
+                    index.mL = record.get<float>();
+                    index.num_layers = record.get<int32_t>();
+                    index.efc = record.get<int32_t>();
+                    index.M = record.get<int32_t>();
+                    index.threads = record.get<int32_t>();
+                    index.compression = static_cast<Compression>(record.get<uint8_t>());
+                    index.rerank_factor = record.get<int32_t>();
+                }
+                createCollection(collectionName, reserveSize, metric, storage, hugePages, index);
+                break;
+            }
+            case LogOperation::DeleteCollection:
+                deleteCollection(collectionName);
+                break;
+            case LogOperation::Add: {
+                T key = record.getKey<T>();
+                addToCollection(collectionName, key, record.getFloats());
+                break;
+            }
+            case LogOperation::Delete:
+                deleteFromCollection(collectionName, record.getKey<T>());
+                break;
+            default:
+                throw std::runtime_error("Log holds an unknown change.");
+        }
+    }
+
+    // Hands the rows of a bulk load to the graph and algorithms. A graph that had no rows
+    // when the load began is built afresh over all of them, in random order on every
+    // thread; otherwise the new rows are linked into it as one batch.
+    void finishBulkLoad(Collection& collection) {
+        if (!collection.bulkLoading) {
+            return;
+        }
+        collection.bulkLoading = false;
+        size_t end = collection.store->size();
+        if (collection.bulkFrom == end) {
+            return;
+        }
+        if (collection.bulkFrom == 0) {
+            collection.hnswGraph = std::make_shared<HNSW_graph<T>>(collection.store, collection.space, collection.index);
+        } else {
+            collection.hnswGraph->addRows(collection.bulkFrom, end);
+        }
+        for (auto& algorithm : collection.algorithms) {
+            size_t unindexed = algorithm->unindexedRows();
+            algorithm->addRows(collection.bulkFrom, end);
+            reportUnindexed(algorithm, unindexed);
+        }
+    }
+
+    // Takes the rows deleted so far out of the collection in the steps of compactionStep
+    void beginCompaction(Collection& collection) {
+        auto& compaction = collection.compaction;
+        if (compaction.active || collection.store->deletedCount() == 0) {
+            return;
+        }
+        compaction.active = true;
+        compaction.deleted = collection.store->tombstones().ids();
+        compaction.index = 0;
+        compaction.row = 0;
+    }
+
+    // Relinks one index around the deleted rows from the nodes of up to rows rows, or
+    // removes up to rows of them, highest ids first so the row moved into each hole is
+    // never one of them. Rows deleted since the compaction began are left for the next.
+    // True once the compaction is over.
+    bool compactionStep(Collection& collection, size_t rows) {
+        auto& compaction = collection.compaction;
+        if (!compaction.active) {
+            return true;
+        }
+        auto& store = *collection.store;
+        if (compaction.index <= collection.algorithms.size()) {
+            VectorSearchAlgorithm<T>& index = compaction.index == 0 ? static_cast<VectorSearchAlgorithm<T>&>(*collection.hnswGraph)
+                                                                    : *collection.algorithms[compaction.index - 1];
+            size_t end = rows >= store.size() - compaction.row ? store.size() : compaction.row + rows;
+            if (compaction.row == 0 && end == store.size()) {
+                index.consolidateDeletes();
+            } else {
+                index.consolidateDeletesIn(compaction.row, end);
+            }
+            compaction.row = end;
+            if (end == store.size()) {
+                ++compaction.index;
+                compaction.row = 0;
+            }
+            return false;
+        }
+
+        for (; rows > 0 && !compaction.deleted.empty(); --rows) {
+            size_t id = compaction.deleted.back();
+            compaction.deleted.pop_back();
+            collection.hnswGraph->removeRow(id);
+            for (auto& algorithm : collection.algorithms) {
+                algorithm->removeRow(id);
+            }
+            store.remove(id);
+        }
+        if (!compaction.deleted.empty()) {
+            return false;
+        }
+        store.shrinkToFit();
+        compaction = typename Collection::Compaction();
+        return true;
+    }
+
+    // Runs the rest of a compaction under way at once
+    void finishCompaction(Collection& collection) {
+        while (!compactionStep(collection, std::numeric_limits<size_t>::max())) {}
+    }
+
+    // Renumbers the collection's rows in ordering over graph's edges: every index, then
+    // the store. False if graph isn't a graph.
+    static bool reorderRows(Collection& collection, VectorSearchAlgorithm<T>& graph, NodeOrdering ordering) {
+        RowGraph edges;
+        if (!graph.rowGraph(edges)) {
+            return false;
+        }
+        auto& store = *collection.store;
+        if (ordering == NodeOrdering::None || store.empty()) {
+            return true;
+        }
+        // Rows the graph has no node for yet have no edges
+        edges.offsets.resize(store.size() + 1, edges.offsets.back());
+
+        std::vector<size_t> newIds = localityOrder(edges, ordering);
+        collection.hnswGraph->permuteRows(newIds);
+        for (auto& algorithm : collection.algorithms) {
+            algorithm->permuteRows(newIds);
+        }
+        store.permute(newIds);
+        return true;
+    }
+
+    // Constructs the algorithm whose section comes next in the snapshot
+    static std::shared_ptr<VectorSearchAlgorithm<T>> loadAlgorithm(std::shared_ptr<const VectorStore<T>> store, SnapshotReader& snapshot) {
+        switch (snapshot.section()) {
+            case SnapshotSection::HNSW:
+                return std::make_shared<HNSW_graph<T>>(store, snapshot);
+            case SnapshotSection::Vamana:
+                return std::make_shared<Vamana<T>>(store, snapshot);
+            case SnapshotSection::DiskVamana:
+                return std::make_shared<DiskVamana<T>>(store, snapshot);
+            case SnapshotSection::InvertedFile:
+                return std::make_shared<InvertedFileIndex<T>>(store, snapshot);
+            case SnapshotSection::Annoy:
+                return std::make_shared<AnnoyTreeForest<T>>(store, snapshot);
+            default:
+                throw std::runtime_error("Snapshot holds an unknown algorithm.");
+        }
+    }
+
+public:
     /* Server Functionality */
 
     static void msg (const char* msg) { fprintf(stderr, "%s\n", msg); }
@@ -273,6 +947,7 @@ public:
             fd2conn.resize (conn->fd + 1);
         }
         fd2conn[conn->fd] = conn;
+        return 0;
     }
 
     static void fd_set_nb (int fd) {
@@ -326,14 +1001,49 @@ public:
     uint32_t create_collection (
         const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
     ) {
+        // Optional metric: l2 (default), ip / inner_product, or cosine
+        Metric metric = Metric::L2;
+        if (cmd.size() > 2 && !parseMetric(cmd[2], metric)) {
+            std::cout << "Unknown metric: " << cmd[2] << std::endl;
+            return RES_ERR;
+        }
+        // Optional storage type: f32 (default), f16 / fp16, or bf16
+        StorageType storage = StorageType::Float32;
+        if (cmd.size() > 3 && !parseStorageType(cmd[3], storage)) {
+            std::cout << "Unknown storage type: " << cmd[3] << std::endl;
+            return RES_ERR;
+        }
+
+        // Optional graph parameters: M, efc, layers, then "none" / "sq8" / "pq" codes to
+        // search on and a rerank factor
+        HnswParameters index;
+        try {
+            if (cmd.size() > 4) index.M = std::stoi(cmd[4]);
+            if (cmd.size() > 5) index.efc = std::stoi(cmd[5]);
+            if (cmd.size() > 6) index.num_layers = std::stoi(cmd[6]);
+            if (cmd.size() > 8) index.rerank_factor = std::stoi(cmd[8]);
+        } catch (...) {
+            std::cout << "Invalid index parameters" << std::endl;
+            return RES_ERR;
+        }
+        if (cmd.size() > 7 && !parseCompression(cmd[7], index.compression)) {
+            std::cout << "Unknown compression: " << cmd[7] << std::endl;
+            return RES_ERR;
+        }
+        if (index.M <= 0 || index.efc <= 0 || index.num_layers <= 0 || index.num_layers >= 255 || index.rerank_factor <= 0) {
+            std::cout << "Invalid index parameters" << std::endl;
+            return RES_ERR;
+        }
+
         // Check if the key already exists in the map
         if (collections.find(cmd[1]) == collections.end()) {
             // Key does not exist, so add it with a new empty vector
-            createCollection(cmd[1]);
+            createCollection(cmd[1], 5000, metric, storage, false, index);
             std::cout << "Added new entry with key: " << cmd[1] << std::endl;
             return RES_OK;
         } else {
             std::cout << "Key already exists: " << cmd[1] << std::endl;
+            return RES_ERR;
         }    
     }
 
@@ -365,18 +1075,127 @@ public:
             }
         }
 
-        // Add the new string and vector of floats as a pair to the specified collection
-        addToCollection(cmd[1], cmd[2], floats);
+        T key;
+        if (!parseKey(cmd[2], key)) {
+            std::cout << "Invalid key: " << cmd[2] << std::endl;
+            return RES_ERR;
+        }
+
+        // Add the new key and vector of floats as a pair to the specified collection. A
+        // key already there or a vector of another dimension is refused.
+        if (!addToCollection(cmd[1], key, floats)) {
+            std::cout << "Not added to collection: " << cmd[1] << std::endl;
+            return RES_ERR;
+        }
         std::cout << "Added to collection: " << cmd[1] << std::endl;
 
         // Success
         return RES_OK;
     }
 
+    uint32_t delete_from_collection(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        T key;
+        if (!parseKey(cmd[2], key)) {
+            std::cerr << "Invalid key: " << cmd[2] << std::endl;
+            return RES_ERR;
+        }
+        return deleteFromCollection(cmd[1], key) ? RES_OK : RES_NX;
+    }
+
+    uint32_t bulk_load(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        if (cmd_is(cmd[2], "begin")) {
+            return beginBulkLoad(cmd[1]) ? RES_OK : RES_NX;
+        }
+        if (cmd_is(cmd[2], "end")) {
+            return endBulkLoad(cmd[1]) ? RES_OK : RES_NX;
+        }
+        std::cerr << "Bulk load is begun or ended, not: " << cmd[2] << std::endl;
+        return RES_ERR;
+    }
+
+    uint32_t compact_collection(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        return compactCollection(cmd[1]) ? RES_OK : RES_NX;
+    }
+
+    uint32_t compaction_threshold(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        try {
+            setCompactionThreshold(std::stod(cmd[1]));
+        } catch (...) {
+            std::cerr << "Invalid compaction threshold: " << cmd[1] << std::endl;
+            return RES_ERR;
+        }
+        return RES_OK;
+    }
+
+    uint32_t reorder_collection(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        NodeOrdering ordering;
+        if (!parseNodeOrdering(cmd[2], ordering)) {
+            std::cerr << "Unknown node ordering: " << cmd[2] << std::endl;
+            return RES_ERR;
+        }
+        // Optional: the graph to order by, the collection's own by default
+        return reorderCollection(cmd[1], ordering, cmd.size() > 3 ? cmd[3] : "") ? RES_OK : RES_NX;
+    }
+
+    uint32_t node_ordering(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        NodeOrdering ordering;
+        if (!parseNodeOrdering(cmd[1], ordering)) {
+            std::cerr << "Unknown node ordering: " << cmd[1] << std::endl;
+            return RES_ERR;
+        }
+        setNodeOrdering(ordering);
+        return RES_OK;
+    }
+
+    uint32_t save_snapshot(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        return saveSnapshot(cmd[1]) ? RES_OK : RES_ERR;
+    }
+
+    uint32_t load_snapshot(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        return loadSnapshot(cmd[1]) ? RES_OK : RES_ERR;
+    }
+
+    uint32_t open_log(
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        // Optional sync policy: always (default), interval, or never; then the interval in ms
+        SyncPolicy policy = SyncPolicy::Always;
+        if (cmd.size() > 2 && !parseSyncPolicy(cmd[2], policy)) {
+            std::cerr << "Unknown sync policy: " << cmd[2] << std::endl;
+            return RES_ERR;
+        }
+        int intervalMs = 100;
+        if (cmd.size() > 3) {
+            try {
+                intervalMs = std::stoi(cmd[3]);
+            } catch (...) {
+                std::cerr << "Invalid sync interval: " << cmd[3] << std::endl;
+                return RES_ERR;
+            }
+        }
+        return openLog(cmd[1], policy, intervalMs) ? RES_OK : RES_ERR;
+    }
+
     uint32_t query_collection(
         const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
     ) {
-        if (cmd.size() < 3) {
+        if (cmd.size() < 4) {
             std::cerr << "Insufficient arguments" << std::endl;
             return 1; // Error code for insufficient arguments
         }
@@ -394,20 +1213,25 @@ public:
             }
         }
 
+        // How many results to return
+        int k = 0;
+        try {
+            k = std::stoi(cmd[3]);
+        } catch (...) {
+            std::cerr << "Invalid search parameters" << std::endl;
+            return RES_ERR;
+        }
+        if (k <= 0) {
+            std::cerr << "Invalid search parameters" << std::endl;
+            return RES_ERR;
+        }
+
         // Perform the search
-        auto searchResults = queryCollection(cmd[1], queryVec, std::stoi(cmd[3])); // Assuming we want the top 10 results
+        auto searchResults = queryCollectionRows(cmd[1], queryVec, k);
 
-        // Here, handle the searchResults according to your application's requirements
-        // This example just prepares a string value from the search results to send back
-        //std::string val = searchResults[0]->value.first; // Replace this with actual processing logic to extract value from searchResults
-        // Assuming searchResults is something like std::vector<YourResultType*>
-        std::string val;
-        for (auto& result : searchResults) {
-            if (!val.empty()) {
-                val += "\n"; // Add a newline between strings, but not before the first string
-            }
-            val += result.first; // Append the current string
-        }
+        // The results are row ids; only their keys are copied, into the response
+        auto it = collections.find(cmd[1]);
+        std::string val = keyLines(it == collections.end() ? nullptr : it->second.store.get(), searchResults);
         assert(val.size() <= k_max_msg);
         memcpy(res, val.data(), val.size());
         *reslen = (uint32_t) val.size();
@@ -418,7 +1242,7 @@ public:
     uint32_t queryAlg(
         const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
     ) {
-        if (cmd.size() < 3) {
+        if (cmd.size() < 4) {
             std::cerr << "Insufficient arguments" << std::endl;
             return 1; // Error code for insufficient arguments
         }
@@ -436,20 +1260,28 @@ public:
             }
         }
 
+        // Optional: the search list size and beam width, trading queries per second for
+        // recall on this request alone
+        int ef = 0;
+        SearchOptions options;
+        try {
+            ef = std::stoi(cmd[3]);
+            if (cmd.size() > 4) options.listSize = std::stoi(cmd[4]);
+            if (cmd.size() > 5) options.beamWidth = std::stoi(cmd[5]);
+        } catch (...) {
+            std::cerr << "Invalid search parameters" << std::endl;
+            return RES_ERR;
+        }
+        if (ef <= 0 || options.listSize < 0 || options.beamWidth < 0) {
+            std::cerr << "Invalid search parameters" << std::endl;
+            return RES_ERR;
+        }
+
         // Perform the search
-        auto searchResults = queryAlgorithm(cmd[1], queryVec, std::stoi(cmd[3])); // Assuming we want the top 10 results
+        auto searchResults = queryAlgorithmRows(cmd[1], queryVec, ef, options);
 
-        // Here, handle the searchResults according to your application's requirements
-        // This example just prepares a string value from the search results to send back
-        //std::string val = searchResults[0]->value.first; // Replace this with actual processing logic to extract value from searchResults
-        // Assuming searchResults is something like std::vector<YourResultType*>
-        std::string val;
-        for (auto& result : searchResults) {
-            if (!val.empty()) {
-                val += "\n"; // Add a newline between strings, but not before the first string
-            }
-            val += result.first; // Append the current string
-        }
+        // The results are row ids; only their keys are copied, into the response
+        std::string val = keyLines(algorithmStore(cmd[1]).get(), searchResults);
         assert(val.size() <= k_max_msg);
         memcpy(res, val.data(), val.size());
         *reslen = (uint32_t) val.size();
@@ -496,21 +1328,45 @@ public:
     uint32_t addHNSW (
         const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
     ) {
-        if (cmd.size() < 6) {
+        if (cmd.size() < 7) {
             std::cerr << "Insufficient arguments" << std::endl;
             return 1; // Error code for insufficient arguments
         }
 
         std::string collectionName = cmd[1];
         std::string algName = cmd[2];
-        float mL = std::stof(cmd[3]);
-        int vector_len = std::stoi(cmd[4]); 
-        int num_layers = std::stoi(cmd[5]); 
-        int efc = std::stoi(cmd[6]); 
+        float mL = 0;
+        int vector_len = 0, num_layers = 0, efc = 0;
+        // Optional: M, the most neighbors a node keeps per layer (twice that in the bottom one)
+        int M = 16;
+        // Optional: threads to build with, 0 for every core
+        int threads = 0;
+        // Optional: "none", "sq8" or "pq" codes to search on, then a rerank factor
+        Compression compression = Compression::None;
+        int rerank_factor = 4;
+        try {
+            mL = std::stof(cmd[3]);
+            vector_len = std::stoi(cmd[4]);
+            num_layers = std::stoi(cmd[5]);
+            efc = std::stoi(cmd[6]);
+            if (cmd.size() > 7) M = std::stoi(cmd[7]);
+            if (cmd.size() > 8) threads = std::stoi(cmd[8]);
+            if (cmd.size() > 10) rerank_factor = std::stoi(cmd[10]);
+        } catch (...) {
+            std::cerr << "Invalid index parameters" << std::endl;
+            return RES_ERR;
+        }
+        if (cmd.size() > 9 && !parseCompression(cmd[9], compression)) {
+            std::cerr << "Unknown compression: " << cmd[9] << std::endl;
+            return 1;
+        }
 
         std::cout << "Building HNSW for " << collectionName << std::endl;
 
-        addAlgorithm<HNSW_graph<std::string>>(algName, collectionName, mL, vector_len, num_layers, efc);
+        if (addRequestedAlgorithm<HNSW_graph<T>>(algName, collectionName, mL, vector_len, num_layers, efc, M, threads,
+                                                 std::mt19937::default_seed, compression, rerank_factor) != RES_OK) {
+            return RES_ERR;
+        }
 
         std::cout << "HNSW graph built for collection: " << collectionName << std::endl;
 
@@ -527,15 +1383,25 @@ public:
 
         std::string collectionName = cmd[1];
         std::string algName = cmd[2];
-        int vector_len = std::stoi(cmd[3]); 
-        float sufficient_bucket_threshold = std::stoi(cmd[5]);
-        int max_depth = std::stoi(cmd[6]); 
-        int n_trees = std::stoi(cmd[7]); 
-        float threshold = std::stof(cmd[4]);
+        int vector_len = 0, max_depth = 0, n_trees = 0;
+        float sufficient_bucket_threshold = 0, threshold = 0;
+        try {
+            vector_len = std::stoi(cmd[3]);
+            sufficient_bucket_threshold = std::stoi(cmd[5]);
+            max_depth = std::stoi(cmd[6]);
+            n_trees = std::stoi(cmd[7]);
+            threshold = std::stof(cmd[4]);
+        } catch (...) {
+            std::cerr << "Invalid index parameters" << std::endl;
+            return RES_ERR;
+        }
 
         std::cout << "Building ANNOY for " << collectionName << std::endl;
 
-        addAlgorithm<AnnoyTreeForest<std::string>>(algName, collectionName, vector_len, threshold, sufficient_bucket_threshold, max_depth, n_trees, true);
+        if (addRequestedAlgorithm<AnnoyTreeForest<T>>(algName, collectionName, vector_len, threshold, sufficient_bucket_threshold,
+                                                      max_depth, n_trees, true) != RES_OK) {
+            return RES_ERR;
+        }
 
         std::cout << "ANNOY built for collection: " << collectionName << std::endl;
 
@@ -545,20 +1411,33 @@ public:
     uint32_t addIFI (
         const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
     ) {
-        if (cmd.size() < 5) {
+        if (cmd.size() < 6) {
             std::cerr << "Insufficient arguments" << std::endl;
             return 1; // Error code for insufficient arguments
         }
 
         std::string collectionName = cmd[1];
         std::string algName = cmd[2];
-        int vector_length = std::stoi(cmd[3]);
-        int num_centroids = std::stoi(cmd[4]); // Adjust according to your needs
-        int retrain_threshold = std::stoi(cmd[5]); // Adjust according to your needs
+        int vector_length = 0, num_centroids = 0, retrain_threshold = 0;
+        // Optional: "sq8" to search 8-bit codes, then a rerank factor (0 keeps only the codes)
+        bool quantized = cmd.size() > 6 && cmd_is(cmd[6], "sq8");
+        int rerank_factor = 0;
+        try {
+            vector_length = std::stoi(cmd[3]);
+            num_centroids = std::stoi(cmd[4]); // Adjust according to your needs
+            retrain_threshold = std::stoi(cmd[5]); // Adjust according to your needs
+            if (cmd.size() > 7) rerank_factor = std::stoi(cmd[7]);
+        } catch (...) {
+            std::cerr << "Invalid index parameters" << std::endl;
+            return RES_ERR;
+        }
 
         std::cout << "Building InvertedFileIndex for " << collectionName << std::endl;
 
-        addAlgorithm<InvertedFileIndex<std::string>>(algName, collectionName, vector_length, num_centroids, retrain_threshold);
+        if (addRequestedAlgorithm<InvertedFileIndex<T>>(algName, collectionName, vector_length, num_centroids, retrain_threshold,
+                                                        quantized, rerank_factor) != RES_OK) {
+            return RES_ERR;
+        }
 
         std::cout << "InvertedFileIndex built for collection: " << collectionName << std::endl;
 
@@ -568,26 +1447,97 @@ public:
     uint32_t addVamana (
         const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
     ) {
-        if (cmd.size() < 5) {
+        if (cmd.size() < 6) {
             std::cerr << "Insufficient arguments" << std::endl;
             return 1; // Error code for insufficient arguments
         }
         
         std::string collectionName = cmd[1];
         std::string algName = cmd[2];
-        int vector_length = std::stoi(cmd[3]);
-        int num_edges = std::stoi(cmd[4]);
-        float alpha = std::stof(cmd[5]);
+        int vector_length = 0, num_edges = 0;
+        float alpha = 0;
+        // Optional: "none", "sq8" or "pq" codes to search on, then a rerank factor
+        Compression compression = Compression::None;
+        int rerank_factor = 4;
+        // Optional: the build's search list size and thread count (0 for every core)
+        int build_list = 100;
+        int threads = 0;
+        try {
+            vector_length = std::stoi(cmd[3]);
+            num_edges = std::stoi(cmd[4]);
+            alpha = std::stof(cmd[5]);
+            if (cmd.size() > 7) rerank_factor = std::stoi(cmd[7]);
+            if (cmd.size() > 8) build_list = std::stoi(cmd[8]);
+            if (cmd.size() > 9) threads = std::stoi(cmd[9]);
+        } catch (...) {
+            std::cerr << "Invalid index parameters" << std::endl;
+            return RES_ERR;
+        }
+        if (cmd.size() > 6 && !parseCompression(cmd[6], compression)) {
+            std::cerr << "Unknown compression: " << cmd[6] << std::endl;
+            return 1;
+        }
         
         std::cout << "Building Vamana for " << collectionName << std::endl;
 
-        addAlgorithm<Vamana<std::string>>(algName, collectionName, alpha, vector_length, num_edges);
+        if (addRequestedAlgorithm<Vamana<T>>(algName, collectionName, alpha, vector_length, num_edges, 1, compression,
+                                             rerank_factor, build_list, threads) != RES_OK) {
+            return RES_ERR;
+        }
 
         std::cout << "Vamana built for collection: " << collectionName << std::endl;
 
         return RES_OK; // Success
     }
 
+    uint32_t addDiskVamana (
+        const std::vector<std::string>& cmd, uint8_t* res, uint32_t* reslen
+    ) {
+        if (cmd.size() < 6) {
+            std::cerr << "Insufficient arguments" << std::endl;
+            return 1; // Error code for insufficient arguments
+        }
+
+        std::string collectionName = cmd[1];
+        std::string algName = cmd[2];
+        // The file is named relative to the index directory, and can't leave it
+        std::string path;
+        if (!indexPath(cmd[3], path)) {
+            std::cerr << "Invalid index file name: " << cmd[3] << std::endl;
+            return RES_ERR;
+        }
+        int num_edges = 0;
+        float alpha = 0;
+        // Optional: the build's search list size, the blocks a search reads per step,
+        // the threads reading them and the nodes cached around the medoid
+        int build_list = 100;
+        int beam_width = 4;
+        int io_threads = 4;
+        int cache_nodes = 1024;
+        try {
+            num_edges = std::stoi(cmd[4]);
+            alpha = std::stof(cmd[5]);
+            if (cmd.size() > 6) build_list = std::stoi(cmd[6]);
+            if (cmd.size() > 7) beam_width = std::stoi(cmd[7]);
+            if (cmd.size() > 8) io_threads = std::stoi(cmd[8]);
+            if (cmd.size() > 9) cache_nodes = std::stoi(cmd[9]);
+        } catch (...) {
+            std::cerr << "Invalid index parameters" << std::endl;
+            return RES_ERR;
+        }
+
+        std::cout << "Building disk Vamana for " << collectionName << " at " << path << std::endl;
+
+        if (addRequestedAlgorithm<DiskVamana<T>>(algName, collectionName, path, alpha, num_edges, build_list, beam_width,
+                                                 io_threads, cache_nodes) != RES_OK) {
+            return RES_ERR;
+        }
+
+        std::cout << "Disk Vamana built for collection: " << collectionName << std::endl;
+
+        return RES_OK; // Success
+    }
+
     static int32_t parse_req(
         const uint8_t* data, size_t len, std::vector<std::string>& out)
     {
@@ -630,17 +1580,55 @@ public:
             *rescode = query_collection(cmd, res, reslen);
         }    
         // Handling "create_collection" command for creating a new collection
-        else if (cmd.size() == 2 && cmd_is(cmd[0], "create_collection")) {
+        else if (cmd.size() >= 2 && cmd.size() <= 9 && cmd_is(cmd[0], "create_collection")) {
             *rescode = create_collection(cmd, res, reslen);
         }
         // Handling "add_to_collection" command for adding to an existing collection
         else if (cmd.size() >= 4 && cmd_is(cmd[0], "add_to_collection")) {
             *rescode = add_to_collection(cmd, res, reslen);
         }
+        // Deleting marks the row; "compact" removes a collection's deleted rows right away,
+        // and "compaction_threshold" sets the deleted fraction that triggers it on its own
+        else if (cmd.size() == 3 && cmd_is(cmd[0], "delete_from_collection")) {
+            *rescode = delete_from_collection(cmd, res, reslen);
+        }
+        // Between "bulk_load <collection> begin" and "... end", adds only go to the store
+        // and the collection's indexes take them all at the end
+        else if (cmd.size() == 3 && cmd_is(cmd[0], "bulk_load")) {
+            *rescode = bulk_load(cmd, res, reslen);
+        }
+        else if (cmd.size() == 2 && cmd_is(cmd[0], "compact")) {
+            *rescode = compact_collection(cmd, res, reslen);
+        }
+        else if (cmd.size() == 2 && cmd_is(cmd[0], "compaction_threshold")) {
+            *rescode = compaction_threshold(cmd, res, reslen);
+        }
+        // "reorder" lays a collection's rows out along a graph's edges (bfs, rcm or gorder);
+        // "node_ordering" does it after every graph build and before every SAVE
+        else if (cmd.size() >= 3 && cmd.size() <= 4 && cmd_is(cmd[0], "reorder")) {
+            *rescode = reorder_collection(cmd, res, reslen);
+        }
+        else if (cmd.size() == 2 && cmd_is(cmd[0], "node_ordering")) {
+            *rescode = node_ordering(cmd, res, reslen);
+        }
+        else if (cmd.size() >= 2 && cmd.size() <= 4 && cmd_is(cmd[0], "open_log")) {
+            *rescode = open_log(cmd, res, reslen);
+        }
+        // Snapshots of every collection and algorithm, to restart without rebuilding
+        else if (cmd.size() == 2 && cmd_is(cmd[0], "SAVE")) {
+            *rescode = save_snapshot(cmd, res, reslen);
+        }
+        else if (cmd.size() == 2 && cmd_is(cmd[0], "LOAD")) {
+            *rescode = load_snapshot(cmd, res, reslen);
+        }
         // Commands for buildings algorithms from collections
         else if (cmd.size() >= 4 && cmd_is(cmd[0], "Vamana")) {
             *rescode = addVamana(cmd, res, reslen);
         }
+        // DiskVamana <collection> <name> <file> <R> <alpha> [L] [beam width] [I/O threads] [cached nodes]
+        else if (cmd.size() >= 6 && cmd_is(cmd[0], "DiskVamana")) {
+            *rescode = addDiskVamana(cmd, res, reslen);
+        }
         else if (cmd.size() >= 4 && cmd_is(cmd[0], "HNSW")) {
             *rescode = addHNSW(cmd, res, reslen);
         }
@@ -650,6 +1638,7 @@ public:
         else if (cmd.size() >= 4 && cmd_is(cmd[0], "ANNOY")) {
             *rescode = addANNOY(cmd, res, reslen);
         }
+        // queryAlg <name> <vector> <k> [list size] [beam width]
         else if (cmd.size() >= 4 && cmd_is(cmd[0], "queryAlg")) {
             *rescode = queryAlg(cmd, res, reslen);
         }
@@ -731,7 +1720,11 @@ public:
         conn->rbuf_size = remain;
 
         conn->state = STATE_RES;
-        state_res (conn);
+        // A change logged to be synced is only acknowledged once the serve loop has
+        // synced the log, which it does once for all the requests of a round
+        if (!log || !log->unsynced()) {
+            state_res (conn);
+        }
 
         return (conn->state == STATE_REQ);
     }
@@ -777,6 +1770,8 @@ public:
             state_req (conn);
         } else if ( conn->state == STATE_RES) {
             state_res (conn);
+            // Requests that arrived behind a held-back response
+            while (conn->state == STATE_REQ && try_one_request (conn)) {}
         } else {
             assert (0); // Error encountered
         }
@@ -808,6 +1803,8 @@ public:
         fd_set_nb (fd);
 
         std::vector<struct pollfd> poll_args;
+        // Compactions still under way; while there are any, poll doesn't wait for requests
+        size_t compacting = 0;
         while (true) {
             mtx.lock();
             poll_args.clear();
@@ -824,7 +1821,7 @@ public:
                 poll_args.push_back (pfd);
             }
 
-            int rv = poll (poll_args.data(), (nfds_t) poll_args.size(), 1000);
+            int rv = poll (poll_args.data(), (nfds_t) poll_args.size(), compacting > 0 ? 0 : 1000);
             if (rv < 0) { die ("Poll failed in while loop."); }
 
             for ( size_t i = 1; i < poll_args.size(); ++i ) { 
@@ -840,6 +1837,18 @@ public:
             }
 
             if (poll_args[0].revents) {accept_new_conn (fd2conn, fd); }
+
+            // One sync covers every change made this round; the responses held back
+            // for it go out when their connections poll writable
+            try {
+                syncLog();
+            } catch (const std::exception& e) {
+                die(e.what());
+            }
+
+            // Collections with enough deleted rows are compacted between requests, a
+            // bounded step per round, so no request waits on a whole compaction
+            compacting = compactDueCollections();
             mtx.unlock();
         }
     }